@@ -14,6 +14,10 @@ extern "C" {
 #endif
 
 #include "TelnetSpy.h"
+#ifndef ESP8266
+#include <errno.h>
+#include <lwip/sockets.h>
+#endif
 
 #ifndef min
 #define min(a,b) ((a)<(b)?(a):(b))
@@ -43,6 +47,10 @@ TelnetSpy::TelnetSpy() {
 	usedSer = &Serial;
 	storeOffline = true;
 	connected = false;
+	clientCount = 0;
+	for (int i = 0; i < TELNETSPY_MAX_CLIENTS; i++) {
+		clients[i].active = false;
+	}
 	callbackConnect = NULL;
 	callbackDisconnect = NULL;
 	welcomeMsg = strdup(TELNETSPY_WELCOME_MSG);
@@ -51,10 +59,6 @@ TelnetSpy::TelnetSpy() {
 	collectingTime = TELNETSPY_COLLECTING_TIME;
 	maxBlockSize = TELNETSPY_MAX_BLOCK_SIZE;
 	pingTime = TELNETSPY_PING_TIME;
-	pingRef = 0xFFFFFFFF;
-	waitRef = 0xFFFFFFFF; 
-	telnetBuf = NULL;
-	bufLen = 0;
 	uint16_t size = TELNETSPY_BUFFER_LEN;
 	while (!setBufferSize(size)) {
 		size = size >> 1;
@@ -76,20 +80,17 @@ TelnetSpy::~TelnetSpy() {
 void TelnetSpy::setPort(uint16_t portToUse) {
 	port = portToUse;
 	if (listening) {
-		if (client.connected()) {
-			client.flush();
-			client.stop();
-		}
-		if (connected && (callbackDisconnect != NULL)) {
-			callbackDisconnect();
+		for (int i = 0; i < TELNETSPY_MAX_CLIENTS; i++) {
+			if (clients[i].active) {
+				dropClient(clients[i]);
+			}
 		}
-		connected = false;
 		telnetServer->close();
 		delete telnetServer;
 		telnetServer = new WiFiServer(port);
 		if (started) {
 			telnetServer->begin();
-			telnetServer->setNoDelay(bufLen > 0);
+			telnetServer->setNoDelay(ring.size() > 0);
 		}
 	}
 }
@@ -121,86 +122,59 @@ void TelnetSpy::setMaxBlockSize(uint16_t maxSize) {
 }
 
 bool TelnetSpy::setBufferSize(uint16_t newSize) {
-	if (telnetBuf && (bufLen == newSize)) {
+	if (ring.size() == newSize) {
 		return true;
 	}
 	if (newSize == 0) {
-		bufLen = 0;
-		if (telnetBuf) {
-			free(telnetBuf);
-			telnetBuf = NULL;
-		}
+		ring.resize(0);
 		if (telnetServer) {
 			telnetServer->setNoDelay(false);
 		}
 		return true;
 	}
 	newSize = max(newSize, minBlockSize);
-	uint16_t oldBufLen = bufLen;
-	bufLen = newSize;
-	uint16_t tmp;
-	if (!telnetBuf || (bufUsed == 0)) {
-		bufRdIdx = 0;
-		bufWrIdx = 0;
-		bufUsed = 0;
-	} else {
-		if (bufLen < oldBufLen) {
-			if (bufRdIdx < bufWrIdx) {
-				if (bufWrIdx > bufLen) {
-					tmp = min(bufLen, (uint16_t) (bufWrIdx - max(bufLen, bufRdIdx)));
-					memcpy(telnetBuf, &telnetBuf[bufWrIdx - tmp], tmp);
-					bufWrIdx = tmp;
-					if (bufWrIdx > bufRdIdx) {
-						bufRdIdx = bufWrIdx;
-					} else {
-						if (bufRdIdx > bufLen) {
-							bufRdIdx = 0;
-						}
-					}
-					if (bufRdIdx == bufWrIdx) {
-						bufUsed = bufLen;
-					} else {
-						bufUsed = bufWrIdx - bufRdIdx;
-					}
-				}
-			} else {
-				if (bufWrIdx > bufLen) {
-					memcpy(telnetBuf, &telnetBuf[bufWrIdx - bufLen], bufLen);
-					bufRdIdx = 0;
-					bufWrIdx = 0;
-					bufUsed = bufLen;
-				} else {
-					tmp = min(bufLen - bufWrIdx, oldBufLen - bufRdIdx);
-					memcpy(&telnetBuf[bufLen - tmp], &telnetBuf[oldBufLen - tmp], tmp);
-					bufRdIdx = bufLen - tmp;
-					bufUsed = bufWrIdx + tmp;
-				}
-			}
-		}
-	}
-	char* temp = (char*) realloc(telnetBuf, bufLen);
-	if (!temp) {
+	if (!ring.resize(newSize)) {
 		return false;
 	}
-	telnetBuf = temp;
-	if (telnetBuf && (bufLen > oldBufLen) && (bufRdIdx > bufWrIdx)) {
-		tmp = bufLen - (oldBufLen - bufRdIdx);
-		memcpy(&telnetBuf[tmp], &telnetBuf[bufRdIdx], oldBufLen - bufRdIdx);
-		bufRdIdx = tmp;
-	}
 	if (telnetServer) {
 		telnetServer->setNoDelay(true);
 	}
 	return true;
 }
 
-uint16_t TelnetSpy::getBufferSize() {
-	if (!telnetBuf) {
-		return 0;
+uint32_t TelnetSpy::getBufferSize() {
+	return ring.size();
+}
+
+#if defined(ESP8266) || TELNETSPY_LOCK_FREE
+
+bool TelnetSpy::setBacklogSize(uint32_t size) {
+	return false;
+}
+
+#else // ESP32
+
+bool TelnetSpy::setBacklogSize(uint32_t size) {
+	if (!lines.resize(size / TELNETSPY_BACKLOG_LINE_LEN, ps_malloc)) {
+		return false;
+	}
+	if (!ring.resize(size, ps_malloc)) {
+		lines.resize(0);
+		return false;
 	}
-	return bufLen;
+	// what was collected before has no time, it counts as written at boot
+	const char* block;
+	uint32_t pos = ring.tailPos();
+	size_t n;
+	while ((n = ring.peekAt(pos, &block, size)) > 0) {
+		lines.add(pos, (const uint8_t*) block, n, 0);
+		pos += n;
+	}
+	return true;
 }
 
+#endif
+
 void TelnetSpy::setStoreOffline(bool store) {
 	storeOffline = store;
 }
@@ -211,11 +185,6 @@ bool TelnetSpy::getStoreOffline() {
 
 void TelnetSpy::setPingTime(uint16_t pngTime) {
 	pingTime = pngTime;
-	if (pingTime == 0) {
-		pingRef = 0xFFFFFFFF;
-	} else {
-		pingRef = (millis() & 0x7FFFFFF) + pingTime;
-	}
 }
 
 void TelnetSpy::setSerial(HardwareSerial* usedSerial) {
@@ -223,36 +192,34 @@ void TelnetSpy::setSerial(HardwareSerial* usedSerial) {
 }
 
 size_t TelnetSpy::write (uint8_t data) {
-	if (telnetBuf) {
-		if (storeOffline || client.connected()) {
-			if (bufUsed == bufLen) {
-				if (client.connected()) {
-					sendBlock();
-				}
-				if (bufUsed == bufLen) {
-					char c;
-					while (bufUsed > 0) {
-						c = pullTelnetBuf();
-						if (c == '\n') {
-							break;
-						}
-					}
-					if (peekTelnetBuf() == '\r') {
-						pullTelnetBuf();
-					}
-				}
+	return write(&data, 1);
+}
+
+size_t TelnetSpy::write (const uint8_t* data, size_t size) {
+	if (ring.size()) {
+		if (storeOffline || (clientCount > 0)) {
+			uint32_t ms = millis();
+CRITCAL_SECTION_START
+			uint32_t pos = ring.headPos();
+			ring.write(data, size);
+			if (lines.size()) {
+				// only the end of data is held if it is larger than the ring
+				uint32_t held = ring.headPos() - pos;
+				lines.add(pos, data + size - held, held, ms);
 			}
-			addTelnetBuf(data);
+CRITCAL_SECTION_END
 		}
 	} else {
-		if (client.connected()) {
-			client.write(data);
+		for (int i = 0; i < TELNETSPY_MAX_CLIENTS; i++) {
+			if (clients[i].active) {
+				trySend(clients[i].client, (const char*) data, size);
+			}
 		}
 	}
 	if (usedSer) {
-		return usedSer->write(data);
+		return usedSer->write(data, size);
 	}
-	return 1;
+	return size;
 }
     
 int TelnetSpy::available (void) {
@@ -262,8 +229,9 @@ int TelnetSpy::available (void) {
 			return avail;
 		}
 	}
-	if (client.connected()) {
-		return telnetAvailable();
+	WiFiClient* c = inputClient();
+	if (c) {
+		return telnetAvailable(*c);
 	}
 	return 0;
 }
@@ -276,12 +244,11 @@ int TelnetSpy::read (void) {
 			return val;
 		}
 	}
-	if (client.connected()) {
-		if (telnetAvailable()) {
-			val = client.read();
-		}
+	WiFiClient* c = inputClient();
+	if (c) {
+		return c->read();
 	}
-	return val;
+	return -1;
 }
     
 int TelnetSpy::peek (void) {
@@ -292,12 +259,11 @@ int TelnetSpy::peek (void) {
 			return val;
 		}
 	}
-	if (client.connected()) {
-		if (telnetAvailable()) {
-			val = client.peek();
-		}
+	WiFiClient* c = inputClient();
+	if (c) {
+		return c->peek();
 	}
-	return val;
+	return -1;
 }
     
 void TelnetSpy::flush (void) {
@@ -333,14 +299,11 @@ void TelnetSpy::end() {
 	if (usedSer) {
 		usedSer->end();
 	}
-	if (client.connected()) {
-		client.flush();
-		client.stop();
+	for (int i = 0; i < TELNETSPY_MAX_CLIENTS; i++) {
+		if (clients[i].active) {
+			dropClient(clients[i]);
+		}
 	}
-	if (connected && (callbackDisconnect != NULL)) {
-		callbackDisconnect();
-	}	
-	connected = false;
 	telnetServer->close();
 	delete telnetServer;
 	telnetServer = NULL;
@@ -386,9 +349,9 @@ bool TelnetSpy::isRxEnabled(void) {
 
 int TelnetSpy::availableForWrite(void) {
 	if (usedSer) {
-		return min(usedSer->availableForWrite(), bufLen - bufUsed);
+		return min(usedSer->availableForWrite(), (int) ring.space());
 	}
-	return bufLen - bufUsed;
+	return ring.space();
 }
 
 TelnetSpy::operator bool() const {
@@ -428,80 +391,207 @@ uint32_t TelnetSpy::baudRate(void) {
 	return 115200;
 }
 
-void TelnetSpy::sendBlock() {
+void TelnetSpy::acceptClient() {
+	if (!telnetServer->hasClient()) {
+		return;
+	}
+	TelnetSpyClient* c = NULL;
+	for (int i = 0; i < TELNETSPY_MAX_CLIENTS; i++) {
+		if (!clients[i].active) {
+			c = &clients[i];
+			break;
+		}
+	}
+	if (!c) {
+		WiFiClient rejectClient = telnetServer->available();
+		if (strlen(rejectMsg) > 0) {
+			rejectClient.write((const uint8_t*) rejectMsg, strlen(rejectMsg));
+		}
+		rejectClient.flush();
+		rejectClient.stop();
+		return;
+	}
+	c->client = telnetServer->available();
+	if (strlen(welcomeMsg) > 0) {
+		c->client.write((const uint8_t*) welcomeMsg, strlen(welcomeMsg));
+	}
+	c->active = true;
 CRITCAL_SECTION_START
-	uint16_t len = bufUsed;
-	if (len > maxBlockSize) {
-		len = maxBlockSize;
+	if (lines.size()) {
+		c->cursor = lines.lastLines(TELNETSPY_CONNECT_LINES, ring.tailPos(), ring.headPos());
+	} else {
+		c->cursor = ring.tailPos();
 	}
-	len = min(len, (uint16_t) (bufLen - bufRdIdx));
-	uint16_t idx = bufRdIdx;
 CRITCAL_SECTION_END
-	client.write(&telnetBuf[idx], len);
-CRITCAL_SECTION_START
-	bufRdIdx += len;
-	if (bufRdIdx >= bufLen) {
-		bufRdIdx = 0;
+	c->cmdLen = 0;
+	c->waiting = false;
+	c->stalled = false;
+	c->sentRef = millis();
+	if (clientCount++ == 0) {
+		connected = true;
+		if (callbackConnect != NULL) {
+			callbackConnect();
+		}
+	}
+}
+
+// Sends the client what its TCP send buffer takes: one block, or blocks up to
+// TELNETSPY_BURST_SIZE while it is catching up. The block is copied out under
+// the lock, as a write() may drop and overwrite it while it is being sent.
+void TelnetSpy::serviceClient(TelnetSpyClient& c) {
+	if (!c.client.connected()) {
+		dropClient(c);
+		return;
+	}
+	if (lines.size()) {
+		readCommand(c);
 	}
-	bufUsed -= len;
-	if (bufUsed == 0) {
-		bufRdIdx = 0;
-		bufWrIdx = 0;
+	unsigned long m = millis();
+CRITCAL_SECTION_START
+	if ((int32_t) (c.cursor - ring.tailPos()) < 0) {
+		// its data was dropped, go on with the oldest line still held
+		c.cursor = ring.tailPos();
+	}
+	uint32_t pending = ring.headPos() - c.cursor;
+	size_t burst = pending > maxBlockSize ? TELNETSPY_BURST_SIZE : maxBlockSize;
+	if (burst > sizeof(sendBuf)) {
+		burst = sizeof(sendBuf);
+	}
+	size_t len = 0;
+	if (pending > 0) {
+		if ((pending < minBlockSize) && !c.waiting) {
+			c.waiting = true;
+			c.waitRef = m;
+		}
+		// less than minBlockSize is only sent after collectingTime
+		if ((pending >= minBlockSize) || (m - c.waitRef >= collectingTime)) {
+			len = ring.copyAt(c.cursor, sendBuf, burst);
+		}
 	}
 CRITCAL_SECTION_END
-	waitRef = 0xFFFFFFFF;
-	if (pingRef != 0xFFFFFFFF) {
-		pingRef = (millis() & 0x7FFFFFF) + pingTime;
-		if (pingRef > 0x7FFFFFFF) {
-			pingRef -= 0x80000000;
+	if (pending == 0) {
+		c.waiting = false;
+		c.stalled = false;
+		if ((pingTime != 0) && (m - c.sentRef >= pingTime)) {
+			// a chr(0) to detect a disconnect earlier
+			const char ping = 0;
+			if (trySend(c.client, &ping, 1) < 0) {
+				dropClient(c);
+				return;
+			}
+			c.sentRef = m;
+		}
+		return;
+	}
+	if (len == 0) {
+		return;
+	}
+	int sent = trySend(c.client, sendBuf, len);
+	if (sent < 0) {
+		dropClient(c);
+		return;
+	}
+	if (sent == 0) {
+		if (!c.stalled) {
+			c.stalled = true;
+			c.stallRef = m;
+		} else if (m - c.stallRef >= TELNETSPY_STALL_TIME) {
+			dropClient(c);
+		}
+		return;
+	}
+	c.cursor += sent;
+	c.waiting = false;
+	c.stalled = false;
+	c.sentRef = m;
+}
+
+// Collects the characters typed by the client and runs each line.
+void TelnetSpy::readCommand(TelnetSpyClient& c) {
+	while (telnetAvailable(c.client) > 0) {
+		int ch = c.client.read();
+		if ((ch == '\r') || (ch == '\n')) {
+			if (c.cmdLen > 0) {
+				c.cmd[c.cmdLen] = 0;
+				runCommand(c);
+				c.cmdLen = 0;
+			}
+		} else if ((ch > 0) && (c.cmdLen < TELNETSPY_CMD_LEN - 1)) {
+			c.cmd[c.cmdLen++] = ch;
 		}
 	}
 }
 
-void TelnetSpy::addTelnetBuf(char c) {
+void TelnetSpy::runCommand(TelnetSpyClient& c) {
+	unsigned long n;
+	bool known = true;
 CRITCAL_SECTION_START
-	telnetBuf[bufWrIdx] = c;
-	if (bufUsed == bufLen) {
-		bufRdIdx++;
-		if (bufRdIdx >= bufLen) {
-			bufRdIdx = 0;
-		}
+	if (sscanf(c.cmd, "last %lu", &n) == 1) {
+		c.cursor = lines.lastLines(n, ring.tailPos(), ring.headPos());
+	} else if (sscanf(c.cmd, "since %lu", &n) == 1) {
+		c.cursor = lines.since(n * 1000, ring.tailPos(), ring.headPos());
+	} else if (strcmp(c.cmd, "live") == 0) {
+		c.cursor = ring.headPos();
 	} else {
-		bufUsed++;
-	}
-	bufWrIdx++;
-	if (bufWrIdx >= bufLen) {
-		bufWrIdx = 0;
+		known = false;
 	}
 CRITCAL_SECTION_END
+	c.waiting = false;
+	if (!known) {
+		const char* help = "TelnetSpy: last <lines> | since <seconds after boot> | live\r\n";
+		trySend(c.client, help, strlen(help));
+	}
 }
 
-char TelnetSpy::pullTelnetBuf() {
-	if (bufUsed == 0) {
+void TelnetSpy::dropClient(TelnetSpyClient& c) {
+	c.client.flush();
+	c.client.stop();
+	c.active = false;
+	if (--clientCount == 0) {
+		connected = false;
+		if (callbackDisconnect != NULL) {
+			callbackDisconnect();
+		}
+	}
+}
+
+// Writes what the client's TCP send buffer takes without waiting for it.
+// Returns the number of bytes taken or -1 if the connection is gone.
+int TelnetSpy::trySend(WiFiClient& c, const char* data, size_t len) {
+#ifdef ESP8266
+	size_t n = min(len, (size_t) c.availableForWrite());
+	if (n == 0) {
 		return 0;
 	}
-CRITCAL_SECTION_START
-	char c = telnetBuf[bufRdIdx++]; 
-	if (bufRdIdx >= bufLen) {
-		bufRdIdx = 0;
+	return c.write((const uint8_t*) data, n);
+#else // ESP32
+	// WiFiClient::write() retries and waits while the window is full
+	int n = send(c.fd(), data, len, MSG_DONTWAIT);
+	if (n >= 0) {
+		return n;
 	}
-	bufUsed--;
-CRITCAL_SECTION_END
-	return c;
+	if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+		return 0;
+	}
+	return -1;
+#endif
 }
 
-char TelnetSpy::peekTelnetBuf() {
-	if (bufUsed == 0) {
-		return 0;
+// The first client with input waiting, NULL if there is none. With a backlog
+// the input is commands for it instead.
+WiFiClient* TelnetSpy::inputClient() {
+	if (lines.size()) {
+		return NULL;
 	}
-CRITCAL_SECTION_START
-char c = telnetBuf[bufRdIdx]; 
-CRITCAL_SECTION_END
-//	return telnetBuf[bufRdIdx]; 
-return c;
+	for (int i = 0; i < TELNETSPY_MAX_CLIENTS; i++) {
+		if (clients[i].active && clients[i].client.connected() && (telnetAvailable(clients[i].client) > 0)) {
+			return &clients[i].client;
+		}
+	}
+	return NULL;
 }
 
-int TelnetSpy::telnetAvailable() {
+int TelnetSpy::telnetAvailable(WiFiClient& client) {
 	int n = client.available();
 	while (n > 0) {
 		if (0xff == client.peek()) {  // If esc char for telnet NVT protocol data remove that telegram:
@@ -525,6 +615,10 @@ bool TelnetSpy::isClientConnected() {
 	return connected;
 }
 
+uint8_t TelnetSpy::getClientCount() {
+	return clientCount;
+}
+
 void TelnetSpy::setCallbackOnConnect(void (*callback)()) {
 	callbackConnect = callback;
 }
@@ -550,69 +644,26 @@ void TelnetSpy::handle() {
 		}
 		telnetServer = new WiFiServer(port);
 		telnetServer->begin();
-		telnetServer->setNoDelay(bufLen > 0);
+		telnetServer->setNoDelay(ring.size() > 0);
 		listening = true;
 	}
-    if (telnetServer->hasClient()) {
-        if (client.connected()) {
-            WiFiClient rejectClient = telnetServer->available();
-			if (strlen(rejectMsg) > 0) {
-				rejectClient.write((const uint8_t*) rejectMsg, strlen(rejectMsg));
-			}
-			rejectClient.flush();
-            rejectClient.stop();
-        } else {
-            client = telnetServer->available();
-			if (strlen(welcomeMsg) > 0) {
-				client.write((const uint8_t*) welcomeMsg, strlen(welcomeMsg));
-			}
-        }
-    }
-    if (client.connected()) {
-    	if (!connected) {
-    		connected = true;
-    		if (pingTime != 0) {
-    			pingRef = (millis() & 0x7FFFFFF) + pingTime;
-    		}
-			if (callbackConnect != NULL) {
-				callbackConnect();
-			}
-		}
-	} else {
-    	if (connected) {
-    		connected = false;
-        	client.flush();
-            client.stop();
-			pingRef = 0xFFFFFFFF;
-			waitRef = 0xFFFFFFFF; 
-			if (callbackDisconnect != NULL) {
-				callbackDisconnect();
-			}
+	acceptClient();
+	for (int i = 0; i < TELNETSPY_MAX_CLIENTS; i++) {
+		if (clients[i].active) {
+			serviceClient(clients[i]);
 		}
 	}
-	
-	if (client.connected() && (bufUsed > 0)) {
-		if (bufUsed >= minBlockSize) {
-			sendBlock();
-		} else {
-			unsigned long m = millis() & 0x7FFFFFF;
-			if (waitRef == 0xFFFFFFFF) {
-				waitRef = m + collectingTime;
-				if (waitRef > 0x7FFFFFFF) {
-					waitRef -= 0x80000000;
-				}
-			} else {
-				if (!((waitRef < 0x20000000) && (m > 0x60000000)) && (m >= waitRef)) {
-					sendBlock();
-				}
+#if TELNETSPY_LOCK_FREE
+	if (clientCount > 0) {
+		// hand back to the writer what every client has been sent
+		uint32_t head = ring.headPos();
+		uint32_t oldest = head;
+		for (int i = 0; i < TELNETSPY_MAX_CLIENTS; i++) {
+			if (clients[i].active && (head - clients[i].cursor > head - oldest)) {
+				oldest = clients[i].cursor;
 			}
 		}
+		ring.release(oldest);
 	}
-	if (client.connected() && (pingRef != 0xFFFFFFFF)) {
-		unsigned long m = millis() & 0x7FFFFFF;
-		if (!((pingRef < 0x20000000) && (m > 0x60000000)) && (m >= pingRef)) {
-			addTelnetBuf(0);
-			sendBlock();
-		}
-	}
+#endif
 }
@@ -48,9 +48,9 @@
  * Default: "Connection established via TelnetSpy.\n"
  *		void setWelcomeMsg(char* msg);    
  *
- * Change the message which will be send to the telnet client if another
- * session is already established.
- * Default: "TelnetSpy: Only one connection possible.\n"
+ * Change the message which will be send to the telnet client if already
+ * TELNETSPY_MAX_CLIENTS sessions are established.
+ * Default: "TelnetSpy: Too many connections.\n"
  *		void setRejectMsg(char* msg);    
  *
  * Change the amount of characters to collect before sending a telnet block.
@@ -68,13 +68,29 @@
  *
  * Change the size of the ring buffer. Set it to 0 to disable buffering.
  * Changing size tries to preserve the already collected data. If the new
- * buffer size is too small the youngest data will be preserved only. Returns
- * false if the requested buffer size cannot be set.
- * Default: 3000
+ * buffer size is too small the youngest data will be preserved only. The size
+ * is rounded down to a power of two. Returns false if the requested buffer
+ * size cannot be set.
+ * Default: 4096
  *		bool setBufferSize(uint16_t newSize);
  *
  * This function returns the actual size of the ring buffer.
- *		uint16_t getBufferSize();
+ *		uint32_t getBufferSize();
+ *
+ * Move the ring buffer into PSRAM (ESP32 only) and make it <size> bytes, for
+ * a backlog of hundreds of KB (rounded down to a power of two), with an
+ * index of where its lines start and when they were written. The data
+ * already collected is kept. A client then
+ * starts with the last TELNETSPY_CONNECT_LINES lines and can type:
+ *		last <n>         replay the last n lines held
+ *		since <seconds>  replay what was written since that many seconds after boot
+ *		live             skip to the newest output
+ * Input from telnet is taken as these commands then and no longer read as
+ * serial input. Call it in setup(), before other tasks print. Returns false
+ * if there is no PSRAM (or TELNETSPY_LOCK_FREE is set); the ring buffer is
+ * left as it was then.
+ * Default: no backlog
+ *		bool setBacklogSize(uint32_t size);
  *
  * Enable / disable storing new data in the ring buffer if no telnet connection
  * is established. This function allows you to store important data only. You
@@ -100,15 +116,18 @@
  * This function returns true, if a telnet client is connected.
  *		bool isClientConnected();
  *
- * This function installs a callback function which will be called on every
- * telnet connect of this object (except rejected connect tries). Use NULL to
- * remove the callback.
+ * This function returns the number of connected telnet clients.
+ *		uint8_t getClientCount();
+ *
+ * This function installs a callback function which will be called when the
+ * first telnet client of this object connects (except rejected connect
+ * tries). Use NULL to remove the callback.
  * Default: NULL
  *		void setCallbackOnConnect(void (*callback)());
  *
- * This function installs a callback function which will be called on every
- * telnet disconnect of this object (except rejected connect tries). Use NULL
- * to remove the callback.
+ * This function installs a callback function which will be called when the
+ * last telnet client of this object disconnects (except rejected connect
+ * tries). Use NULL to remove the callback.
  * Default: NULL
  *		void setCallbackOnDisconnect(void (*callback)());
  *
@@ -134,12 +153,26 @@
  * Transfering data also via telnet will need more performance than the serial
  * port only. So time critical things may be influenced.
  *
- * It is not possible to establish more than one telnet connection at the same
- * time. But its possible to use more than one instance of TelnetSpy.
+ * Up to TELNETSPY_MAX_CLIENTS telnet connections can be established at the
+ * same time. Each client has its own position in the ring buffer and starts
+ * with the data still held there. handle() never waits for a client: it only
+ * sends what fits into the client's TCP send buffer and comes back for the
+ * rest, in blocks of up to TELNETSPY_BURST_SIZE while it is catching up. A
+ * client that falls so far behind that its data has been dropped
+ * from the ring buffer skips ahead to the oldest line still held; one that
+ * takes nothing for TELNETSPY_STALL_TIME ms is disconnected. Input from all
+ * clients is read as if it came from the serial port.
+ * Its also possible to use more than one instance of TelnetSpy.
  *
  * If you have problems with low memory you may reduce the value of the define
  * TELNETSPY_BUFFER_LEN for a smaller ring buffer on initialisation.    
  *
+ * Print functions (print, printf, write with a buffer) copy their whole
+ * output into the ring buffer under one lock, not byte by byte. If only one
+ * task writes and one task calls handle(), define TELNETSPY_LOCK_FREE 1 in
+ * the build flags: the ring buffer then needs no lock at all, but once it is
+ * full new output is dropped instead of the oldest lines (see TelnetSpyRing.h).
+ *
  * Usage of void setDebugOutput(bool) to enable / disable of capturing of
  * os_print calls when you have more than one TelnetSpy instance: That
  * TelnetSpy object will handle this functionallity where you used
@@ -151,7 +184,7 @@
 #ifndef TelnetSpy_h
 #define TelnetSpy_h
 
-#define TELNETSPY_BUFFER_LEN 3000
+#define TELNETSPY_BUFFER_LEN 4096
 #define TELNETSPY_MIN_BLOCK_SIZE 64
 #define TELNETSPY_COLLECTING_TIME 100
 #define TELNETSPY_MAX_BLOCK_SIZE 512
@@ -159,7 +192,18 @@
 #define TELNETSPY_PORT 23
 #define TELNETSPY_CAPTURE_OS_PRINT true
 #define TELNETSPY_WELCOME_MSG "Connection established via TelnetSpy.\r\n"
-#define TELNETSPY_REJECT_MSG "TelnetSpy: Only one connection possible.\r\n"
+#define TELNETSPY_REJECT_MSG "TelnetSpy: Too many connections.\r\n"
+#ifndef TELNETSPY_MAX_CLIENTS
+#define TELNETSPY_MAX_CLIENTS 3
+#endif
+#define TELNETSPY_STALL_TIME 5000
+#define TELNETSPY_BURST_SIZE 4096
+#define TELNETSPY_BACKLOG_LINE_LEN 32
+#define TELNETSPY_CONNECT_LINES 50
+#define TELNETSPY_CMD_LEN 24
+#ifndef TELNETSPY_LOCK_FREE
+#define TELNETSPY_LOCK_FREE 0
+#endif
 
 
 #ifdef ESP8266
@@ -170,13 +214,40 @@
 #define CRITCAL_SECTION_END
 #else // ESP32
 #include <WiFi.h>
+#if TELNETSPY_LOCK_FREE
+// single writer, single reader: the ring buffer needs no lock
+#define CRITCAL_SECTION_MUTEX
+#define CRITCAL_SECTION_START
+#define CRITCAL_SECTION_END
+#else
 // add spinlock for ESP32
 #define CRITCAL_SECTION_MUTEX portMUX_TYPE AtomicMutex = portMUX_INITIALIZER_UNLOCKED;
 // Non-static Data Member Initializers, see: https://web.archive.org/web/20160316174223/https://blogs.oracle.com/pcarlini/entry/c_11_tidbits_non_static
 #define CRITCAL_SECTION_START portENTER_CRITICAL(&AtomicMutex);
 #define CRITCAL_SECTION_END portEXIT_CRITICAL(&AtomicMutex);
 #endif
+#endif
 #include <WiFiClient.h>
+#include "TelnetSpyRing.h"
+
+#if TELNETSPY_LOCK_FREE
+typedef TelnetSpySpscRing TelnetSpyBuffer;
+#else
+typedef TelnetSpyRing TelnetSpyBuffer;
+#endif
+
+struct TelnetSpyClient {
+	WiFiClient client;
+	bool active;
+	uint32_t cursor;          // ring position of the next byte to send
+	bool waiting;             // less than minBlockSize pending since waitRef
+	unsigned long waitRef;
+	unsigned long sentRef;    // last time the client took data, for pings
+	bool stalled;             // took nothing since stallRef
+	unsigned long stallRef;
+	char cmd[TELNETSPY_CMD_LEN]; // backlog command being typed
+	uint8_t cmdLen;
+};
 
 class TelnetSpy : public Stream {
 	public:
@@ -190,12 +261,14 @@ class TelnetSpy : public Stream {
 		void setCollectingTime(uint16_t colTime);
 		void setMaxBlockSize(uint16_t maxSize);
 		bool setBufferSize(uint16_t newSize);
-		uint16_t getBufferSize();
+		uint32_t getBufferSize();
+		bool setBacklogSize(uint32_t size);
 		void setStoreOffline(bool store);
 		bool getStoreOffline();
 		void setPingTime(uint16_t pngTime);
 		void setSerial(HardwareSerial* usedSerial);
 		bool isClientConnected();
+		uint8_t getClientCount();
 		void setCallbackOnConnect(void (*callback)());
 		void setCallbackOnDisconnect(void (*callback)());
 		// Functions offered by HardwareSerial class:
@@ -222,6 +295,7 @@ class TelnetSpy : public Stream {
 		int availableForWrite(void);
 		void flush(void) override;
 		size_t write(uint8_t) override;
+		size_t write(const uint8_t* buffer, size_t size) override;
 		inline size_t write(unsigned long n) { return write((uint8_t) n); }
 		inline size_t write(long n) { return write((uint8_t) n); }
 		inline size_t write(unsigned int n) { return write((uint8_t) n); }
@@ -233,21 +307,23 @@ class TelnetSpy : public Stream {
 
 	protected:
 		CRITCAL_SECTION_MUTEX
-		void sendBlock(void);
-		void addTelnetBuf(char c);
-		char pullTelnetBuf();
-		char peekTelnetBuf();
-		int telnetAvailable();
+		void acceptClient(void);
+		void serviceClient(TelnetSpyClient& c);
+		void dropClient(TelnetSpyClient& c);
+		void readCommand(TelnetSpyClient& c);
+		void runCommand(TelnetSpyClient& c);
+		int trySend(WiFiClient& c, const char* data, size_t len);
+		int telnetAvailable(WiFiClient& c);
+		WiFiClient* inputClient();
 		WiFiServer* telnetServer;
-		WiFiClient client;
+		TelnetSpyClient clients[TELNETSPY_MAX_CLIENTS];
+		uint8_t clientCount;
 		uint16_t port;
 		HardwareSerial* usedSer;
 		bool storeOffline;
 		bool started;
 		bool listening;
 		bool firstMainLoop;
-		unsigned long waitRef;
-		unsigned long pingRef;
 		uint16_t pingTime;
 		char* welcomeMsg;
 		char* rejectMsg;
@@ -255,11 +331,9 @@ class TelnetSpy : public Stream {
 		uint16_t collectingTime;
 		uint16_t maxBlockSize;
 		bool debugOutput;
-		char* telnetBuf;
-		uint16_t bufLen;
-		uint16_t bufUsed;
-		uint16_t bufRdIdx;
-		uint16_t bufWrIdx;
+		TelnetSpyBuffer ring;
+		TelnetSpyLineIndex lines;
+		char sendBuf[TELNETSPY_BURST_SIZE]; // one client's block, copied out of ring
 		bool connected;
 		void (*callbackConnect)();
 		void (*callbackDisconnect)();
@@ -0,0 +1,387 @@
+/*
+ * Ring buffers behind TelnetSpy. Plain C++, so they can be benchmarked on a
+ * host (see avialog telnetbench).
+ *
+ * Positions are free running 32 bit byte counts: head is everything ever
+ * written, tail the oldest byte still held, and a position maps to
+ * buf[pos & (len - 1)]. len is a power of two, resize() rounds the size
+ * down to one, so that mapping carries on unbroken when the positions wrap
+ * at 2^32. Both rings copy whole blocks with memcpy. Readers keep
+ * their own position (each telnet client has one) and read with peekAt().
+ *
+ * TelnetSpyRing is not thread safe by itself; TelnetSpy holds its spinlock
+ * around every call, once per write() rather than once per byte. It keeps
+ * what was written until the space is needed, then drops the oldest whole
+ * lines, so what is held is always the newest output. A reader whose
+ * position falls behind tail has missed data.
+ *
+ * TelnetSpySpscRing is for exactly one writing task and one reading task
+ * (the one calling handle()) and needs no lock: the writer only moves head
+ * and the reader only moves tail, with release() once every client has
+ * been sent the data. As the writer cannot move tail, output that does not
+ * fit is dropped instead and counted.
+ *
+ * TelnetSpyLineIndex records where the lines in a TelnetSpyRing start and
+ * when they were written, so a large backlog can be replayed from the last
+ * N lines or from a point in time.
+ */
+
+#ifndef TelnetSpyRing_h
+#define TelnetSpyRing_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+
+// The largest power of two not above size, 0 for 0.
+inline uint32_t telnetSpyRingSize(uint32_t size) {
+	while (size & (size - 1)) {
+		size &= size - 1;
+	}
+	return size;
+}
+
+class TelnetSpyRing {
+	public:
+		TelnetSpyRing() : buf(NULL), len(0), head(0), tail(0), dropped(0) {}
+		~TelnetSpyRing() { free(buf); }
+
+		// Keeps the newest data that fits. Size 0 frees the buffer.
+		bool resize(uint32_t size, void* (*alloc)(size_t) = malloc) {
+			size = telnetSpyRingSize(size);
+			if (size == 0) {
+				free(buf);
+				buf = NULL;
+				len = 0;
+				head = tail = 0;
+				return true;
+			}
+			char* temp = (char*) alloc(size);
+			if (!temp) {
+				return false;
+			}
+			uint32_t keep = used() < size ? used() : size;
+			copyOut(head - keep, temp, keep);
+			free(buf);
+			buf = temp;
+			len = size;
+			tail = 0;
+			head = keep;
+			return true;
+		}
+
+		uint32_t size() const { return buf ? len : 0; }
+		uint32_t used() const { return head - tail; }
+		uint32_t space() const { return len - used(); }
+		uint32_t droppedBytes() const { return dropped; }
+		uint32_t headPos() const { return head; }
+		uint32_t tailPos() const { return tail; }
+
+		void write(const uint8_t* data, size_t n) {
+			if (n >= len) {
+				// only the newest len bytes fit
+				dropped += used() + (n - len);
+				data += n - len;
+				n = len;
+				tail = head;
+			} else {
+				dropLines(n);
+			}
+			copyIn(data, n);
+			head += n;
+		}
+
+		// The bytes from pos on, at most max and contiguous in memory. pos must
+		// not be behind tail.
+		size_t peekAt(uint32_t pos, const char** block, size_t max) const {
+			uint32_t n = head - pos;
+			if (n == 0) {
+				*block = buf;
+				return 0;
+			}
+			uint32_t idx = pos & (len - 1);
+			if (n > len - idx) {
+				n = len - idx;
+			}
+			*block = &buf[idx];
+			return n < max ? n : max;
+		}
+
+		// Copies the bytes from pos on, at most max, into out, for a reader
+		// that uses them after the lock is released. pos must not be behind
+		// tail.
+		size_t copyAt(uint32_t pos, char* out, size_t max) const {
+			uint32_t n = head - pos;
+			if (n > max) {
+				n = max;
+			}
+			copyOut(pos, out, n);
+			return n;
+		}
+
+	private:
+		// Drops whole lines from the front until need bytes are free.
+		void dropLines(size_t need) {
+			while ((used() > 0) && (space() < need)) {
+				const char* eol = NULL;
+				while (!eol && (used() > 0)) {
+					// the contiguous part, up to the end of the line
+					uint32_t idx = tail & (len - 1);
+					uint32_t n = used() < len - idx ? used() : len - idx;
+					eol = (const char*) memchr(&buf[idx], '\n', n);
+					if (eol) {
+						n = eol - &buf[idx] + 1;
+					}
+					tail += n;
+					dropped += n;
+				}
+				if ((used() > 0) && (buf[tail & (len - 1)] == '\r')) {
+					tail++;
+					dropped++;
+				}
+			}
+		}
+
+		void copyIn(const uint8_t* data, size_t n) {
+			uint32_t idx = head & (len - 1);
+			size_t first = n < len - idx ? n : len - idx;
+			memcpy(&buf[idx], data, first);
+			memcpy(buf, data + first, n - first);
+		}
+
+		void copyOut(uint32_t pos, char* out, uint32_t n) const {
+			if (n == 0) {
+				return;
+			}
+			uint32_t idx = pos & (len - 1);
+			uint32_t first = n < len - idx ? n : len - idx;
+			memcpy(out, &buf[idx], first);
+			memcpy(out + first, buf, n - first);
+		}
+
+		char* buf;
+		uint32_t len;
+		uint32_t head;
+		uint32_t tail;
+		uint32_t dropped;
+};
+
+class TelnetSpySpscRing {
+	public:
+		TelnetSpySpscRing() : buf(NULL), len(0), head(0), tail(0), dropped(0) {}
+		~TelnetSpySpscRing() { free(buf); }
+
+		// Not safe while the writer or the reader is running.
+		bool resize(uint32_t size) {
+			size = telnetSpyRingSize(size);
+			char* temp = NULL;
+			if (size > 0) {
+				temp = (char*) malloc(size);
+				if (!temp) {
+					return false;
+				}
+			}
+			uint32_t t = tail.load(std::memory_order_relaxed);
+			uint32_t h = head.load(std::memory_order_relaxed);
+			uint32_t keep = h - t < size ? h - t : size;
+			for (uint32_t i = 0; i < keep; i++) {
+				temp[i] = buf[(h - keep + i) & (len - 1)];
+			}
+			free(buf);
+			buf = temp;
+			len = size;
+			tail.store(0, std::memory_order_relaxed);
+			head.store(keep, std::memory_order_relaxed);
+			return true;
+		}
+
+		uint32_t size() const { return buf ? len : 0; }
+		uint32_t used() const { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire); }
+		uint32_t space() const { return len - used(); }
+		uint32_t droppedBytes() const { return dropped.load(std::memory_order_relaxed); }
+		uint32_t headPos() const { return head.load(std::memory_order_acquire); }
+		uint32_t tailPos() const { return tail.load(std::memory_order_relaxed); }
+
+		// Writer side.
+		void write(const uint8_t* data, size_t n) {
+			uint32_t h = head.load(std::memory_order_relaxed);
+			uint32_t free = len - (h - tail.load(std::memory_order_acquire));
+			if (n > free) {
+				dropped.fetch_add(n - free, std::memory_order_relaxed);
+				n = free;
+			}
+			uint32_t idx = h & (len - 1);
+			size_t first = n < len - idx ? n : len - idx;
+			memcpy(&buf[idx], data, first);
+			memcpy(buf, data + first, n - first);
+			head.store(h + n, std::memory_order_release);
+		}
+
+		// Reader side.
+		size_t peekAt(uint32_t pos, const char** block, size_t max) const {
+			uint32_t n = head.load(std::memory_order_acquire) - pos;
+			if (n == 0) {
+				*block = buf;
+				return 0;
+			}
+			uint32_t idx = pos & (len - 1);
+			if (n > len - idx) {
+				n = len - idx;
+			}
+			*block = &buf[idx];
+			return n < max ? n : max;
+		}
+
+		size_t copyAt(uint32_t pos, char* out, size_t max) const {
+			uint32_t n = head.load(std::memory_order_acquire) - pos;
+			if (n > max) {
+				n = max;
+			}
+			if (n == 0) {
+				return 0;
+			}
+			uint32_t idx = pos & (len - 1);
+			uint32_t first = n < len - idx ? n : len - idx;
+			memcpy(out, &buf[idx], first);
+			memcpy(out + first, buf, n - first);
+			return n;
+		}
+
+		// Frees everything before pos for the writer.
+		void release(uint32_t pos) {
+			tail.store(pos, std::memory_order_release);
+		}
+
+	private:
+		char* buf;
+		uint32_t len;
+		std::atomic<uint32_t> head;
+		std::atomic<uint32_t> tail;
+		std::atomic<uint32_t> dropped;
+};
+
+struct TelnetSpyLine {
+	uint32_t pos;   // ring position of its first byte
+	uint32_t ms;    // when that was written
+};
+
+// A ring of its own, also a power of two long. When it is full the oldest
+// entries go; entries for lines the ring has dropped are skipped.
+class TelnetSpyLineIndex {
+	public:
+		TelnetSpyLineIndex() : lines(NULL), len(0), count(0), next(0), atLineStart(true) {}
+		~TelnetSpyLineIndex() { free(lines); }
+
+		// Clears the index. Size 0 frees it.
+		bool resize(uint32_t entries, void* (*alloc)(size_t) = malloc) {
+			entries = telnetSpyRingSize(entries);
+			TelnetSpyLine* temp = NULL;
+			if (entries > 0) {
+				temp = (TelnetSpyLine*) alloc(entries * sizeof(TelnetSpyLine));
+				if (!temp) {
+					return false;
+				}
+			}
+			free(lines);
+			lines = temp;
+			len = entries;
+			count = next = 0;
+			atLineStart = true;
+			return true;
+		}
+
+		uint32_t size() const { return lines ? len : 0; }
+
+		// Records the lines starting in data, which was written at pos.
+		void add(uint32_t pos, const uint8_t* data, size_t n, uint32_t ms) {
+			if (!lines || (n == 0)) {
+				return;
+			}
+			if (atLineStart) {
+				push(pos, ms);
+			}
+			const uint8_t* end = data + n;
+			const uint8_t* p = data;
+			while ((p = (const uint8_t*) memchr(p, '\n', end - p)) != NULL) {
+				if (++p == end) {
+					atLineStart = true;
+					return;
+				}
+				push(pos + (p - data), ms);
+			}
+			atLineStart = false;
+		}
+
+		// Where the last n lines still held from tail on start, head for none.
+		uint32_t lastLines(uint32_t n, uint32_t tail, uint32_t head) const {
+			uint32_t first = firstHeld(tail);
+			if (n == 0) {
+				return head;
+			}
+			if (n >= count - first) {
+				return tail;
+			}
+			return at(count - n).pos;
+		}
+
+		// Where the first line held from tail on that was written at or after
+		// ms starts, head if there is none.
+		uint32_t since(uint32_t ms, uint32_t tail, uint32_t head) const {
+			uint32_t first = firstHeld(tail);
+			if ((first < count) && ((int32_t) (at(first).ms - ms) >= 0)) {
+				// lines older than the index may be newer than ms too
+				return tail;
+			}
+			uint32_t lo = first;
+			uint32_t hi = count;
+			while (lo < hi) {
+				uint32_t mid = lo + (hi - lo) / 2;
+				if ((int32_t) (at(mid).ms - ms) < 0) {
+					lo = mid + 1;
+				} else {
+					hi = mid;
+				}
+			}
+			return lo < count ? at(lo).pos : head;
+		}
+
+	private:
+		void push(uint32_t pos, uint32_t ms) {
+			TelnetSpyLine& line = lines[next++ & (len - 1)];
+			line.pos = pos;
+			line.ms = ms;
+			if (count < len) {
+				count++;
+			}
+		}
+
+		// i = 0 is the oldest entry
+		const TelnetSpyLine& at(uint32_t i) const {
+			return lines[(next - count + i) & (len - 1)];
+		}
+
+		// The oldest entry not behind tail, count if there is none.
+		uint32_t firstHeld(uint32_t tail) const {
+			uint32_t lo = 0;
+			uint32_t hi = count;
+			while (lo < hi) {
+				uint32_t mid = lo + (hi - lo) / 2;
+				if ((int32_t) (at(mid).pos - tail) < 0) {
+					lo = mid + 1;
+				} else {
+					hi = mid;
+				}
+			}
+			return lo;
+		}
+
+		TelnetSpyLine* lines;
+		uint32_t len;
+		uint32_t count;
+		uint32_t next;
+		bool atLineStart;
+};
+
+#endif
@@ -0,0 +1,258 @@
+#ifndef BINLOG_H
+#define BINLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <type_traits>
+
+// Deferred printf. A message is recorded as its format string pointer, a
+// timestamp and its arguments as raw 64 bit words, and turned into text
+// later by binLogFormat(), exactly as printf would have. Plain C++, shared
+// with the host tool.
+//
+// The format is only read when the record is formatted, so it has to be a
+// string literal, and so do %s arguments (or point into a name table):
+// never a buffer that is reused. '*' widths and long double are not
+// supported.
+#define BINLOG_MAX_ARGS 8
+
+struct BinLogRecord
+{
+    const char *fmt;
+    uint8_t argc;
+    int64_t us;
+    uint64_t args[BINLOG_MAX_ARGS];
+};
+
+// Bounded ring for any number of producers and one consumer, without a lock:
+// each slot carries a sequence number, a producer claims a position with a
+// compare and swap and publishes the slot by advancing its sequence. A full
+// ring drops the message and counts it. LENGTH must be a power of two.
+template <size_t LENGTH>
+class BinLogRing
+{
+    static_assert((LENGTH & (LENGTH - 1)) == 0, "BinLogRing length must be a power of two");
+
+public:
+    BinLogRing()
+    {
+        for (uint32_t i = 0; i < LENGTH; i++)
+            slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    bool push(const char *fmt, int64_t us, const uint64_t *args, uint8_t argc)
+    {
+        uint32_t pos = enqueuePos.load(std::memory_order_relaxed);
+        Slot *slot;
+        for (;;)
+        {
+            slot = &slots[pos & (LENGTH - 1)];
+            int32_t ahead = (int32_t)(slot->seq.load(std::memory_order_acquire) - pos);
+            if (ahead == 0)
+            {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (ahead < 0)
+            {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            else
+                pos = enqueuePos.load(std::memory_order_relaxed);
+        }
+        slot->record.fmt = fmt;
+        slot->record.us = us;
+        slot->record.argc = argc;
+        memcpy(slot->record.args, args, argc * sizeof(uint64_t));
+        slot->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side.
+    bool pop(BinLogRecord &out)
+    {
+        uint32_t pos = dequeuePos.load(std::memory_order_relaxed);
+        Slot &slot = slots[pos & (LENGTH - 1)];
+        if (slot.seq.load(std::memory_order_acquire) != pos + 1)
+            return false;
+        out = slot.record;
+        slot.seq.store(pos + LENGTH, std::memory_order_release);
+        dequeuePos.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // True when nothing has been claimed since the last pop, from any task.
+    bool empty() const
+    {
+        return enqueuePos.load(std::memory_order_acquire) == dequeuePos.load(std::memory_order_acquire);
+    }
+
+    size_t capacity() const { return LENGTH; }
+    uint32_t droppedCount() const { return dropped.load(std::memory_order_relaxed); }
+
+private:
+    struct Slot
+    {
+        std::atomic<uint32_t> seq;
+        BinLogRecord record;
+    };
+
+    Slot slots[LENGTH];
+    std::atomic<uint32_t> enqueuePos{0};
+    std::atomic<uint32_t> dequeuePos{0};
+    std::atomic<uint32_t> dropped{0};
+};
+
+// One argument as a raw word: integers sign or zero extended, floating point
+// as the bits of a double, pointers as their address.
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value, uint64_t>::type binLogWord(T v)
+{
+    return (uint64_t)(int64_t)v;
+}
+
+template <typename T>
+typename std::enable_if<std::is_floating_point<T>::value, uint64_t>::type binLogWord(T v)
+{
+    double d = v;
+    uint64_t w;
+    memcpy(&w, &d, sizeof(w));
+    return w;
+}
+
+template <typename T>
+uint64_t binLogWord(T *v)
+{
+    return (uint64_t)(uintptr_t)v;
+}
+
+template <size_t LENGTH, typename... Args>
+bool binLogPush(BinLogRing<LENGTH> &ring, int64_t us, const char *fmt, Args... args)
+{
+    static_assert(sizeof...(Args) <= BINLOG_MAX_ARGS, "too many arguments for a deferred log message");
+    const uint64_t words[] = {0, binLogWord(args)...}; // the 0 keeps the array from being empty
+    return ring.push(fmt, us, words + 1, sizeof...(Args));
+}
+
+// Formats r into out as printf would have. Returns the length, truncated to
+// size - 1.
+size_t binLogFormat(const BinLogRecord &r, char *out, size_t size)
+{
+    if (size == 0)
+        return 0;
+    size_t n = 0;
+    uint8_t arg = 0;
+    const char *p = r.fmt;
+    while (*p && n + 1 < size)
+    {
+        if (*p != '%')
+        {
+            out[n++] = *p++;
+            continue;
+        }
+        const char *start = p++;
+        if (*p == '%')
+        {
+            out[n++] = '%';
+            p++;
+            continue;
+        }
+
+        // flags, width, precision, length and conversion of one argument
+        while (*p && strchr("-+ #0", *p))
+            p++;
+        while (*p >= '0' && *p <= '9')
+            p++;
+        if (*p == '.')
+        {
+            p++;
+            while (*p >= '0' && *p <= '9')
+                p++;
+        }
+        int longs = 0;
+        bool sizeT = false;
+        while (*p == 'l' || *p == 'h' || *p == 'z')
+        {
+            if (*p == 'l')
+                longs++;
+            if (*p == 'z')
+                sizeT = true;
+            p++;
+        }
+        char type = *p;
+        if (!type)
+            break;
+        p++;
+
+        char spec[16];
+        size_t specLen = p - start;
+        if (specLen >= sizeof(spec))
+            break;
+        memcpy(spec, start, specLen);
+        spec[specLen] = 0;
+
+        uint64_t w = arg < r.argc ? r.args[arg] : 0;
+        arg++;
+        char *at = out + n;
+        size_t room = size - n;
+        int len = 0;
+        switch (type)
+        {
+        case 'd':
+        case 'i':
+            if (sizeT || longs == 1)
+                len = snprintf(at, room, spec, (long)w);
+            else if (longs >= 2)
+                len = snprintf(at, room, spec, (long long)w);
+            else
+                len = snprintf(at, room, spec, (int)w);
+            break;
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+            if (sizeT)
+                len = snprintf(at, room, spec, (size_t)w);
+            else if (longs == 1)
+                len = snprintf(at, room, spec, (unsigned long)w);
+            else if (longs >= 2)
+                len = snprintf(at, room, spec, (unsigned long long)w);
+            else
+                len = snprintf(at, room, spec, (unsigned int)w);
+            break;
+        case 'c':
+            len = snprintf(at, room, spec, (int)w);
+            break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+        {
+            double d;
+            memcpy(&d, &w, sizeof(d));
+            len = snprintf(at, room, spec, d);
+            break;
+        }
+        case 's':
+            len = snprintf(at, room, spec, w ? (const char *)(uintptr_t)w : "(null)");
+            break;
+        case 'p':
+            len = snprintf(at, room, spec, (void *)(uintptr_t)w);
+            break;
+        }
+        if (len > 0)
+            n += (size_t)len < room ? (size_t)len : room - 1;
+    }
+    out[n] = 0;
+    return n;
+}
+
+#endif
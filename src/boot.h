@@ -0,0 +1,352 @@
+#ifndef BOOT_H
+#define BOOT_H
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <Preferences.h>
+#include "global.h"
+
+// The slow parts of start up run in bootTask after setup() has returned, so the
+// display and ESP-NOW are live straight away. Each phase has a time budget and
+// is given up on, not waited for, when it runs over.
+#define WIFI_SSID "shed"
+#define WIFI_PASSWORD "elephantseat"
+#define BOOT_SD_MS 2000           // mount retries
+#define BOOT_WIFI_MS 5000         // association with the time sync network, scan included
+#define BOOT_NTP_MS 3000          // waiting for the NTP answer
+#define BOOT_TIME_MS 8000         // whole time sync path, WiFi and NTP together
+#define BOOT_NTP_MIN_MS 500       // not worth asking NTP with less left than this
+#define WIFI_FAST_MS 1500         // association with the cached BSSID before scanning
+#define WIFI_SCAN_CHANNEL_MS 120  // bounds the fallback scan to about 1.6 s
+#define WIFI_LEASE_REUSE_S 43200  // reuse the cached IP without DHCP for this long
+
+enum BootPhase
+{
+    BOOT_SD,
+    BOOT_WIFI,
+    BOOT_NTP,
+    BOOT_DONE
+};
+
+const char *bootPhaseNames[] = {"sd", "wifi", "ntp", "done"};
+
+volatile BootPhase bootPhase = BOOT_SD;
+
+extern ESPNowReceiver espnow;
+extern TelnetSpy debug;
+
+// Boot profile: esp_timer timestamps of the start up milestones. It is kept
+// in RTC memory, so it survives a watchdog reset in the middle of booting, and
+// copied to NVS when the boot task is done and again after the first gauges
+// frame, the milestone that matters most, so it also survives a power cycle
+// even when the sender is never heard. Each boot prints the previous one, the
+// "boot profile" lines can be summarised with avialog boot.
+#define BOOT_MARKS 16
+#define BOOT_PROFILE_MAGIC 0x544F4F42 // "BOOT"
+
+struct BootMark
+{
+    char name[12];
+    uint32_t us; // esp_timer time, microseconds since the app started
+};
+
+struct BootProfile
+{
+    uint32_t magic;
+    uint32_t boot; // counts up across boots
+    uint32_t count;
+    bool complete;
+    BootMark marks[BOOT_MARKS];
+};
+
+RTC_NOINIT_ATTR BootProfile bootProfile;
+portMUX_TYPE bootMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Records a milestone, from any task.
+void bootMark(const char *name)
+{
+    portENTER_CRITICAL(&bootMux);
+    if (bootProfile.count < BOOT_MARKS)
+    {
+        // stamped inside the lock so the marks stay in time order
+        BootMark &mark = bootProfile.marks[bootProfile.count++];
+        mark.us = (uint32_t)esp_timer_get_time();
+        strncpy(mark.name, name, sizeof(mark.name) - 1);
+        mark.name[sizeof(mark.name) - 1] = 0;
+    }
+    portEXIT_CRITICAL(&bootMux);
+}
+
+void printBootProfile(const BootProfile &profile)
+{
+    debug.printf("i: boot profile %u %s", profile.boot, profile.complete ? "complete" : "incomplete");
+    for (uint32_t i = 0; i < profile.count; i++)
+        debug.printf(" %s=%u", profile.marks[i].name, profile.marks[i].us);
+    debug.println();
+}
+
+// Prints the previous boot's profile and starts recording this one.
+void beginBootProfile()
+{
+    static BootProfile last;
+    bool found = bootProfile.magic == BOOT_PROFILE_MAGIC && bootProfile.count <= BOOT_MARKS;
+
+    if (found)
+    {
+        last = bootProfile;
+    }
+    else
+    {
+        // RTC memory does not survive a power cycle
+        Preferences prefs;
+        prefs.begin("boot", true);
+        found = prefs.getBytes("profile", &last, sizeof(last)) == sizeof(last) &&
+                last.magic == BOOT_PROFILE_MAGIC && last.count <= BOOT_MARKS;
+        prefs.end();
+    }
+    if (found)
+        printBootProfile(last);
+
+    memset(&bootProfile, 0, sizeof(bootProfile));
+    bootProfile.boot = found ? last.boot + 1 : 0;
+    bootProfile.magic = BOOT_PROFILE_MAGIC;
+}
+
+// From the boot task and the render task.
+void saveBootProfile()
+{
+    Preferences prefs;
+    BootProfile saved;
+
+    portENTER_CRITICAL(&bootMux);
+    bootProfile.complete = true;
+    saved = bootProfile;
+    portEXIT_CRITICAL(&bootMux);
+    prefs.begin("boot", false);
+    prefs.putBytes("profile", &saved, sizeof(saved));
+    prefs.end();
+}
+
+// The boot task owns the radio, the SD card and the RTC until it is done, so
+// the power task must not power-cycle the radio or light sleep before then.
+bool bootPending()
+{
+    return bootPhase != BOOT_DONE;
+}
+
+void bootPhaseDone(BootPhase phase, unsigned long start, unsigned long budget, bool ok)
+{
+    unsigned long took = millis() - start;
+    Serial.printf("%s: boot %s %s in %lu ms%s\n", ok ? "i" : "w", bootPhaseNames[phase],
+                  ok ? "ok" : "failed", took, took > budget ? " (over budget)" : "");
+}
+
+// The last good association, so the next boot can skip the scan and DHCP.
+struct WifiCache
+{
+    uint8_t bssid[6];
+    int32_t channel;
+    uint32_t ip;
+    uint32_t gateway;
+    uint32_t subnet;
+    uint32_t dns;
+    uint32_t savedAt; // clockSeconds() when the lease was obtained
+};
+
+bool waitWifi(unsigned long start, unsigned long budgetMs)
+{
+    while (WiFi.status() != WL_CONNECTED)
+    {
+        if (millis() - start >= budgetMs)
+            return false;
+        vTaskDelay(pdMS_TO_TICKS(50));
+    }
+    return true;
+}
+
+// Joins WIFI_SSID, first with the cached BSSID, channel and lease, and only
+// scans when that fails or there is nothing cached.
+bool connectWifi(unsigned long budgetMs)
+{
+    unsigned long start = millis();
+    Preferences prefs;
+    WifiCache cache;
+    bool ok = false;
+
+    prefs.begin("wifi", false);
+    bool cached = prefs.getBytes("cache", &cache, sizeof(cache)) == sizeof(cache) && cache.channel > 0;
+    if (cached)
+    {
+        if (clockSeconds() - cache.savedAt < WIFI_LEASE_REUSE_S)
+            WiFi.config(IPAddress(cache.ip), IPAddress(cache.gateway), IPAddress(cache.subnet), IPAddress(cache.dns));
+        WiFi.begin(WIFI_SSID, WIFI_PASSWORD, cache.channel, cache.bssid);
+        ok = waitWifi(start, min(budgetMs, (unsigned long)WIFI_FAST_MS));
+        if (!ok)
+        {
+            Serial.printf("w: wifi cached channel %d failed, scanning\n", cache.channel);
+            WiFi.disconnect();
+            WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE); // back to DHCP
+        }
+    }
+
+    if (!ok && millis() - start < budgetMs)
+    {
+        int32_t channel = 0;
+        uint8_t bssid[6];
+        int n = WiFi.scanNetworks(false, false, false, WIFI_SCAN_CHANNEL_MS);
+        for (int i = 0; i < n; ++i)
+        {
+            // strongest first
+            if (WiFi.SSID(i) == WIFI_SSID)
+            {
+                channel = WiFi.channel(i);
+                memcpy(bssid, WiFi.BSSID(i), sizeof(bssid));
+                break;
+            }
+        }
+        WiFi.scanDelete();
+
+        if (channel > 0)
+        {
+            WiFi.begin(WIFI_SSID, WIFI_PASSWORD, channel, bssid);
+            ok = waitWifi(start, budgetMs);
+        }
+    }
+
+    if (ok && WiFi.status() == WL_CONNECTED)
+    {
+        bool leaseChanged = !cached || cache.ip != (uint32_t)WiFi.localIP();
+        memcpy(cache.bssid, WiFi.BSSID(), sizeof(cache.bssid));
+        cache.channel = WiFi.channel();
+        cache.ip = WiFi.localIP();
+        cache.gateway = WiFi.gatewayIP();
+        cache.subnet = WiFi.subnetMask();
+        cache.dns = WiFi.dnsIP();
+        if (leaseChanged)
+            cache.savedAt = clockSeconds();
+        prefs.putBytes("cache", &cache, sizeof(cache));
+    }
+    else
+    {
+        WiFi.disconnect();
+    }
+    prefs.end();
+    return ok;
+}
+
+// Telnet on the ground. Past the boot task WiFi is only joined while on
+// external power, so the debug backlog can be fetched on the charger in the
+// shed. The power task calls this from serviceRadio(); it brings the radio up
+// and joins WIFI_SSID without blocking, tries again every GROUND_WIFI_RETRY_MS
+// while the network is out of reach, and leaves as soon as wanted drops.
+// Returns true while it has the radio, which must then not be paused or slept.
+#define GROUND_WIFI_JOIN_MS 10000
+#define GROUND_WIFI_RETRY_MS 60000
+
+enum GroundWifi
+{
+    GROUND_OFF,
+    GROUND_JOINING,
+    GROUND_JOINED
+};
+
+GroundWifi groundWifi = GROUND_OFF;
+
+bool serviceGroundWifi(bool wanted)
+{
+    static unsigned long since;
+    static unsigned long lastTry;
+    static bool tried = false;
+    unsigned long now = millis();
+
+    switch (groundWifi)
+    {
+    case GROUND_OFF:
+        // the boot task has the radio until it is done
+        if (!wanted || bootPending() || (tried && now - lastTry < GROUND_WIFI_RETRY_MS))
+            return false;
+        if (!espnow.resumeWiFi()) // the driver has to run to join
+            return false;
+        WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+        groundWifi = GROUND_JOINING;
+        since = now;
+        lastTry = now;
+        tried = true;
+        return true;
+
+    case GROUND_JOINING:
+        if (wanted && WiFi.status() == WL_CONNECTED)
+        {
+            IPAddress ip = WiFi.localIP();
+            LOG_INFO("wifi joined for telnet, %u.%u.%u.%u\n",
+                     (unsigned)ip[0], (unsigned)ip[1], (unsigned)ip[2], (unsigned)ip[3]);
+            groundWifi = GROUND_JOINED;
+            return true;
+        }
+        if (wanted && now - since < GROUND_WIFI_JOIN_MS)
+            return true;
+        break;
+
+    case GROUND_JOINED:
+        if (wanted && WiFi.status() == WL_CONNECTED)
+            return true;
+        break;
+    }
+
+    if (groundWifi == GROUND_JOINED)
+        LOG_INFO("wifi left\n");
+    WiFi.disconnect();
+    // leave ESP-NOW the way the power save cycling expects it, as bootTask does
+    espnow.pauseWiFi();
+    groundWifi = GROUND_OFF;
+    return false;
+}
+
+void bootTask(void *parameter)
+{
+    unsigned long start = millis();
+
+    bool ok = beginSD(BOOT_SD_MS);
+    bootMark("sd");
+    beginFlashLog();
+    beginFrameLog();
+    bootMark("flashlog");
+    bootPhaseDone(BOOT_SD, start, BOOT_SD_MS, ok);
+
+    bootPhase = BOOT_WIFI;
+    unsigned long timeStart = millis();
+    start = timeStart;
+    ok = connectWifi(BOOT_WIFI_MS);
+    bootMark("wifi");
+    bootPhaseDone(BOOT_WIFI, start, BOOT_WIFI_MS, ok);
+
+    // NTP only gets what is left of the time sync budget
+    unsigned long left = BOOT_TIME_MS - min((unsigned long)BOOT_TIME_MS, millis() - timeStart);
+    unsigned long ntpBudget = min(left, (unsigned long)BOOT_NTP_MS);
+    if (ok && ntpBudget >= BOOT_NTP_MIN_MS)
+    {
+        bootPhase = BOOT_NTP;
+        start = millis();
+        ok = timeSync(ntpBudget);
+        bootMark("ntp");
+        bootPhaseDone(BOOT_NTP, start, ntpBudget, ok);
+    }
+    WiFi.disconnect();
+
+    // leave ESP-NOW the way the power save cycling expects it
+    espnow.pauseWiFi();
+    espnow.resumeWiFi();
+
+    bootMark("done");
+    saveBootProfile();
+    dvfsRelease(DVFS_FAST); // held since beginDvfs()
+    bootPhase = BOOT_DONE;
+    vTaskDelete(NULL);
+}
+
+void beginBoot()
+{
+    xTaskCreatePinnedToCore(bootTask, "boot", 4096, NULL, 1, NULL, 0);
+}
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef CHARGING_H
+#define CHARGING_H
+
+#include <Arduino.h>
+#include <M5Core2.h>
+
+// Charging mode, entered by the power task while on external power. The
+// radio, the once a second jobs and the gauges stop, the backlight is dimmed
+// and the charge current set once. The PMIC is read every CHARGE_POLL_MIN_MS
+// while the values move, backing off to CHARGE_POLL_MAX_MS while they hold,
+// and the screen is only redrawn when the rounded values change, so the
+// device spends the charge in light sleep instead of on itself.
+#define CHARGE_POLL_MIN_MS 2000
+#define CHARGE_POLL_MAX_MS 16000
+#define CHARGE_LCD_MV 2500    // backlight while charging, a tap brightens it
+#define CHARGE_CURRENT_STEP_MA 10
+
+// As shown on the charging screen.
+struct ChargeStatus
+{
+    int level;     // %
+    int currentMa; // into the battery, CHARGE_CURRENT_STEP_MA steps
+    int voltageCv; // centivolts
+};
+
+portMUX_TYPE chargeMux = portMUX_INITIALIZER_UNLOCKED;
+ChargeStatus chargeShown;
+
+ChargeStatus readCharge()
+{
+    ChargeStatus s;
+    s.level = (int)(M5.Axp.GetBatteryLevel() + 0.5f);
+    s.currentMa = (int)lroundf(M5.Axp.GetBatCurrent() / CHARGE_CURRENT_STEP_MA) * CHARGE_CURRENT_STEP_MA;
+    s.voltageCv = (int)lroundf(M5.Axp.GetBatVoltage() * 100);
+    return s;
+}
+
+// Stores s for the charging screen. Returns true if it differs from what is shown.
+bool publishCharge(const ChargeStatus &s, bool force)
+{
+    portENTER_CRITICAL(&chargeMux);
+    bool changed = force || s.level != chargeShown.level || s.currentMa != chargeShown.currentMa ||
+                   s.voltageCv != chargeShown.voltageCv;
+    chargeShown = s;
+    portEXIT_CRITICAL(&chargeMux);
+    return changed;
+}
+
+ChargeStatus takeCharge()
+{
+    portENTER_CRITICAL(&chargeMux);
+    ChargeStatus s = chargeShown;
+    portEXIT_CRITICAL(&chargeMux);
+    return s;
+}
+
+#endif
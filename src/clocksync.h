@@ -0,0 +1,185 @@
+#ifndef CLOCKSYNC_H
+#define CLOCKSYNC_H
+
+#include <stdint.h>
+
+// Tracks the sender's clock from ESP-NOW time beacons. Plain C++ so the host
+// tool can run it against a simulated link.
+//
+// Each beacon carries the sender's esp_timer time; the receiver stamps it on
+// arrival. The difference is the clock offset plus a delay that is never
+// negative and occasionally large (air time, retries, the WiFi task being
+// busy), so only the smallest difference of every CLOCK_WINDOW beacons is
+// kept. A least squares line through the last CLOCK_POINTS of those gives the
+// offset and the drift between the two crystals. The fixed minimum delay ends
+// up in the offset, which is what a receiver wants anyway.
+#define BEACON_MAGIC 0x4E434254 // "TBCN"
+#define CLOCK_WINDOW 8          // beacons per minimum-delay sample
+#define CLOCK_POINTS 16         // samples in the drift fit
+
+// Sent by the sender next to SensorData, told apart by its length.
+struct TimeBeacon
+{
+    uint32_t magic;
+    uint32_t seq;
+    int64_t senderUs; // sender's esp_timer_get_time() just before esp_now_send()
+};
+
+// The fitted line. Small enough to be handed to other tasks under a lock
+// while the estimator itself stays with the task that feeds it.
+struct ClockFit
+{
+    bool valid;
+    int64_t local;  // local time the line is centred on
+    int64_t offset; // local - sender there
+    double drift;   // change of the offset per local microsecond
+
+    // local - sender at a local time
+    int64_t offsetAt(int64_t localUs) const
+    {
+        return offset + (int64_t)(drift * (double)(localUs - local));
+    }
+
+    int64_t toSender(int64_t localUs) const
+    {
+        return localUs - offsetAt(localUs);
+    }
+};
+
+class ClockEstimator
+{
+public:
+    ClockEstimator()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        count = 0;
+        next = 0;
+        windowFill = 0;
+        windowOffset = 0;
+        windowLocal = 0;
+        lastSeq = 0;
+        haveSeq = false;
+        lostBeacons = 0;
+        line.valid = false;
+        line.local = 0;
+        line.offset = 0;
+        line.drift = 0;
+    }
+
+    // Feeds one beacon, times in microseconds. Returns true when the fit moved.
+    bool add(uint32_t seq, int64_t senderUs, int64_t localUs)
+    {
+        if (haveSeq && seq == lastSeq)
+            return false; // duplicate
+        if (haveSeq && seq < lastSeq)
+            reset(); // sender restarted, its clock did too
+        if (haveSeq && seq > lastSeq + 1)
+            lostBeacons += seq - lastSeq - 1;
+        lastSeq = seq;
+        haveSeq = true;
+
+        int64_t offset = localUs - senderUs;
+        if (windowFill == 0 || offset < windowOffset)
+        {
+            windowOffset = offset;
+            windowLocal = localUs;
+        }
+        if (++windowFill < CLOCK_WINDOW)
+            return false;
+        windowFill = 0;
+
+        pointLocal[next] = windowLocal;
+        pointOffset[next] = windowOffset;
+        next = (next + 1) % CLOCK_POINTS;
+        if (count < CLOCK_POINTS)
+            count++;
+        fit();
+        return true;
+    }
+
+    bool valid() const
+    {
+        return line.valid;
+    }
+
+    const ClockFit &current() const
+    {
+        return line;
+    }
+
+    // local - sender at a local time
+    int64_t offsetAt(int64_t localUs) const
+    {
+        return line.offsetAt(localUs);
+    }
+
+    int64_t toSender(int64_t localUs) const
+    {
+        return line.toSender(localUs);
+    }
+
+    int64_t toLocal(int64_t senderUs) const
+    {
+        return senderUs + offsetAt(senderUs + line.offset);
+    }
+
+    // Positive when the local clock runs fast against the sender's.
+    double driftPpm() const
+    {
+        return line.drift * 1e6;
+    }
+
+    uint32_t lost() const
+    {
+        return lostBeacons;
+    }
+
+private:
+    void fit()
+    {
+        // centre on the newest sample so the doubles keep microsecond precision
+        int last = (next + CLOCK_POINTS - 1) % CLOCK_POINTS;
+        int64_t x0 = pointLocal[last];
+        int64_t y0 = pointOffset[last];
+        double sx = 0, sy = 0, sxx = 0, sxy = 0;
+
+        for (int i = 0; i < count; i++)
+        {
+            double x = (double)(pointLocal[i] - x0);
+            double y = (double)(pointOffset[i] - y0);
+            sx += x;
+            sy += y;
+            sxx += x * x;
+            sxy += x * y;
+        }
+
+        double mx = sx / count;
+        double my = sy / count;
+        double vxx = sxx - sx * mx;
+        line.drift = count > 1 && vxx > 0 ? (sxy - sx * my) / vxx : 0;
+        line.local = x0 + (int64_t)mx;
+        line.offset = y0 + (int64_t)my;
+        line.valid = true;
+    }
+
+    int64_t pointLocal[CLOCK_POINTS];
+    int64_t pointOffset[CLOCK_POINTS];
+    int count;
+    int next;
+
+    int64_t windowOffset;
+    int64_t windowLocal;
+    int windowFill;
+
+    uint32_t lastSeq;
+    bool haveSeq;
+    uint32_t lostBeacons;
+
+    ClockFit line;
+};
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef DEBUGLOG_H
+#define DEBUGLOG_H
+
+#include <Arduino.h>
+#include <TelnetSpy.h>
+#include "binlog.h"
+#include "tasks.h"
+
+// Deferred log messages for the hot paths: the ingest task, the ESP-NOW
+// callback, the SD writer and the power task's jobs. LOG_WARN / LOG_INFO /
+// LOG_DEBUG only record the format, the time and the arguments into printRing,
+// without a lock, vsnprintf or the UART; the print task formats them into
+// debug (serial and telnet) at low priority. It also runs the telnet server,
+// which can be reached while WiFi is joined: in the boot task and on the
+// charger (serviceGroundWifi() in boot.h). The format must be a string
+// literal and %s arguments literals or name table entries, see binlog.h.
+//
+// Messages below LOG_LEVEL compile to nothing, arguments included. The "w: ",
+// "i: " or "d: " prefix is added by the macro.
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+#define PRINT_RING_LENGTH 128   // records of 80 bytes
+#define PRINT_POLL_MS 50        // print task poll; the power task flushes it before light sleep
+#define PRINT_LINE_LEN 256
+#define PRINT_TIMESTAMPS 0      // 1 to prefix each line with when it was logged, s since boot
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(fmt, ...) binLog("w: " fmt, ##__VA_ARGS__)
+#else
+#define LOG_WARN(fmt, ...) do { } while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(fmt, ...) binLog("i: " fmt, ##__VA_ARGS__)
+#else
+#define LOG_INFO(fmt, ...) do { } while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(fmt, ...) binLog("d: " fmt, ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(fmt, ...) do { } while (0)
+#endif
+
+extern TelnetSpy debug;
+
+BinLogRing<PRINT_RING_LENGTH> printRing;
+TaskHandle_t printer = NULL;
+
+template <typename... Args>
+void binLog(const char *fmt, Args... args)
+{
+    binLogPush(printRing, esp_timer_get_time(), fmt, args...);
+}
+
+void printTask(void *parameter)
+{
+    BinLogRecord r;
+    char line[PRINT_LINE_LEN];
+    uint32_t reportedDrops = 0;
+
+    for (;;)
+    {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(PRINT_POLL_MS));
+        // telnet: accepts clients while WiFi is up and sends them what is new
+        debug.handle();
+        if (printRing.empty())
+            continue;
+        taskBegin(TASK_PRINT);
+        while (printRing.pop(r))
+        {
+#if PRINT_TIMESTAMPS
+            debug.printf("%lu.%03lu ", (unsigned long)(r.us / 1000000), (unsigned long)(r.us / 1000 % 1000));
+#endif
+            size_t n = binLogFormat(r, line, sizeof(line));
+            debug.write((const uint8_t *)line, n);
+        }
+        if (printRing.droppedCount() != reportedDrops)
+        {
+            reportedDrops = printRing.droppedCount();
+            debug.printf("w: print ring full, %u messages dropped\n", reportedDrops);
+        }
+        taskEnd(TASK_PRINT);
+    }
+}
+
+void beginPrint()
+{
+    printer = startTask(TASK_PRINT, printTask, 4096, 1, 0);
+}
+
+// For the power task before light sleep: true, with the print task woken,
+// while messages are waiting to be printed.
+bool printPending()
+{
+    if (printRing.empty())
+        return false;
+    if (printer != NULL)
+        xTaskNotifyGive(printer);
+    return true;
+}
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef DVFS_H
+#define DVFS_H
+
+#include <Arduino.h>
+
+// CPU clock governor. Activities ask for the lowest clock they can live with
+// and the CPU runs at the highest one still asked for:
+//   DVFS_FAST   rendering and SD bursts, done sooner and back to sleep
+//   DVFS_RADIO  radio on; WiFi / ESP-NOW need at least 80 MHz
+//   DVFS_IDLE   nothing running but the loop between radio windows
+// Below 80 MHz the APB clock follows the CPU, which halves the LCD and SD SPI
+// clocks and the I2C and I2S timing, so only the idle level goes under 80 MHz,
+// everything that touches SPI asks for DVFS_FAST and the speaker and vibration
+// motor for at least DVFS_RADIO.
+#define DVFS_ENABLED 1
+#define DVFS_FAST_MHZ 240
+#define DVFS_RADIO_MHZ 80
+#define DVFS_IDLE_MHZ 40
+#define DVFS_REPORT_MS 60000
+
+enum DvfsLevel
+{
+    DVFS_IDLE,
+    DVFS_RADIO,
+    DVFS_FAST,
+    DVFS_LEVELS
+};
+
+const uint32_t dvfsMhz[DVFS_LEVELS] = {DVFS_IDLE_MHZ, DVFS_RADIO_MHZ, DVFS_FAST_MHZ};
+
+SemaphoreHandle_t dvfsLock = NULL;
+int dvfsCount[DVFS_LEVELS];
+DvfsLevel dvfsLevel = DVFS_FAST; // the core boots at 240 MHz
+int64_t dvfsSince = 0;
+int64_t dvfsResidency[DVFS_LEVELS];
+uint32_t dvfsTransitions = 0;
+uint32_t dvfsWorstSwitchUs = 0;
+
+// Switches to the highest level still requested. dvfsLock held.
+void dvfsApply()
+{
+    DvfsLevel want = DVFS_IDLE;
+    for (int l = DVFS_FAST; l > DVFS_IDLE; l--)
+    {
+        if (dvfsCount[l] > 0)
+        {
+            want = (DvfsLevel)l;
+            break;
+        }
+    }
+    if (want == dvfsLevel)
+        return;
+
+    int64_t now = esp_timer_get_time();
+    dvfsResidency[dvfsLevel] += now - dvfsSince;
+    setCpuFrequencyMhz(dvfsMhz[want]);
+    dvfsSince = esp_timer_get_time();
+
+    uint32_t took = dvfsSince - now;
+    if (took > dvfsWorstSwitchUs)
+        dvfsWorstSwitchUs = took;
+    dvfsTransitions++;
+    dvfsLevel = want;
+}
+
+void dvfsRequest(DvfsLevel level)
+{
+    if (!DVFS_ENABLED || dvfsLock == NULL)
+        return;
+    xSemaphoreTake(dvfsLock, portMAX_DELAY);
+    dvfsCount[level]++;
+    dvfsApply();
+    xSemaphoreGive(dvfsLock);
+}
+
+void dvfsRelease(DvfsLevel level)
+{
+    if (!DVFS_ENABLED || dvfsLock == NULL)
+        return;
+    xSemaphoreTake(dvfsLock, portMAX_DELAY);
+    if (dvfsCount[level] > 0)
+        dvfsCount[level]--;
+    dvfsApply();
+    xSemaphoreGive(dvfsLock);
+}
+
+// Holds DVFS_FAST until boot releases it.
+void beginDvfs()
+{
+    dvfsLock = xSemaphoreCreateMutex();
+    dvfsSince = esp_timer_get_time();
+    dvfsRequest(DVFS_FAST);
+}
+
+void dvfsReport(Print &out)
+{
+    static unsigned long lastReport = millis();
+    if (dvfsLock == NULL || millis() - lastReport < DVFS_REPORT_MS)
+        return;
+    lastReport = millis();
+
+    int64_t residency[DVFS_LEVELS];
+    xSemaphoreTake(dvfsLock, portMAX_DELAY);
+    int64_t now = esp_timer_get_time();
+    dvfsResidency[dvfsLevel] += now - dvfsSince;
+    dvfsSince = now;
+    int64_t total = 0;
+    for (int l = 0; l < DVFS_LEVELS; l++)
+    {
+        residency[l] = dvfsResidency[l];
+        dvfsResidency[l] = 0;
+        total += residency[l];
+    }
+    uint32_t transitions = dvfsTransitions;
+    uint32_t worst = dvfsWorstSwitchUs;
+    dvfsTransitions = 0;
+    xSemaphoreGive(dvfsLock);
+
+    out.print("i: dvfs");
+    for (int l = DVFS_LEVELS - 1; l >= 0; l--)
+        out.printf(" %uMHz=%.1f%%", dvfsMhz[l], total ? residency[l] * 100.0 / total : 0.0);
+    out.printf(", %u transitions, worst switch %u us\n", transitions, worst);
+}
+
+#endif
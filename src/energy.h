@@ -0,0 +1,106 @@
+#ifndef ENERGY_H
+#define ENERGY_H
+
+#include <Arduino.h>
+
+// Energy accounting. The time spent in each activity is summed (they can
+// overlap, the SD writer runs on the other core) and the battery current is
+// sampled from the AXP once a second. Every ENERGY_REPORT_MS one "i: energy"
+// line gives the residency of each activity, the average drain and the
+// runtime left; avialog energy fits a per-activity current to those lines.
+#define ENERGY_REPORT_MS 60000
+#define ENERGY_BATTERY_MAH 390 // Core2 internal cell
+
+enum EnergyState
+{
+    E_RENDER,
+    E_RADIO,
+    E_SLEEP,
+    E_SD,
+    E_AUDIO,
+    E_STATES
+};
+
+const char *energyStateNames[E_STATES] = {"render", "radio", "sleep", "sd", "audio"};
+
+portMUX_TYPE energyMux = portMUX_INITIALIZER_UNLOCKED;
+int64_t energySince[E_STATES];
+int energyDepth[E_STATES];
+int64_t energyTotal[E_STATES];
+
+double energyChargeMas = 0; // discharge since the last report, mA * s
+int64_t energySampledUs = 0;
+float energyCurrentMa = 0;  // last sample, negative while discharging
+
+void energyBegin(EnergyState state)
+{
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&energyMux);
+    if (energyDepth[state]++ == 0)
+        energySince[state] = now;
+    portEXIT_CRITICAL(&energyMux);
+}
+
+void energyEnd(EnergyState state)
+{
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&energyMux);
+    if (energyDepth[state] > 0 && --energyDepth[state] == 0)
+        energyTotal[state] += now - energySince[state];
+    portEXIT_CRITICAL(&energyMux);
+}
+
+// Microseconds spent in each state since the last call, open states included.
+void energyTake(int64_t *spent)
+{
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&energyMux);
+    for (int i = 0; i < E_STATES; i++)
+    {
+        spent[i] = energyTotal[i];
+        energyTotal[i] = 0;
+        if (energyDepth[i] > 0)
+        {
+            spent[i] += now - energySince[i];
+            energySince[i] = now;
+        }
+    }
+    portEXIT_CRITICAL(&energyMux);
+}
+
+// Called once a second from the power task. The current holds until the next sample,
+// so a sample after a light sleep is weighted by the whole gap.
+void energySample(bool onBattery)
+{
+    int64_t now = esp_timer_get_time();
+    if (energySampledUs != 0 && onBattery)
+        energyChargeMas += -energyCurrentMa * (now - energySampledUs) / 1e6;
+    energySampledUs = now;
+    energyCurrentMa = M5.Axp.GetBatCurrent();
+}
+
+void energyReport(Print &out)
+{
+    static unsigned long lastReport = millis();
+    unsigned long elapsed = millis() - lastReport;
+    if (elapsed < ENERGY_REPORT_MS)
+        return;
+    lastReport = millis();
+
+    int64_t spent[E_STATES];
+    energyTake(spent);
+
+    float drainMa = energyChargeMas / (elapsed / 1000.0);
+    energyChargeMas = 0;
+    float level = M5.Axp.GetBatteryLevel();
+
+    out.print("i: energy");
+    for (int i = 0; i < E_STATES; i++)
+        out.printf(" %s=%.2f", energyStateNames[i], spent[i] / (elapsed * 10.0));
+    out.printf(" %% drain=%.1f mA (mAh/h), battery %.0f%%", drainMa, level);
+    if (drainMa > 1)
+        out.printf(" ~%.1f h left", level / 100 * ENERGY_BATTERY_MAH / drainMa);
+    out.println();
+}
+
+#endif
@@ -3,12 +3,17 @@
 
 #include <Arduino.h>
 #include <esp_now.h>
+#include <esp_wifi.h>
 #include <WiFi.h>
 #include "global.h"
+#include "clocksync.h"
+#include "listen.h"
 
-bool sensorDataUpdated = false;
+#define RADIO_KEEP_INIT 1      // 0 = deinit ESP-NOW and the WiFi driver on every pause, as before
+#define RADIO_REPORT_MS 60000
 #define SENSOR_HISTORY_INTERVAL 5000 // 5 seconds
 #define SENSOR_HISTORY_LENGTH 300
+#define INGEST_QUEUE_LENGTH 8
 
 struct SensorData
 {
@@ -28,7 +33,102 @@ struct SensorData
     unsigned long timestamp; // time in milliseconds
 };
 
-SensorData sensorData;
+SensorData sensorData; // the render task's copy, see takeSensorData()
+
+void captureFrame(const SensorData &data, int64_t arrivalUs);
+
+// Frames go from the receive callback through ingestQueue to ingestTask, which
+// keeps the newest one in latestData for the render task.
+struct IngestFrame
+{
+    SensorData data;
+    int64_t arrivalUs;
+};
+
+QueueHandle_t ingestQueue = NULL;
+uint32_t ingestDropped = 0;
+portMUX_TYPE sensorMux = portMUX_INITIALIZER_UNLOCKED;
+SensorData latestData;
+int64_t latestArrivalUs = 0;
+bool latestFresh = false;
+
+// Hands a frame to the ingest task without blocking the caller.
+bool ingestFrame(const SensorData &data, int64_t arrivalUs)
+{
+    IngestFrame frame;
+    frame.data = data;
+    frame.arrivalUs = arrivalUs;
+    if (ingestQueue == NULL || xQueueSend(ingestQueue, &frame, 0) != pdTRUE)
+    {
+        ingestDropped++;
+        return false;
+    }
+    return true;
+}
+
+// Copies the newest frame and when it arrived. False if it was already taken.
+bool takeSensorData(SensorData &out, int64_t &arrivalUs)
+{
+    portENTER_CRITICAL(&sensorMux);
+    bool fresh = latestFresh;
+    out = latestData;
+    arrivalUs = latestArrivalUs;
+    latestFresh = false;
+    portEXIT_CRITICAL(&sensorMux);
+    return fresh;
+}
+
+// Sender clock. Only the receive callback feeds senderClock and runs its fit;
+// the resulting line is published in senderFit for the other tasks.
+ClockEstimator senderClock;
+ClockFit senderFit;
+portMUX_TYPE senderClockMux = portMUX_INITIALIZER_UNLOCKED;
+
+// The sender's esp_timer time at a local one, or -1 before the first fit.
+int64_t senderTimeUs(int64_t localUs)
+{
+    portENTER_CRITICAL(&senderClockMux);
+    ClockFit fit = senderFit;
+    portEXIT_CRITICAL(&senderClockMux);
+    return fit.valid ? fit.toSender(localUs) : -1;
+}
+
+// Radio schedule, run by the power task. The callback only notes when a frame
+// came in and wakes the power task if it is waiting for one.
+ListenScheduler listener;
+portMUX_TYPE frameMux = portMUX_INITIALIZER_UNLOCKED;
+int64_t frameArrivalUs = 0;
+bool frameArrived = false;
+TaskHandle_t frameWaiter = NULL;
+
+// The arrival time of the newest frame not yet taken.
+bool takeFrameArrival(int64_t &arrivalUs)
+{
+    portENTER_CRITICAL(&frameMux);
+    bool arrived = frameArrived;
+    arrivalUs = frameArrivalUs;
+    frameArrived = false;
+    portEXIT_CRITICAL(&frameMux);
+    return arrived;
+}
+
+// What each pause / resume cycle costs, to compare the two radio strategies.
+struct RadioStats
+{
+    uint32_t cycles;
+    int64_t onUs;         // total time resumed
+    int64_t resumeUs;     // total time spent in resumeWiFi()
+    uint32_t worstResumeUs;
+    int64_t wakeToRxUs;   // resume start to the first frame after it
+    uint32_t wakeToRxCount;
+    uint32_t worstWakeToRxUs;
+    uint32_t firstHeap;   // free heap after the first resume
+    uint32_t lastHeap;
+    uint32_t minHeap;
+} radioStats;
+
+int64_t radioResumedAt = -1; // set while resumed and no frame has come in yet
+int64_t radioOnSince = 0;
 
 // Define the array to hold the history of readings
 SensorData readings[SENSOR_HISTORY_LENGTH]; // 5 minutes x 6 readings per minute
@@ -46,34 +146,88 @@ void addReading(SensorData newReading)
     currentIndex = (currentIndex + 1) % 30;
 }
 
+void ingestTask(void *parameter)
+{
+    static unsigned long nextSavedReadingTimestamp;
+    IngestFrame frame;
+    uint32_t reportedDrops = 0;
+
+    for (;;)
+    {
+        xQueueReceive(ingestQueue, &frame, portMAX_DELAY);
+        taskBegin(TASK_INGEST);
+
+        captureFrame(frame.data, frame.arrivalUs);
+
+        if (millis() > nextSavedReadingTimestamp)
+        {
+
+            addReading(frame.data);
+            nextSavedReadingTimestamp = millis() + SENSOR_HISTORY_INTERVAL;
+            LOG_INFO("rx %i ** saved %i **\n", frame.data.frame, currentIndex);
+        }
+        else
+        {
+            LOG_INFO("rx %i\n", frame.data.frame);
+        }
+
+        portENTER_CRITICAL(&sensorMux);
+        latestData = frame.data;
+        latestArrivalUs = frame.arrivalUs;
+        latestFresh = true;
+        portEXIT_CRITICAL(&sensorMux);
+        xEventGroupSetBits(taskEvents, EV_FRAME);
+
+        taskEnd(TASK_INGEST, frame.arrivalUs);
+
+        if (ingestDropped != reportedDrops)
+        {
+            reportedDrops = ingestDropped;
+            LOG_WARN("ingest queue full, %u frames dropped\n", reportedDrops);
+        }
+    }
+}
+
 class ESPNowReceiver
 {
 private:
     static void onDataReceived(const uint8_t *mac_addr, const uint8_t *data, int len)
     {
-        static unsigned long nextSavedReadingTimestamp;
+        int64_t now = esp_timer_get_time();
 
-        if (len != sizeof(SensorData))
+        if (len == sizeof(TimeBeacon))
         {
-            Serial.println("Invalid data received");
+            onBeacon(data, now);
             return;
         }
 
-        if (!SIMULATE)
+        if (len != sizeof(SensorData))
         {
-            memcpy(&sensorData, data, sizeof(sensorData));
+            LOG_WARN("invalid frame, %d bytes\n", len);
+            return;
         }
 
-        if (millis() > nextSavedReadingTimestamp)
+        portENTER_CRITICAL(&frameMux);
+        frameArrivalUs = now;
+        frameArrived = true;
+        if (radioResumedAt >= 0)
         {
-
-            addReading(sensorData);
-            nextSavedReadingTimestamp = millis() + SENSOR_HISTORY_INTERVAL;
-            Serial.printf("i: rx %i ** saved %i **\n", sensorData.frame, currentIndex);
+            uint32_t latency = now - radioResumedAt;
+            radioStats.wakeToRxUs += latency;
+            radioStats.wakeToRxCount++;
+            if (latency > radioStats.worstWakeToRxUs)
+                radioStats.worstWakeToRxUs = latency;
+            radioResumedAt = -1;
         }
-        else
+        portEXIT_CRITICAL(&frameMux);
+        if (frameWaiter != NULL)
+            xTaskNotifyGive(frameWaiter);
+
+        if (!SIMULATE)
         {
-            Serial.printf("i: rx %i\n", sensorData.frame);
+            SensorData received;
+            memcpy(&received, data, sizeof(received));
+            ingestFrame(received, now);
         }
 
         // Serial.print("  MAC address: ");
@@ -85,16 +239,50 @@ private:
         //         Serial.print(":");
         //     }
         // }
+    }
 
-        sensorDataUpdated = true;
+    static void onBeacon(const uint8_t *data, int64_t now)
+    {
+        TimeBeacon beacon;
+        memcpy(&beacon, data, sizeof(beacon));
+        if (beacon.magic != BEACON_MAGIC)
+            return;
 
+        if (!senderClock.add(beacon.seq, beacon.senderUs, now))
+            return;
+        ClockFit fit = senderClock.current();
+        portENTER_CRITICAL(&senderClockMux);
+        senderFit = fit;
+        portEXIT_CRITICAL(&senderClockMux);
+
+        LOG_INFO("sender clock offset %lld us drift %.1f ppm, %u beacons lost\n",
+                 fit.offsetAt(now), senderClock.driftPpm(), senderClock.lost());
     }
 
+    bool listening = false;
+    bool initialised = false; // ESP-NOW, the callback stays registered while it is
+
 public:
     ESPNowReceiver()
     {
     }
 
+    bool isListening()
+    {
+        return listening;
+    }
+
+    // Pauses or resumes the radio, only when that changes its state.
+    void setListening(bool on)
+    {
+        if (on == listening)
+            return;
+        if (on)
+            resumeWiFi();
+        else
+            pauseWiFi();
+    }
+
     void debug()
     {
         Serial.println();
@@ -121,6 +309,9 @@ public:
     bool init()
     {
 
+        if (ingestQueue == NULL)
+            ingestQueue = xQueueCreate(INGEST_QUEUE_LENGTH, sizeof(IngestFrame));
+
         WiFi.mode(WIFI_STA);
         if (esp_now_init() != ESP_OK)
         {
@@ -132,31 +323,116 @@ public:
             Serial.println("ESP-NOW OK");
             esp_now_register_recv_cb(onDataReceived);
         }
+        initialised = true;
+        listening = true;
+        energyBegin(E_RADIO);
+        dvfsRequest(DVFS_RADIO);
+        radioOnSince = esp_timer_get_time();
         return true;
     }
 
+    // Keeping the driver and ESP-NOW initialised and only stopping the radio
+    // saves the deinit / init and the heap churn that comes with it on every
+    // cycle; the receive callback stays registered.
     void pauseWiFi()
     {
-        esp_now_deinit();
-        WiFi.mode(WIFI_OFF);
-        Serial.println("Wi-Fi paused");
+        if (!listening)
+            return;
+        if (RADIO_KEEP_INIT)
+            esp_wifi_stop();
+        else
+        {
+            esp_now_deinit();
+            WiFi.mode(WIFI_OFF);
+            initialised = false;
+        }
+        listening = false;
+        energyEnd(E_RADIO);
+        dvfsRelease(DVFS_RADIO);
+
+        portENTER_CRITICAL(&frameMux);
+        radioResumedAt = -1;
+        portEXIT_CRITICAL(&frameMux);
+        radioStats.onUs += esp_timer_get_time() - radioOnSince;
     }
 
     bool resumeWiFi()
     {
-        Serial.printf("Resume Wifi heap: %u\n",esp_get_free_heap_size());
-        WiFi.mode(WIFI_STA);
-        if (esp_now_init() == ESP_OK)
-        {
-            esp_now_register_recv_cb(onDataReceived);
-            Serial.println("ESP-NOW resumed successfully");
+        if (listening)
             return true;
+        int64_t start = esp_timer_get_time();
+        bool ok;
+
+        dvfsRequest(DVFS_RADIO); // before the radio starts
+
+        if (initialised)
+        {
+            ok = esp_wifi_start() == ESP_OK;
         }
         else
+        {
+            WiFi.mode(WIFI_STA);
+            ok = esp_now_init() == ESP_OK;
+            if (ok)
+                esp_now_register_recv_cb(onDataReceived);
+            initialised = ok;
+        }
+        if (!ok)
         {
             Serial.println("Error initializing ESP-NOW");
+            dvfsRelease(DVFS_RADIO);
             return false;
         }
+        listening = true;
+        energyBegin(E_RADIO);
+
+        int64_t now = esp_timer_get_time();
+        uint32_t took = now - start;
+        uint32_t heap = esp_get_free_heap_size();
+        portENTER_CRITICAL(&frameMux);
+        radioResumedAt = start;
+        portEXIT_CRITICAL(&frameMux);
+        radioOnSince = now;
+        radioStats.cycles++;
+        radioStats.resumeUs += took;
+        if (took > radioStats.worstResumeUs)
+            radioStats.worstResumeUs = took;
+        if (radioStats.firstHeap == 0)
+            radioStats.firstHeap = heap;
+        if (radioStats.minHeap == 0 || heap < radioStats.minHeap)
+            radioStats.minHeap = heap;
+        radioStats.lastHeap = heap;
+
+        // windows only need to open as early as the radio takes to come up
+        listener.wakeUs = min((int64_t)LISTEN_WAKE_US, (int64_t)radioStats.worstResumeUs + 2000);
+        return true;
+    }
+
+    void report(Print &out)
+    {
+        static unsigned long lastReport;
+        static int64_t lastOnUs;
+        static uint32_t lastCycles;
+
+        unsigned long elapsed = millis() - lastReport;
+        if (elapsed < RADIO_REPORT_MS || radioStats.cycles == lastCycles)
+            return;
+        lastReport = millis();
+
+        RadioStats s;
+        portENTER_CRITICAL(&frameMux);
+        s = radioStats;
+        portEXIT_CRITICAL(&frameMux);
+
+        out.printf("i: radio %s: on %.1f%%, %u cycles, resume %.2f ms avg %.2f max, "
+                   "wake to rx %.1f ms avg %.1f max, heap %u (%+d since first, min %u)\n",
+                   RADIO_KEEP_INIT ? "kept" : "deinit",
+                   (s.onUs - lastOnUs) / (elapsed * 10.0), s.cycles,
+                   s.resumeUs / 1000.0 / s.cycles, s.worstResumeUs / 1000.0,
+                   s.wakeToRxCount ? s.wakeToRxUs / 1000.0 / s.wakeToRxCount : 0.0, s.worstWakeToRxUs / 1000.0,
+                   s.lastHeap, (int)(s.lastHeap - s.firstHeap), s.minHeap);
+        lastOnUs = s.onUs;
+        lastCycles = s.cycles;
     }
 };
 
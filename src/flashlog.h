@@ -0,0 +1,325 @@
+#ifndef FLASHLOG_H
+#define FLASHLOG_H
+
+#include <Arduino.h>
+#include <esp_partition.h>
+#include <Preferences.h>
+#include "global.h"
+#include "logblock.h"
+#include "logcodec.h"
+
+// Fallback log in the internal flash, used while the SD card is missing or has
+// failed, and copied to the card as an ordinary journal once it is back.
+//
+// The spiffs data partition (unused by this firmware) is treated as a ring of
+// journal blocks written strictly in sequence. A 4 KB sector is erased just
+// before its first block is written, so every sector is erased exactly once
+// per lap and wear is spread evenly over the whole partition. Block sequence
+// numbers keep counting across laps and boots, block seq lives at slot
+// seq % flashBlocks, and the block CRC rejects anything torn or stale.
+
+#define FLASH_SECTOR_SIZE 4096
+#define FLASH_BLOCKS_PER_SECTOR (FLASH_SECTOR_SIZE / LOG_BLOCK_SIZE)
+#define FLASH_RING_ID 0x464C5641 // "AVLF", file id of every flash block
+#define FLASH_FLUSH_MS 5000      // partial blocks are written at most this often, bounds amplification
+#define FLASH_MIGRATE_BLOCKS 16  // blocks copied to the card per maintainFlash() call
+#define FLASH_SD_RETRY_MS 10000  // how often to look for a card while logging to flash
+#define FLASH_REPORT_MS 60000
+
+const esp_partition_t *flashPart = NULL;
+uint32_t flashBlocks = 0;   // ring size in blocks
+uint32_t flashSeq = 0;      // next block to write
+uint32_t flashMigrated = 0; // blocks before this seq are already on the card
+Preferences flashPrefs;
+
+LogBlock flashBlock;
+size_t flashUsed = 0;
+uint32_t flashTime;
+uint32_t flashMs;
+LogEncoder flashEncoder;
+unsigned long flashLastWrite = 0;
+
+struct FlashStats
+{
+    uint32_t records;
+    uint32_t blocks;
+    uint32_t erases;
+    uint64_t payloadBytes;
+    uint64_t writeUs;
+    uint64_t eraseUs;
+    uint32_t worstWriteUs;
+    uint32_t worstEraseUs;
+} flashStats;
+
+void packFrame(const LoggedFrame &f, PackedRecord &r);
+bool remountSD();
+bool writeSuperBlock(File &file, LogSuperBlock &sb);
+
+bool readFlashBlock(uint32_t seq, LogBlock &block)
+{
+    uint32_t slot = seq % flashBlocks;
+    return esp_partition_read(flashPart, slot * LOG_BLOCK_SIZE, &block, LOG_BLOCK_SIZE) == ESP_OK &&
+           logBlockValid(block, FLASH_RING_ID, seq);
+}
+
+// Oldest sequence number still in the ring. The sector being filled has
+// already lost the rest of its previous lap.
+uint32_t flashOldest()
+{
+    uint32_t partial = flashSeq % FLASH_BLOCKS_PER_SECTOR;
+    uint32_t kept = partial ? flashBlocks - FLASH_BLOCKS_PER_SECTOR + partial : flashBlocks;
+    return flashSeq > kept ? flashSeq - kept : 0;
+}
+
+// Finds the head of the ring: the newest valid block. Reads one header per
+// sector, then walks the newest sector.
+bool beginFlashLog()
+{
+    static LogBlock block;
+
+    flashPart = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, NULL);
+    if (flashPart == NULL)
+    {
+        Serial.println("w: no flash partition for the fallback log");
+        return false;
+    }
+    flashBlocks = flashPart->size / FLASH_SECTOR_SIZE * FLASH_BLOCKS_PER_SECTOR;
+
+    bool found = false;
+    uint32_t newest = 0;
+    for (uint32_t slot = 0; slot < flashBlocks; slot += FLASH_BLOCKS_PER_SECTOR)
+    {
+        if (esp_partition_read(flashPart, slot * LOG_BLOCK_SIZE, &block, LOG_BLOCK_SIZE) != ESP_OK)
+            continue;
+        uint32_t seq = block.header.seq;
+        if (seq % flashBlocks == slot && logBlockValid(block, FLASH_RING_ID, seq) && (!found || seq > newest))
+        {
+            newest = seq;
+            found = true;
+        }
+    }
+
+    flashSeq = 0;
+    if (found)
+    {
+        flashSeq = newest + 1;
+        while (flashSeq % FLASH_BLOCKS_PER_SECTOR && readFlashBlock(flashSeq, block))
+            flashSeq++;
+    }
+
+    flashPrefs.begin("flashlog", false);
+    flashMigrated = flashPrefs.getUInt("migrated", 0);
+    if (flashMigrated > flashSeq)
+        flashMigrated = flashSeq;
+    if (flashMigrated < flashOldest())
+        flashMigrated = flashOldest();
+
+    Serial.printf("i: flash log %u KB, next block %u, %u not on SD\n",
+                  flashPart->size / 1024, flashSeq, flashSeq - flashMigrated);
+    return true;
+}
+
+bool writeFlashBlock()
+{
+    if (flashUsed == 0 || flashPart == NULL)
+        return true;
+
+    uint32_t slot = flashSeq % flashBlocks;
+    unsigned long start = micros();
+    if (slot % FLASH_BLOCKS_PER_SECTOR == 0)
+    {
+        esp_partition_erase_range(flashPart, slot * LOG_BLOCK_SIZE, FLASH_SECTOR_SIZE);
+        uint32_t took = micros() - start;
+        flashStats.erases++;
+        flashStats.eraseUs += took;
+        if (took > flashStats.worstEraseUs)
+            flashStats.worstEraseUs = took;
+        start = micros();
+    }
+
+    logSealBlock(flashBlock, FLASH_RING_ID, flashSeq, LOG_BLOCK_PACKED, flashUsed, flashTime, flashMs,
+                 LOG_BLOCK_SENDER_MS);
+    bool ok = esp_partition_write(flashPart, slot * LOG_BLOCK_SIZE, &flashBlock, LOG_BLOCK_SIZE) == ESP_OK;
+
+    uint32_t took = micros() - start;
+    flashStats.blocks++;
+    flashStats.payloadBytes += flashUsed;
+    flashStats.writeUs += took;
+    if (took > flashStats.worstWriteUs)
+        flashStats.worstWriteUs = took;
+
+    flashSeq++;
+    flashUsed = 0;
+    flashEncoder.reset();
+    flashLastWrite = millis();
+    return ok;
+}
+
+// Logs a batch the SD card could not take. Blocks are only written when full
+// or every FLASH_FLUSH_MS, so a partial block costs at most one per interval.
+bool writeFlash(const LoggedFrame *frames, size_t count)
+{
+    PackedRecord record;
+
+    if (flashPart == NULL)
+        return false;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        packFrame(frames[i], record);
+        size_t n = flashEncoder.encode(record, flashBlock.payload + flashUsed, LOG_PAYLOAD_SIZE - flashUsed);
+        if (n == 0)
+        {
+            writeFlashBlock();
+            n = flashEncoder.encode(record, flashBlock.payload, LOG_PAYLOAD_SIZE);
+        }
+        if (flashUsed == 0)
+        {
+            flashTime = record.v[F_TIME];
+            flashMs = record.v[F_MS];
+        }
+        flashUsed += n;
+        flashStats.records++;
+    }
+
+    if (millis() - flashLastWrite >= FLASH_FLUSH_MS)
+        return writeFlashBlock();
+    return true;
+}
+
+// Copies the blocks not yet on the card into their own journal, named by the
+// time of the first one, a few blocks per call so the frame ring never backs up.
+void migrateFlash()
+{
+    static File out;
+    static LogSuperBlock sb;
+    static uint32_t outSeq;
+    static uint32_t outStart;
+    static LogBlock block;
+    char path[20];
+    char created[20];
+
+    if (!out)
+    {
+        if (flashMigrated < flashOldest())
+            flashMigrated = flashOldest();
+        if (flashMigrated >= flashSeq)
+            return;
+        if (!readFlashBlock(flashMigrated, block))
+        {
+            flashMigrated++; // torn or unreadable, nothing to copy
+            return;
+        }
+
+        // never truncate a journal that happens to share the second
+        uint32_t time = block.header.time;
+        do
+        {
+            logSecondsToTime(time++, created, sizeof(created));
+            snprintf(path, sizeof(path), "/%.4s%.2s%.2s%.2s%.2s%.2s.log",
+                     created, created + 5, created + 8, created + 11, created + 14, created + 17);
+        } while (SD.exists(path));
+
+        out = SD.open(path, FILE_WRITE);
+        if (!out)
+            return;
+        memset(&sb, 0, sizeof(sb));
+        sb.magic = LOG_SUPER_MAGIC;
+        sb.version = LOG_VERSION;
+        sb.blockSize = LOG_BLOCK_SIZE;
+        sb.fileId = esp_random();
+        sb.capacity = min(flashSeq - flashMigrated + 1, (uint32_t)LOG_FILE_BLOCKS);
+        logSecondsToTime(block.header.time, sb.created, sizeof(sb.created));
+        writeSuperBlock(out, sb);
+        sb.generation++;
+        writeSuperBlock(out, sb);
+
+        // the same column header block as every other journal, see openJournal()
+        size_t len = strlen(LOG_CSV_HEADER);
+        memcpy(block.payload, LOG_CSV_HEADER, len);
+        logSealBlock(block, sb.fileId, 0, LOG_BLOCK_CSV, len, block.header.time, block.header.ms);
+        out.seek(LOG_DATA_START * LOG_BLOCK_SIZE);
+        if (out.write((const uint8_t *)&block, LOG_BLOCK_SIZE) != LOG_BLOCK_SIZE)
+        {
+            Serial.println("w: flash log copy failed");
+            out.close();
+            return;
+        }
+        outSeq = 1;
+        outStart = flashMigrated;
+        Serial.printf("i: copying %u flash log blocks to %s\n", sb.capacity - 1, path);
+    }
+
+    for (int i = 0; i < FLASH_MIGRATE_BLOCKS && outSeq < sb.capacity && flashMigrated < flashSeq; i++)
+    {
+        if (readFlashBlock(flashMigrated, block))
+        {
+            logSealBlock(block, sb.fileId, outSeq, block.header.type, block.header.length,
+                         block.header.time, block.header.ms, block.header.flags);
+            out.seek((LOG_DATA_START + outSeq) * LOG_BLOCK_SIZE);
+            if (out.write((const uint8_t *)&block, LOG_BLOCK_SIZE) != LOG_BLOCK_SIZE)
+            {
+                // card gone again, start this file over next time
+                Serial.println("w: flash log copy failed");
+                out.close();
+                flashMigrated = outStart;
+                return;
+            }
+            outSeq++;
+        }
+        flashMigrated++;
+    }
+
+    if (outSeq == sb.capacity || flashMigrated >= flashSeq)
+    {
+        out.flush();
+        sb.generation++;
+        sb.capacity = outSeq;
+        sb.committed = outSeq;
+        writeSuperBlock(out, sb);
+        out.close();
+        flashPrefs.putUInt("migrated", flashMigrated);
+    }
+}
+
+// Writer side housekeeping: look for the card again while it is missing and
+// move the flash backlog over once it is back.
+void maintainFlash()
+{
+    static unsigned long lastRetry;
+    static unsigned long lastReport;
+
+    if (flashPart == NULL)
+        return;
+
+    if (!sdPresent)
+    {
+        if (flashUsed > 0 && millis() - flashLastWrite >= FLASH_FLUSH_MS)
+            writeFlashBlock();
+        if (millis() - lastRetry >= FLASH_SD_RETRY_MS)
+        {
+            lastRetry = millis();
+            remountSD();
+        }
+    }
+    else if (flashMigrated < flashSeq && frameRing.size() < LOG_RING_LENGTH / 4)
+    {
+        // the partial block has to reach flash before it can be copied
+        writeFlashBlock();
+        migrateFlash();
+    }
+
+    if (flashStats.records > 0 && millis() - lastReport >= FLASH_REPORT_MS)
+    {
+        lastReport = millis();
+        uint64_t written = (uint64_t)flashStats.blocks * LOG_BLOCK_SIZE;
+        Serial.printf("i: flash log %u records %u blocks %u erases, amplification %.2f, "
+                      "%.0f us/record, worst write %u us erase %u us\n",
+                      flashStats.records, flashStats.blocks, flashStats.erases,
+                      flashStats.payloadBytes ? (double)written / flashStats.payloadBytes : 0.0,
+                      (double)(flashStats.writeUs + flashStats.eraseUs) / flashStats.records,
+                      flashStats.worstWriteUs, flashStats.worstEraseUs);
+    }
+}
+
+#endif
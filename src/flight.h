@@ -0,0 +1,191 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "logblock.h"
+
+// Flight segmentation and the on-card flight index. Free of Arduino headers so
+// the host tools use the same detector and record layout.
+//
+// A flight is the engine running, judged by oil pressure with hysteresis: the
+// pressure has to stay above FLIGHT_OIL_ON for FLIGHT_START_MS to start one
+// and below FLIGHT_OIL_OFF for FLIGHT_STOP_MS to end it.
+
+#define FLIGHT_OIL_ON 0.5     // bar
+#define FLIGHT_OIL_OFF 0.3    // bar
+#define FLIGHT_START_MS 10000 // ignores a brief crank or a pressure spike
+#define FLIGHT_STOP_MS 30000  // rides through a short dip or a lost sender
+#define FLIGHT_INDEX_MAGIC 0x49465641 // "AVFI"
+#define FLIGHT_INDEX_VERSION 1
+#define FLIGHT_CHANNELS 7
+
+const char *flightChannelNames[FLIGHT_CHANNELS] = {
+    "batteryVoltage", "amp", "fuelLitres", "fuelPress", "oilTemp", "oilPress", "cht1"};
+
+enum FlightChannel
+{
+    CH_BATTERY_VOLTAGE,
+    CH_AMP,
+    CH_FUEL_LITRES,
+    CH_FUEL_PRESS,
+    CH_OIL_TEMP,
+    CH_OIL_PRESS,
+    CH_CHT1,
+};
+
+struct ChannelSummary
+{
+    float min;
+    float max;
+    float mean;
+};
+
+// One fixed-size record per flight in the index file, rewritten in place while
+// the flight is in progress.
+struct FlightRecord
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t closed;    // 0 while in progress, or if power was lost before the stop
+    char startFile[20]; // journal and data block holding the first sample
+    uint32_t startBlock;
+    char endFile[20];
+    uint32_t endBlock;
+    char startTime[20]; // RTC time of the first sample
+    uint32_t durationMs;
+    uint32_t samples;
+    ChannelSummary channels[FLIGHT_CHANNELS];
+    uint32_t crc;
+};
+
+void flightSeal(FlightRecord &record)
+{
+    record.magic = FLIGHT_INDEX_MAGIC;
+    record.version = FLIGHT_INDEX_VERSION;
+    record.crc = 0;
+    record.crc = logCrc32(&record, sizeof(record));
+}
+
+bool flightValid(const FlightRecord &record)
+{
+    FlightRecord copy = record;
+    copy.crc = 0;
+    return record.magic == FLIGHT_INDEX_MAGIC &&
+           record.version == FLIGHT_INDEX_VERSION &&
+           record.crc == logCrc32(&copy, sizeof(copy));
+}
+
+struct ChannelStats
+{
+    float min;
+    float max;
+    double sum;
+    uint32_t count;
+
+    void reset()
+    {
+        min = max = 0;
+        sum = 0;
+        count = 0;
+    }
+
+    void add(float value)
+    {
+        if (count == 0 || value < min)
+            min = value;
+        if (count == 0 || value > max)
+            max = value;
+        sum += value;
+        count++;
+    }
+
+    void merge(const ChannelStats &other)
+    {
+        if (other.count == 0)
+            return;
+        if (count == 0 || other.min < min)
+            min = other.min;
+        if (count == 0 || other.max > max)
+            max = other.max;
+        sum += other.sum;
+        count += other.count;
+    }
+
+    ChannelSummary summary() const
+    {
+        ChannelSummary s = {min, max, count ? (float)(sum / count) : 0.0f};
+        return s;
+    }
+};
+
+enum FlightEvent
+{
+    FLIGHT_NONE,
+    FLIGHT_ARMED,    // pressure just came up, may become a flight
+    FLIGHT_DISARMED, // ...but did not last
+    FLIGHT_STARTED,  // start is backdated to the FLIGHT_ARMED sample
+    FLIGHT_STOPPED,
+};
+
+class FlightDetector
+{
+public:
+    FlightEvent update(unsigned long ms, float oilPress, bool oilPressError)
+    {
+        bool running = !oilPressError && oilPress > (flying ? FLIGHT_OIL_OFF : FLIGHT_OIL_ON);
+
+        if (!flying)
+        {
+            if (running && !armed)
+            {
+                armed = true;
+                since = ms;
+                return FLIGHT_ARMED;
+            }
+            if (!running && armed)
+            {
+                armed = false;
+                return FLIGHT_DISARMED;
+            }
+            if (running && ms - since >= FLIGHT_START_MS)
+            {
+                flying = true;
+                armed = false;
+                started = since;
+                lastRunning = ms;
+                return FLIGHT_STARTED;
+            }
+            return FLIGHT_NONE;
+        }
+
+        if (running)
+        {
+            lastRunning = ms;
+            return FLIGHT_NONE;
+        }
+        if (ms - lastRunning >= FLIGHT_STOP_MS)
+        {
+            flying = false;
+            stopped = lastRunning;
+            return FLIGHT_STOPPED;
+        }
+        return FLIGHT_NONE;
+    }
+
+    bool inFlight() const { return flying; }
+    bool engineOn() const { return flying || armed; } // in a flight or about to start one
+    unsigned long startMs() const { return started; }
+    unsigned long stopMs() const { return stopped; }
+
+private:
+    bool flying = false;
+    bool armed = false;
+    unsigned long since = 0;
+    unsigned long lastRunning = 0;
+    unsigned long started = 0;
+    unsigned long stopped = 0;
+};
+
+#endif
@@ -0,0 +1,164 @@
+#ifndef FLIGHTINDEX_H
+#define FLIGHTINDEX_H
+
+#include <Arduino.h>
+#include "global.h"
+#include "flight.h"
+#include <SD.h>
+
+// Maintains /flights.idx, one FlightRecord per flight, so a viewer can list
+// flights and seek straight to one without reading the journals.
+#define FLIGHT_INDEX_FILE "/flights.idx"
+#define FLIGHT_UPDATE_MS 60000 // rewrite the open record this often during a flight
+
+FlightDetector flightDetector;
+FlightRecord currentFlight;
+ChannelStats flightStats[FLIGHT_CHANNELS];
+ChannelStats tailStats[FLIGHT_CHANNELS]; // since the engine went below FLIGHT_OIL_OFF
+int32_t flightSlot = -1; // record number of the open flight in the index
+volatile bool flightActive = false; // engine on, the power task keeps the radio up for every frame
+
+// position of the sample that armed the detector, becomes the flight start
+char armedFile[20];
+uint32_t armedBlock;
+char armedTime[20];
+
+void frameChannels(const SensorData &data, float *values)
+{
+    values[CH_BATTERY_VOLTAGE] = data.batteryVoltage;
+    values[CH_AMP] = data.amp;
+    values[CH_FUEL_LITRES] = data.fuelLitres;
+    values[CH_FUEL_PRESS] = data.fuelPress;
+    values[CH_OIL_TEMP] = data.oilTemp;
+    values[CH_OIL_PRESS] = data.oilPress;
+    values[CH_CHT1] = data.cht1;
+}
+
+bool writeFlightRecord()
+{
+    if (!sdPresent || flightSlot < 0)
+        return false;
+
+    strncpy(currentFlight.endFile, fileName, sizeof(currentFlight.endFile));
+    currentFlight.endBlock = journalSeq;
+    currentFlight.samples = flightStats[0].count;
+    for (int i = 0; i < FLIGHT_CHANNELS; i++)
+        currentFlight.channels[i] = flightStats[i].summary();
+    flightSeal(currentFlight);
+
+    File index = SD.open(FLIGHT_INDEX_FILE, SD.exists(FLIGHT_INDEX_FILE) ? "r+" : FILE_WRITE);
+    if (!index)
+        return false;
+    index.seek(flightSlot * sizeof(FlightRecord));
+    bool ok = index.write((const uint8_t *)&currentFlight, sizeof(currentFlight)) == sizeof(currentFlight);
+    index.close();
+    return ok;
+}
+
+// Runs the detector over a batch before it is written, so journalSeq is the
+// block the batch will start in. Samples after the engine stops are held in
+// tailStats and only counted if it starts again before the flight is closed,
+// as avialog report does, so the shutdown does not end up in the minimums.
+void trackFlights(const LoggedFrame *frames, size_t count)
+{
+    static unsigned long lastWrite;
+    float values[FLIGHT_CHANNELS];
+
+    for (size_t n = 0; n < count; n++)
+    {
+        const LoggedFrame &f = frames[n];
+
+        switch (flightDetector.update(f.ms, f.data.oilPress, f.data.oilPressError))
+        {
+        case FLIGHT_ARMED:
+            memcpy(armedFile, fileName, sizeof(armedFile));
+            armedBlock = journalSeq;
+            memcpy(armedTime, f.timeStr, sizeof(armedTime));
+            break;
+
+        case FLIGHT_STARTED:
+        {
+            memset(&currentFlight, 0, sizeof(currentFlight));
+            memcpy(currentFlight.startFile, armedFile, sizeof(currentFlight.startFile));
+            currentFlight.startBlock = armedBlock;
+            memcpy(currentFlight.startTime, armedTime, sizeof(currentFlight.startTime));
+            for (int i = 0; i < FLIGHT_CHANNELS; i++)
+            {
+                flightStats[i].reset();
+                tailStats[i].reset();
+            }
+
+            File index = SD.open(FLIGHT_INDEX_FILE);
+            flightSlot = index ? index.size() / sizeof(FlightRecord) : 0;
+            index.close();
+
+            Serial.printf("i: flight %d started %s\n", flightSlot, armedTime);
+            writeFlightRecord();
+            lastWrite = f.ms;
+            break;
+        }
+
+        case FLIGHT_STOPPED:
+            currentFlight.durationMs = flightDetector.stopMs() - flightDetector.startMs();
+            currentFlight.closed = 1;
+            writeFlightRecord();
+            LOG_INFO("flight %d stopped after %lu s\n", flightSlot, currentFlight.durationMs / 1000);
+            flightSlot = -1;
+            break;
+
+        default:
+            break;
+        }
+
+        if (flightDetector.inFlight())
+        {
+            bool running = !f.data.oilPressError && f.data.oilPress > FLIGHT_OIL_OFF;
+            frameChannels(f.data, values);
+            for (int i = 0; i < FLIGHT_CHANNELS; i++)
+            {
+                if (!running)
+                {
+                    tailStats[i].add(values[i]);
+                    continue;
+                }
+                flightStats[i].merge(tailStats[i]);
+                tailStats[i].reset();
+                flightStats[i].add(values[i]);
+            }
+
+            if (f.ms - lastWrite >= FLIGHT_UPDATE_MS)
+            {
+                currentFlight.durationMs = f.ms - flightDetector.startMs();
+                writeFlightRecord();
+                lastWrite = f.ms;
+            }
+        }
+    }
+    flightActive = flightDetector.engineOn();
+}
+
+void listFlights()
+{
+    File index = SD.open(FLIGHT_INDEX_FILE);
+    if (!index)
+        return;
+
+    FlightRecord record;
+    int n = 0;
+    while (index.read((uint8_t *)&record, sizeof(record)) == sizeof(record))
+    {
+        if (flightValid(record))
+        {
+            Serial.printf("i: flight %d %s %3lu min %s:%u oil max %0.1fC min %0.1fbar%s\n",
+                          n, record.startTime, record.durationMs / 60000,
+                          record.startFile, record.startBlock,
+                          record.channels[CH_OIL_TEMP].max,
+                          record.channels[CH_OIL_PRESS].min,
+                          record.closed ? "" : " (open)");
+        }
+        n++;
+    }
+    index.close();
+}
+
+#endif
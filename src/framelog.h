@@ -0,0 +1,128 @@
+#ifndef FRAMELOG_H
+#define FRAMELOG_H
+
+#include <Arduino.h>
+#include "global.h"
+#include "ringbuffer.h"
+
+// Every received frame is captured here at the sender's rate and written to the
+// card in batches by logWriterTask, independently of the 1 Hz display tick.
+#define LOG_RING_LENGTH 256 // ~5 seconds of frames at 50 Hz
+#define LOG_INTERVAL_MS 0   // minimum spacing between logged frames, 0 = every frame
+#define LOG_BATCH_FRAMES 25 // wake the writer once this many frames are queued
+#define LOG_FLUSH_MS 1000   // otherwise flush whatever is queued at this interval
+
+extern float accX, accY, accZ;
+extern bool sdPresent;
+
+struct LoggedFrame
+{
+    SensorData data;
+    float accX;
+    float accY;
+    float accZ;
+    unsigned long ms;       // millis() at capture
+    unsigned long senderMs; // sender's clock at arrival, 0 until it is fitted
+    char timeStr[20];
+};
+
+SpscRing<LoggedFrame, LOG_RING_LENGTH> frameRing;
+TaskHandle_t logWriterHandle = NULL;
+unsigned long logIntervalMs = LOG_INTERVAL_MS;
+
+size_t writeSD(const LoggedFrame *frames, size_t count);
+bool writeFlash(const LoggedFrame *frames, size_t count);
+void maintainSD();
+void maintainFlash();
+void trackFlights(const LoggedFrame *frames, size_t count);
+
+// Called once per frame by the single producer, the ingest task. The frame
+// keeps millis() for everything on this device and also carries the sender's
+// clock (see clocksync.h) for lining the log up with the sensor node. Only the
+// former is monotonic: the fit steps when it is first published and again
+// when the sender restarts.
+void captureFrame(const SensorData &data, int64_t arrivalUs)
+{
+    static unsigned long lastCaptured;
+    unsigned long now = millis();
+
+    if (logIntervalMs > 0 && now - lastCaptured < logIntervalMs)
+        return;
+    lastCaptured = now;
+
+    LoggedFrame frame;
+    frame.data = data;
+    frame.accX = accX;
+    frame.accY = accY;
+    frame.accZ = accZ;
+    int64_t senderUs = senderTimeUs(arrivalUs);
+    frame.ms = now;
+    frame.senderMs = senderUs >= 0 ? (unsigned long)(senderUs / 1000) : 0;
+    getRtcTime(frame.timeStr, sizeof(frame.timeStr));
+
+    frameRing.push(frame);
+
+    if (logWriterHandle != NULL && frameRing.size() >= LOG_BATCH_FRAMES)
+        xTaskNotifyGive(logWriterHandle);
+}
+
+void logWriterTask(void *parameter)
+{
+    static LoggedFrame batch[LOG_BATCH_FRAMES];
+    uint32_t reportedDrops = 0;
+    uint32_t lostFrames = 0; // on neither the card nor the flash log
+    uint32_t reportedLost = 0;
+
+    for (;;)
+    {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(LOG_FLUSH_MS));
+
+        if (frameRing.size() == 0)
+        {
+            // nothing to write: only the timed upkeep (flash flush, SD
+            // remount), without asking for the fast clock
+            taskBegin(TASK_LOG);
+            maintainSD();
+            maintainFlash();
+            taskEnd(TASK_LOG);
+            continue;
+        }
+
+        size_t n;
+        taskBegin(TASK_LOG);
+        energyBegin(E_SD);
+        dvfsRequest(DVFS_FAST);
+        while ((n = frameRing.popBatch(batch, LOG_BATCH_FRAMES)) > 0)
+        {
+            trackFlights(batch, n);
+            // whatever the card did not take goes to the flash log
+            size_t done = writeSD(batch, n);
+            if (done < n && !writeFlash(batch + done, n - done))
+                lostFrames += n - done;
+        }
+        maintainSD();
+        maintainFlash();
+        dvfsRelease(DVFS_FAST);
+        energyEnd(E_SD);
+        taskEnd(TASK_LOG);
+
+        if (frameRing.droppedCount() != reportedDrops)
+        {
+            reportedDrops = frameRing.droppedCount();
+            LOG_WARN("log ring full, %u frames dropped (peak %u/%u)\n",
+                     reportedDrops, frameRing.peakUsed(), frameRing.capacity());
+        }
+        if (lostFrames != reportedLost)
+        {
+            reportedLost = lostFrames;
+            LOG_WARN("%u frames on neither the card nor the flash log\n", reportedLost);
+        }
+    }
+}
+
+void beginFrameLog()
+{
+    logWriterHandle = startTask(TASK_LOG, logWriterTask, 4096, 1, 0);
+}
+
+#endif
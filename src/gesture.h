@@ -0,0 +1,167 @@
+#ifndef GESTURE_H
+#define GESTURE_H
+
+#include <stdint.h>
+
+// Turns touch samples into debounced gestures. Plain C++, fed by the UI task
+// with one sample per TOUCH_TRACK_MS while a finger is down.
+//
+// A contact has to last TOUCH_DEBOUNCE_MS to count and be gone for
+// TOUCH_RELEASE_MS to end, so a dropped sample neither starts nor splits a
+// gesture. Holding still for TOUCH_LONG_MS is a long press, reported while
+// the finger is still down; moving TOUCH_SWIPE_PX or more is a swipe in the
+// direction of the larger movement; anything else is a tap.
+#define TOUCH_DEBOUNCE_MS 30
+#define TOUCH_RELEASE_MS 50
+#define TOUCH_LONG_MS 600
+#define TOUCH_SWIPE_PX 40
+
+enum GestureType
+{
+    GESTURE_NONE,
+    GESTURE_TAP,
+    GESTURE_LONG_PRESS,
+    GESTURE_SWIPE_LEFT,
+    GESTURE_SWIPE_RIGHT,
+    GESTURE_SWIPE_UP,
+    GESTURE_SWIPE_DOWN
+};
+
+const char *const gestureNames[] = {"none", "tap", "long press", "swipe left", "swipe right", "swipe up", "swipe down"};
+
+struct Gesture
+{
+    GestureType type;
+    int16_t x; // where the touch started
+    int16_t y;
+    int16_t dx; // movement from there
+    int16_t dy;
+    uint32_t heldMs;
+};
+
+class GestureDetector
+{
+public:
+    GestureDetector()
+        : state(IDLE), startMs(0), releaseMs(0), x0(0), y0(0), x(0), y(0), longSent(false)
+    {
+    }
+
+    // Feeds one sample. Returns true with out filled when a gesture is complete.
+    bool sample(bool pressed, int sx, int sy, uint32_t nowMs, Gesture &out)
+    {
+        switch (state)
+        {
+        case IDLE:
+            if (pressed)
+            {
+                state = PENDING;
+                startMs = nowMs;
+                x0 = x = sx;
+                y0 = y = sy;
+                longSent = false;
+            }
+            return false;
+
+        case PENDING:
+            if (!pressed)
+            {
+                state = IDLE; // too short, a glitch
+                return false;
+            }
+            x = sx;
+            y = sy;
+            if (nowMs - startMs >= TOUCH_DEBOUNCE_MS)
+                state = DOWN;
+            return false;
+
+        case DOWN:
+            if (!pressed)
+            {
+                state = RELEASING;
+                releaseMs = nowMs;
+                return false;
+            }
+            x = sx;
+            y = sy;
+            if (!longSent && !moved() && nowMs - startMs >= TOUCH_LONG_MS)
+            {
+                longSent = true;
+                fill(out, GESTURE_LONG_PRESS, nowMs);
+                return true;
+            }
+            return false;
+
+        case RELEASING:
+            if (pressed)
+            {
+                state = DOWN; // bounce
+                x = sx;
+                y = sy;
+                return false;
+            }
+            if (nowMs - releaseMs < TOUCH_RELEASE_MS)
+                return false;
+            state = IDLE;
+            if (longSent)
+                return false; // already reported
+            if (moved())
+            {
+                int dx = x - x0, dy = y - y0;
+                if (absInt(dx) >= absInt(dy))
+                    fill(out, dx < 0 ? GESTURE_SWIPE_LEFT : GESTURE_SWIPE_RIGHT, releaseMs);
+                else
+                    fill(out, dy < 0 ? GESTURE_SWIPE_UP : GESTURE_SWIPE_DOWN, releaseMs);
+                return true;
+            }
+            fill(out, GESTURE_TAP, releaseMs);
+            return true;
+        }
+        return false;
+    }
+
+    // True from the first contact until the release has been confirmed; the
+    // caller keeps sampling while it is.
+    bool active() const
+    {
+        return state != IDLE;
+    }
+
+private:
+    enum State
+    {
+        IDLE,
+        PENDING,
+        DOWN,
+        RELEASING
+    };
+
+    static int absInt(int v)
+    {
+        return v < 0 ? -v : v;
+    }
+
+    bool moved() const
+    {
+        return absInt(x - x0) >= TOUCH_SWIPE_PX || absInt(y - y0) >= TOUCH_SWIPE_PX;
+    }
+
+    void fill(Gesture &out, GestureType type, uint32_t endMs) const
+    {
+        out.type = type;
+        out.x = x0;
+        out.y = y0;
+        out.dx = x - x0;
+        out.dy = y - y0;
+        out.heldMs = endMs - startMs;
+    }
+
+    State state;
+    uint32_t startMs;
+    uint32_t releaseMs;
+    int x0, y0;
+    int x, y;
+    bool longSent;
+};
+
+#endif
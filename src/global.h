@@ -9,10 +9,22 @@
 #include <Arduino.h>
 #include <TelnetSpy.h>
 #include <M5Core2.h>
+#include "energy.h"
+#include "dvfs.h"
+#include "tasks.h"
+#include "debuglog.h"
+#include "timerwheel.h"
+#include "touch.h"
+#include "charging.h"
 #include "espnow.h"
 #include "timestuff.h"
 #include "Core2_Sounds.h"
+#include "ranges.h"
+#include "framelog.h"
 #include "sdcard.h"
+#include "flashlog.h"
+#include "flightindex.h"
+#include "boot.h"
 
 //intellisense workaround 
 // _VOID      _EXFUN(tzset,	(_VOID));
@@ -21,39 +33,6 @@
 extern TelnetSpy debug;
 extern SensorData sensorData;
 
-struct ColoredRange {
-  float start;
-  float end;
-  uint32_t color;
-};
-
-ColoredRange oilTempRange[] = {
-  {0, 40, RED},
-  {120, 140, RED},
-};
-int oilTempRangeNum = 2;
-
-ColoredRange oilPressRange[] = {
-  {0, 1.5, RED},
-  {1.5, 4.5, YELLOW},
-  {4.5, 6.2, GREEN},
-  {6.2, 7.0, RED},
-};
-int oilPressRangeNum = 4;
-
-ColoredRange fuelPressRange[] = {
-  {0, 35, RED},
-  {35, 350, DARKGREY},
-};
-int fuelPressRangeNum = 2;
-
-ColoredRange fuelQTYRange[] = {
-  {0, 10, RED},
-  {10, 20, YELLOW},
-  {20, 120, GREEN},
-};
-int fuelQTYRangeNum = 3;
-
 int fuelQTYWarning = 0;
 int fuelPressWarning = 0;
 int oilPressWarning = 0;
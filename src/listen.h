@@ -0,0 +1,191 @@
+#ifndef LISTEN_H
+#define LISTEN_H
+
+#include <stdint.h>
+
+// Decides when the receiver's radio has to be on. The sender transmits on a
+// fixed period, so once its period and phase are known the radio only needs
+// to be up for a short window around the frames it wants, one every
+// LISTEN_INTERVAL_US. That is for the ground only: once the engine is on
+// (flightActive) the power task keeps the radio up for every frame, so the
+// journal and the flight index get the sender's full rate. Plain C++ so the
+// host tool can simulate it.
+//
+// Learning: listen for LISTEN_SEARCH_ON_US at a time (backing off for
+// LISTEN_SEARCH_OFF_US when nothing is heard) until LISTEN_LEARN_FRAMES
+// arrivals give the period as the median interval.
+// Tracking: every received frame re-anchors the phase and nudges the period,
+// which follows the drift between the two crystals. A missed window widens
+// the next one; LISTEN_MAX_MISSES in a row go back to learning.
+#define LISTEN_LEARN_FRAMES 9          // arrivals used to measure the period
+#define LISTEN_SEARCH_ON_US 3000000    // listening for a sender ...
+#define LISTEN_SEARCH_OFF_US 3000000   // ... and backing off when there is none
+#define LISTEN_INTERVAL_US 500000      // wanted spacing of received frames
+#define LISTEN_GUARD_US 4000           // window half width around a predicted frame
+#define LISTEN_WAKE_US 30000           // radio start up ahead of a window
+#define LISTEN_MAX_MISSES 4            // misses in a row before relearning
+
+class ListenScheduler
+{
+public:
+    ListenScheduler(int64_t guardUs = LISTEN_GUARD_US, int64_t wakeUs = LISTEN_WAKE_US)
+        : guardUs(guardUs), wakeUs(wakeUs), windows(0), hits(0), misses(0)
+    {
+        reset(0);
+    }
+
+    void reset(int64_t nowUs)
+    {
+        tracking = false;
+        learned = 0;
+        searchStart = nowUs;
+        pending = false;
+        missRun = 0;
+        periodUs = 0;
+        every = 1;
+        anchor = 0;
+        center = 0;
+    }
+
+    // A frame arrived at arrivalUs.
+    void onFrame(int64_t arrivalUs)
+    {
+        if (!tracking)
+        {
+            learn(arrivalUs);
+            return;
+        }
+
+        int64_t since = arrivalUs - anchor;
+        int64_t k = (since + periodUs / 2) / periodUs;
+        if (k >= 1)
+            periodUs += (since / k - periodUs) / 8;
+        if (pending)
+            hits++;
+        anchor = arrivalUs;
+        missRun = 0;
+        schedule(anchor);
+    }
+
+    // Accounts for a window that closed empty. Call before radioOn().
+    void update(int64_t nowUs)
+    {
+        if (!tracking || !pending || nowUs <= center + guard())
+            return;
+
+        misses++;
+        if (++missRun > LISTEN_MAX_MISSES)
+        {
+            reset(nowUs);
+            return;
+        }
+        // the sender may have just dropped a frame, try its next slot with a wider window
+        schedule(center);
+    }
+
+    bool radioOn(int64_t nowUs) const
+    {
+        if (!tracking)
+            return (nowUs - searchStart) % (LISTEN_SEARCH_ON_US + LISTEN_SEARCH_OFF_US) < LISTEN_SEARCH_ON_US;
+        return pending && nowUs >= center - guard() - wakeUs && nowUs <= center + guard();
+    }
+
+    // When the radio has to be on next, nowUs if it already has to be.
+    int64_t nextOn(int64_t nowUs) const
+    {
+        if (!tracking)
+        {
+            int64_t cycle = LISTEN_SEARCH_ON_US + LISTEN_SEARCH_OFF_US;
+            int64_t phase = (nowUs - searchStart) % cycle;
+            return phase < LISTEN_SEARCH_ON_US ? nowUs : nowUs + cycle - phase;
+        }
+        int64_t open = center - guard() - wakeUs;
+        return open > nowUs ? open : nowUs;
+    }
+
+    // When the radio may go off again, nowUs if it already may.
+    int64_t nextOff(int64_t nowUs) const
+    {
+        if (!tracking)
+        {
+            int64_t cycle = LISTEN_SEARCH_ON_US + LISTEN_SEARCH_OFF_US;
+            int64_t phase = (nowUs - searchStart) % cycle;
+            return phase < LISTEN_SEARCH_ON_US ? nowUs + LISTEN_SEARCH_ON_US - phase : nowUs;
+        }
+        if (!radioOn(nowUs))
+            return nowUs;
+        return center + guard();
+    }
+
+    bool isTracking() const
+    {
+        return tracking;
+    }
+
+    int64_t period() const
+    {
+        return periodUs;
+    }
+
+    int64_t guardUs;
+    int64_t wakeUs;
+    uint32_t windows; // windows opened while tracking
+    uint32_t hits;    // of those, the ones a frame arrived in
+    uint32_t misses;
+
+private:
+    void learn(int64_t arrivalUs)
+    {
+        arrivals[learned++] = arrivalUs;
+        if (learned < LISTEN_LEARN_FRAMES)
+            return;
+
+        int64_t intervals[LISTEN_LEARN_FRAMES - 1];
+        for (int i = 0; i < LISTEN_LEARN_FRAMES - 1; i++)
+            intervals[i] = arrivals[i + 1] - arrivals[i];
+        for (int i = 1; i < LISTEN_LEARN_FRAMES - 1; i++)
+            for (int j = i; j > 0 && intervals[j] < intervals[j - 1]; j--)
+            {
+                int64_t t = intervals[j];
+                intervals[j] = intervals[j - 1];
+                intervals[j - 1] = t;
+            }
+
+        learned = 0;
+        periodUs = intervals[(LISTEN_LEARN_FRAMES - 1) / 2];
+        if (periodUs <= 0)
+            return;
+        every = (LISTEN_INTERVAL_US + periodUs / 2) / periodUs;
+        if (every < 1)
+            every = 1;
+        tracking = true;
+        anchor = arrivalUs;
+        missRun = 0;
+        schedule(anchor);
+    }
+
+    void schedule(int64_t from)
+    {
+        center = from + every * periodUs;
+        pending = true;
+        windows++;
+    }
+
+    int64_t guard() const
+    {
+        return guardUs * (1 + missRun);
+    }
+
+    bool tracking;
+    int64_t arrivals[LISTEN_LEARN_FRAMES];
+    int learned;
+    int64_t searchStart;
+    int64_t periodUs;
+    int64_t every;   // sender periods between listened frames
+    int64_t anchor;  // arrival the schedule counts from
+    int64_t center;  // predicted arrival of the next wanted frame
+    bool pending;
+    int missRun;
+};
+
+#endif
@@ -0,0 +1,225 @@
+#ifndef LOGBLOCK_H
+#define LOGBLOCK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// On-card journal layout. Kept free of Arduino headers so the host tools can
+// read the same files.
+//
+// A log file is preallocated to LOG_BLOCK_SIZE * (LOG_DATA_START + capacity)
+// bytes so appending never touches the FAT. Blocks 0 and 1 hold two copies of
+// the superblock which are rewritten alternately at each checkpoint, so a
+// torn write can only damage one of them. Every following block carries the
+// file id, its own sequence number and a CRC, and is written exactly once.
+//
+// After a power loss everything up to the last checkpoint is known good and
+// only the blocks written since then have to be scanned.
+//
+// Each block header also records the time of its first record. Blocks are
+// fixed size and a block boundary is a valid place to start reading, so the
+// block headers double as a sparse time index that can be binary searched
+// (logSeekBlock) without a separate index file.
+
+#define LOG_BLOCK_SIZE 512
+#define LOG_DATA_START 2
+#define LOG_BLOCK_MAGIC 0x424C5641 // "AVLB"
+#define LOG_SUPER_MAGIC 0x534C5641 // "AVLS"
+#define LOG_VERSION 3
+#define LOG_VERSION_OLDEST 2 // still readable, see LOG_BLOCK_SENDER_MS
+
+enum LogBlockType : uint8_t
+{
+    LOG_BLOCK_CSV = 1,    // payload is CSV text, whole lines only
+    LOG_BLOCK_PACKED = 2, // payload is delta coded records, see logcodec.h
+};
+
+// header flags
+#define LOG_BLOCK_SENDER_MS 0x01 // packed records carry F_SENDER_MS, added in version 3
+
+struct LogBlockHeader
+{
+    uint32_t magic;
+    uint32_t fileId; // random per file, rejects stale blocks left in preallocated space
+    uint32_t seq;    // data block number, block N lives at LOG_DATA_START + N
+    uint32_t time;   // RTC seconds since 2000 of the first record
+    uint32_t ms;     // millis() of the first record
+    uint16_t length; // payload bytes used
+    uint8_t type;
+    uint8_t flags;
+    uint32_t crc; // crc32 of header (with crc = 0) and the used payload
+};
+
+#define LOG_PAYLOAD_SIZE (LOG_BLOCK_SIZE - sizeof(LogBlockHeader))
+
+struct LogBlock
+{
+    LogBlockHeader header;
+    uint8_t payload[LOG_PAYLOAD_SIZE];
+};
+
+struct LogSuperBlock
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t blockSize;
+    uint32_t fileId;
+    uint32_t capacity;   // data blocks preallocated
+    uint32_t generation; // bumped per checkpoint, copy lives in block (generation & 1)
+    uint32_t committed;  // data blocks known good at this checkpoint
+    char created[20];    // RTC time the file was opened
+    uint32_t crc;
+};
+
+static_assert(sizeof(LogBlock) == LOG_BLOCK_SIZE, "LogBlock must fill one sector");
+static_assert(sizeof(LogSuperBlock) <= LOG_BLOCK_SIZE, "LogSuperBlock must fit one sector");
+
+uint32_t logCrc32(const void *data, size_t len, uint32_t crc = 0)
+{
+    static uint32_t table[256];
+    static bool tableReady = false;
+
+    if (!tableReady)
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        tableReady = true;
+    }
+
+    const uint8_t *p = (const uint8_t *)data;
+    crc = ~crc;
+    while (len--)
+        crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+uint32_t logBlockCrc(const LogBlock &block)
+{
+    LogBlockHeader header = block.header;
+    header.crc = 0;
+    uint32_t crc = logCrc32(&header, sizeof(header));
+    return logCrc32(block.payload, block.header.length, crc);
+}
+
+void logSealBlock(LogBlock &block, uint32_t fileId, uint32_t seq, uint8_t type, uint16_t length,
+                  uint32_t time, uint32_t ms, uint8_t flags = 0)
+{
+    block.header.magic = LOG_BLOCK_MAGIC;
+    block.header.fileId = fileId;
+    block.header.seq = seq;
+    block.header.time = time;
+    block.header.ms = ms;
+    block.header.length = length;
+    block.header.type = type;
+    block.header.flags = flags;
+    memset(block.payload + length, 0, LOG_PAYLOAD_SIZE - length);
+    block.header.crc = logBlockCrc(block);
+}
+
+bool logBlockValid(const LogBlock &block, uint32_t fileId, uint32_t seq)
+{
+    return block.header.magic == LOG_BLOCK_MAGIC &&
+           block.header.fileId == fileId &&
+           block.header.seq == seq &&
+           block.header.length <= LOG_PAYLOAD_SIZE &&
+           block.header.crc == logBlockCrc(block);
+}
+
+void logSealSuper(LogSuperBlock &sb)
+{
+    sb.crc = 0;
+    sb.crc = logCrc32(&sb, sizeof(sb));
+}
+
+bool logSuperValid(const LogSuperBlock &sb)
+{
+    LogSuperBlock copy = sb;
+    copy.crc = 0;
+    return sb.magic == LOG_SUPER_MAGIC &&
+           sb.version >= LOG_VERSION_OLDEST && sb.version <= LOG_VERSION &&
+           sb.blockSize == LOG_BLOCK_SIZE &&
+           sb.committed <= sb.capacity &&
+           sb.crc == logCrc32(&copy, sizeof(copy));
+}
+
+// readBlock(index, buffer) reads one LOG_BLOCK_SIZE block and returns false on
+// a short read. Picks the newest intact superblock copy.
+template <typename ReadBlock>
+bool logLoadSuper(ReadBlock readBlock, LogSuperBlock &sb)
+{
+    static uint8_t buffer[LOG_BLOCK_SIZE];
+    bool found = false;
+
+    for (uint32_t i = 0; i < LOG_DATA_START; i++)
+    {
+        if (!readBlock(i, buffer))
+            continue;
+        LogSuperBlock copy;
+        memcpy(&copy, buffer, sizeof(copy));
+        if (logSuperValid(copy) && (!found || copy.generation > sb.generation))
+        {
+            sb = copy;
+            found = true;
+        }
+    }
+    return found;
+}
+
+// Scans forward from the last checkpoint and returns the number of contiguous
+// valid data blocks. Only the tail written since the checkpoint is read.
+template <typename ReadBlock>
+uint32_t logScanTail(ReadBlock readBlock, const LogSuperBlock &sb, uint32_t *scanned = NULL)
+{
+    static LogBlock block;
+    uint32_t seq = sb.committed;
+    uint32_t reads = 0;
+
+    while (seq < sb.capacity)
+    {
+        reads++;
+        if (!readBlock(LOG_DATA_START + seq, &block) || !logBlockValid(block, sb.fileId, seq))
+            break;
+        seq++;
+    }
+
+    if (scanned)
+        *scanned = reads;
+    return seq;
+}
+
+// Finds the block to start reading at for records from time onwards: the last
+// of the first `blocks` data blocks whose first record is before time, or 0.
+// Records in that block before time still have to be skipped by the reader.
+// Reads O(log blocks) blocks. reads, if given, returns how many.
+template <typename ReadBlock>
+uint32_t logSeekBlock(ReadBlock readBlock, const LogSuperBlock &sb, uint32_t blocks, uint32_t time,
+                      uint32_t *reads = NULL)
+{
+    static LogBlock block;
+    uint32_t lo = 0, hi = blocks; // answer is in [lo, hi)
+    uint32_t n = 0;
+
+    while (hi - lo > 1)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        n++;
+        if (!readBlock(LOG_DATA_START + mid, &block) || !logBlockValid(block, sb.fileId, mid))
+            hi = mid; // treat damage like the end of the log
+        else if (block.header.time < time)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    if (reads)
+        *reads = n;
+    return lo;
+}
+
+#endif
@@ -0,0 +1,226 @@
+#ifndef LOGCODEC_H
+#define LOGCODEC_H
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Compact encoding for LOG_BLOCK_PACKED journal blocks, shared with the host
+// tools.
+//
+// Every channel is quantised to fixed point (logFieldScale). The first record
+// of a block is a keyframe holding absolute values, every later record holds
+// the difference to the one before. Values are written as zigzag varints, so
+// a typical record of small deltas takes one byte per field. Because each
+// block starts with a keyframe, any block can be decoded on its own.
+
+#define LOG_FIELDS 15
+#define LOG_FIELDS_V2 14 // records of blocks without LOG_BLOCK_SENDER_MS stop before F_SENDER_MS
+#define LOG_RECORD_MAX (LOG_FIELDS * 5) // worst case encoded record
+
+#define LOG_CSV_HEADER "timeStr,frame,batteryVoltage,amp,fuelLitres,fuelPress,oilTemp,oilPress,cht1,accX,accY,accZ,ms,senderMs\n"
+#define LOG_CSV_FORMAT "%s,%i,%0.2f,%0.2f,%0.1f,%0.1f,%0.1f,%0.1f,%0.1f,%0.1f,%0.1f,%0.1f,%lu,%lu\n"
+
+enum LogField
+{
+    F_TIME,  // RTC seconds since 2000-01-01
+    F_MS,    // millis() at capture
+    F_FRAME,
+    F_FLAGS, // sensor error bits, see LOG_FLAG_*
+    F_BATTERY_VOLTAGE,
+    F_AMP,
+    F_FUEL_LITRES,
+    F_FUEL_PRESS,
+    F_OIL_TEMP,
+    F_OIL_PRESS,
+    F_CHT1,
+    F_ACC_X,
+    F_ACC_Y,
+    F_ACC_Z,
+    F_SENDER_MS, // sender's clock at arrival, 0 until it is fitted
+};
+
+#define LOG_FLAG_FUEL_QTY 0x01
+#define LOG_FLAG_FUEL_PRESS 0x02
+#define LOG_FLAG_OIL_PRESS 0x04
+#define LOG_FLAG_OIL_TEMP 0x08
+#define LOG_FLAG_AMP 0x10
+
+// fixed point steps per unit, chosen at or below each sensor's resolution
+const float logFieldScale[LOG_FIELDS] = {1, 1, 1, 1, 100, 100, 10, 10, 10, 100, 10, 100, 100, 100, 1};
+
+struct PackedRecord
+{
+    int32_t v[LOG_FIELDS];
+};
+
+int32_t logQuantise(float value, LogField field)
+{
+    return (int32_t)lroundf(value * logFieldScale[field]);
+}
+
+float logValue(const PackedRecord &record, LogField field)
+{
+    return record.v[field] / logFieldScale[field];
+}
+
+uint32_t zigzag(int32_t v)
+{
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+int32_t unzigzag(uint32_t v)
+{
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+size_t putVarint(uint8_t *out, uint32_t v)
+{
+    size_t n = 0;
+    while (v >= 0x80)
+    {
+        out[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (uint8_t)v;
+    return n;
+}
+
+bool getVarint(const uint8_t *&p, const uint8_t *end, uint32_t &v)
+{
+    v = 0;
+    for (int shift = 0; shift < 35 && p < end; shift += 7)
+    {
+        uint8_t b = *p++;
+        v |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+class LogEncoder
+{
+public:
+    // next record becomes a keyframe, call when starting a block
+    void reset() { keyframe = true; }
+
+    // Returns the bytes written, or 0 if the record does not fit in room.
+    size_t encode(const PackedRecord &record, uint8_t *out, size_t room)
+    {
+        uint8_t buffer[LOG_RECORD_MAX];
+        size_t n = 0;
+
+        for (int i = 0; i < LOG_FIELDS; i++)
+        {
+            // unsigned subtraction keeps the millis() wrap harmless
+            uint32_t d = (uint32_t)record.v[i] - (keyframe ? 0 : (uint32_t)prev.v[i]);
+            n += putVarint(buffer + n, zigzag((int32_t)d));
+        }
+        if (n > room)
+            return 0;
+
+        memcpy(out, buffer, n);
+        prev = record;
+        keyframe = false;
+        return n;
+    }
+
+private:
+    PackedRecord prev;
+    bool keyframe = true;
+};
+
+class LogDecoder
+{
+public:
+    void reset() { keyframe = true; }
+
+    // fields is how many the block's records carry, the rest read as 0
+    bool decode(const uint8_t *&p, const uint8_t *end, PackedRecord &record, int fields = LOG_FIELDS)
+    {
+        for (int i = 0; i < LOG_FIELDS; i++)
+        {
+            if (i >= fields)
+            {
+                record.v[i] = 0;
+                continue;
+            }
+            uint32_t z;
+            if (!getVarint(p, end, z))
+                return false;
+            record.v[i] = (int32_t)((keyframe ? 0 : (uint32_t)prev.v[i]) + (uint32_t)unzigzag(z));
+        }
+        prev = record;
+        keyframe = false;
+        return true;
+    }
+
+private:
+    PackedRecord prev;
+    bool keyframe = true;
+};
+
+// Days since 1970-01-01 for a civil date, valid for any Gregorian year.
+int32_t logDaysFromCivil(int y, unsigned m, unsigned d)
+{
+    y -= m <= 2;
+    int32_t era = (y >= 0 ? y : y - 399) / 400;
+    unsigned yoe = (unsigned)(y - era * 400);
+    unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (int32_t)doe - 719468;
+}
+
+#define LOG_EPOCH_DAYS 10957 // 2000-01-01, the RTC's epoch
+
+// "YYYY-MM-DD HH:MM:SS" to seconds since 2000-01-01, 0 if it does not parse
+uint32_t logTimeToSeconds(const char *timeStr)
+{
+    int y, mo, d, h, mi, s;
+    if (sscanf(timeStr, "%d-%d-%d %d:%d:%d", &y, &mo, &d, &h, &mi, &s) != 6)
+        return 0;
+    int32_t days = logDaysFromCivil(y, mo, d) - LOG_EPOCH_DAYS;
+    return days < 0 ? 0 : (uint32_t)days * 86400 + h * 3600 + mi * 60 + s;
+}
+
+void logSecondsToTime(uint32_t seconds, char *timeStr, size_t size)
+{
+    int32_t z = (int32_t)(seconds / 86400) + LOG_EPOCH_DAYS + 719468;
+    int32_t era = z / 146097;
+    unsigned doe = (unsigned)(z - era * 146097);
+    unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned mp = (5 * doy + 2) / 153;
+    unsigned d = doy - (153 * mp + 2) / 5 + 1;
+    unsigned m = mp < 10 ? mp + 3 : mp - 9;
+    int y = (int)yoe + era * 400 + (m <= 2);
+    uint32_t t = seconds % 86400;
+
+    snprintf(timeStr, size, "%04d-%02u-%02u %02u:%02u:%02u",
+             y, m, d, (unsigned)(t / 3600), (unsigned)(t / 60 % 60), (unsigned)(t % 60));
+}
+
+// Renders a record in the same CSV layout the logger used to write.
+int logFormatCsv(const PackedRecord &r, char *line, size_t size)
+{
+    char timeStr[20];
+    logSecondsToTime(r.v[F_TIME], timeStr, sizeof(timeStr));
+    return snprintf(line, size, LOG_CSV_FORMAT,
+                    timeStr,
+                    (int)r.v[F_FRAME],
+                    logValue(r, F_BATTERY_VOLTAGE),
+                    logValue(r, F_AMP),
+                    logValue(r, F_FUEL_LITRES),
+                    logValue(r, F_FUEL_PRESS),
+                    logValue(r, F_OIL_TEMP),
+                    logValue(r, F_OIL_PRESS),
+                    logValue(r, F_CHT1),
+                    logValue(r, F_ACC_X), logValue(r, F_ACC_Y), logValue(r, F_ACC_Z),
+                    (unsigned long)(uint32_t)r.v[F_MS],
+                    (unsigned long)(uint32_t)r.v[F_SENDER_MS]);
+}
+
+#endif
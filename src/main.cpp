@@ -10,32 +10,113 @@ TFT_eSprite gSprite = TFT_eSprite(&M5.Lcd);
 TFT_eSprite pSprite = TFT_eSprite(&M5.Lcd);
 TFT_eSprite warnSprite = TFT_eSprite(&M5.Lcd);
 char timeStr[20];
-int muteUntil = 60;
 int lcdVoltage = 3100;
 bool inverter = false; // inverter, used to make things flash every second
+volatile bool charging = false; // in charging mode, from the power task
+volatile bool dataStale = false; // no frame for STALE_MS, from the power task
+volatile bool muted = true;      // alarm silenced, for the first minute and after a touch
 
 #define GAUGE_WIDTH 195
 #define GAUGE_HEIGHT 34
 #define PANEL_WIDTH 320 - GAUGE_WIDTH - 5
 #define PANEL_HEIGHT GAUGE_HEIGHT
-#define RADIO_SLEEP_MS 500
 #define ENABLE_IMU 0
-#define WIFI_SSID "shed"
+#define STALE_MS 5000     // no frame for this long and the gauges are crossed out
+#define REMINDER_MS 60000 // then a beep this often that it's been left powered on
+#define REMINDER_BEEP_MS 300
+#define MUTE_MS 60000
+#define LCD_MIN_MV 2500
+#define LCD_MAX_MV 3300
+#define BRIGHTNESS_SETTLE_MS 150 // a run of brightness taps ends in one write to the AXP
+#define FEEDBACK_QUEUE_LENGTH 4
+#define TELNET_BACKLOG_BYTES (256 * 1024) // debug output kept in PSRAM until a telnet client reads it, see serviceGroundWifi()
+
+void renderTask(void *parameter);
+void uiTask(void *parameter);
+void powerTask(void *parameter);
+void everySecond(void *arg);
+void dataLost(void *arg);
+void reminderBeep(void *arg);
+void beepOff(void *arg);
+void unmute(void *arg);
+void applyBrightness(void *arg);
+void chargePoll(void *arg);
+
+// The power task's jobs. Only the power task touches the wheel.
+TimerWheel wheel;
+WheelTimer secondTimer(everySecond);
+WheelTimer staleTimer(dataLost);
+WheelTimer reminderTimer(reminderBeep);
+WheelTimer beepOffTimer(beepOff);
+WheelTimer muteTimer(unmute);
+WheelTimer brightnessTimer(applyBrightness);
+WheelTimer chargeTimer(chargePoll);
+uint32_t chargePollMs = CHARGE_POLL_MIN_MS;
+
+uint64_t wheelNow()
+{
+  return esp_timer_get_time() / 1000;
+}
+
+// A frame came in, restart the no-data timeout.
+void dataArrived()
+{
+  wheel.start(staleTimer, STALE_MS);
+  if (dataStale)
+  {
+    dataStale = false;
+    wheel.stop(reminderTimer);
+  }
+}
+
+// A beep (freq 0 for none) and optionally a buzz, played by soundTask so the
+// caller does not wait for it.
+struct Feedback
+{
+  uint16_t freq;
+  uint16_t ms;
+  bool vibrate;
+};
+
+QueueHandle_t feedbackQueue = NULL;
 
-int secondsSinceBoot()
+void feedback(uint16_t freq, uint16_t ms, bool vibrate = false)
 {
-  return (int)millis() / 1000;
+  Feedback f = {freq, ms, vibrate};
+  if (feedbackQueue != NULL)
+    xQueueSend(feedbackQueue, &f, 0);
 }
 
 void soundTask(void *parameter)
 {
+  Feedback f;
   for (;;)
   {
+    if (xQueueReceive(feedbackQueue, &f, pdMS_TO_TICKS(100)) == pdTRUE)
+    {
+      dvfsRequest(DVFS_RADIO); // I2S and the AXP's I2C need the APB at 80 MHz
+      energyBegin(E_AUDIO);
+      if (f.vibrate)
+        M5.Axp.SetLDOEnable(3, true); // vibration motor
+      if (f.freq)
+        soundsBeep(f.freq, f.ms, 100);
+      else
+        vTaskDelay(pdMS_TO_TICKS(f.ms));
+      if (f.vibrate)
+        M5.Axp.SetLDOEnable(3, false);
+      energyEnd(E_AUDIO);
+      dvfsRelease(DVFS_RADIO);
+      continue;
+    }
+
     if (alarmSound > 0)
     {
+      dvfsRequest(DVFS_RADIO);
+      energyBegin(E_AUDIO);
       soundsBeep(2200, 200, 100);
+      energyEnd(E_AUDIO);
+      dvfsRelease(DVFS_RADIO);
     }
-    vTaskDelay(pdMS_TO_TICKS(100));
   }
 }
 
@@ -59,6 +140,20 @@ void set40Mhz()
 
 void SleepProcessor(uint64_t time_in_us)
 {
+  // light sleep would stall the boot task or drop the ground WiFi, just yield
+  if (bootPending() || groundWifi != GROUND_OFF)
+  {
+    vTaskDelay(pdMS_TO_TICKS(time_in_us / 1000));
+    return;
+  }
+  // or stop another task part way through its work, lose a touch or leave
+  // log messages unprinted
+  if (!tasksIdle() || touchActive || printPending())
+  {
+    vTaskDelay(pdMS_TO_TICKS(TASK_IDLE_POLL_MS));
+    return;
+  }
+
   if (time_in_us > 0)
   {
     esp_sleep_enable_timer_wakeup(time_in_us);
@@ -67,50 +162,82 @@ void SleepProcessor(uint64_t time_in_us)
   {
     esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_TIMER);
   }
+  touchSleepArm();
+  energyBegin(E_SLEEP);
   esp_light_sleep_start();
+  energyEnd(E_SLEEP);
+  touchSleepDisarm(esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_GPIO);
 }
 
-void checkWifi()
+// Takes any newly arrived frame into the listen schedule and switches the
+// radio to match it.
+void serviceRadio()
 {
-  M5.Lcd.println("Scanning...");
-  // Scan for available networks
-  int n = WiFi.scanNetworks();
-  bool ssidFound = false;
-
-  for (int i = 0; i < n; ++i)
+  int64_t arrival;
+  if (takeFrameArrival(arrival))
   {
-    if (WiFi.SSID(i) == WIFI_SSID)
-    {
-      ssidFound = true;
-      break;
-    }
+    listener.onFrame(arrival);
+    if (!SIMULATE && !charging)
+      dataArrived();
   }
 
-  if (ssidFound)
+  // on external power the radio is only up for telnet
+  if (serviceGroundWifi(charging))
+    return;
+  static bool wasCharging = false;
+  if (charging)
   {
-    M5.Lcd.println("Connecting");
-
-    // Connect to WiFi
-    WiFi.begin(WIFI_SSID, "elephantseat");
-    while (WiFi.status() != WL_CONNECTED)
-    {
-      delay(500);
-      M5.Lcd.print(".");
-    }
-
-    M5.Lcd.println("Connected\nSyncing Time");
-    delay(2000);
+    espnow.setListening(false);
+    wasCharging = true;
+    return;
+  }
+  if (wasCharging)
+  {
+    // charging paused the radio, bring it back whatever the power saving
+    espnow.setListening(true);
+    wasCharging = false;
+  }
+  if (!POWER_SAVE || bootPending())
+    return;
+  if (flightActive)
+  {
+    // every frame while the engine is on, the listen schedule is for the ground
+    espnow.setListening(true);
+    return;
+  }
+  int64_t now = esp_timer_get_time();
+  listener.update(now);
+  espnow.setListening(listener.radioOn(now));
+}
 
-    timeSync();
+// Waits for at most maxUs: while the radio is listening until a frame comes in
+// or the window closes, otherwise in light sleep until the next window opens.
+// In flight the radio stays on and there is no light sleep.
+void radioSleep(uint64_t maxUs)
+{
+  if (!POWER_SAVE || bootPending() || charging)
+  {
+    SleepProcessor(maxUs);
+    return;
+  }
 
-    // Disconnect from WiFi
-    WiFi.disconnect();
-    M5.Lcd.println("Disconnected from WiFi");
+  serviceRadio();
+  if (flightActive)
+  {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(maxUs / 1000 + 1));
+    return;
   }
-  else
+  int64_t now = esp_timer_get_time();
+  if (espnow.isListening())
   {
-    M5.Lcd.println("No WiFi network found.");
+    int64_t wait = min(listener.nextOff(now) - now, (int64_t)maxUs);
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait / 1000 + 1));
+    return;
   }
+
+  int64_t wait = min(listener.nextOn(now) - now, (int64_t)maxUs);
+  if (wait > 1000)
+    SleepProcessor(wait);
 }
 
 void setup()
@@ -118,7 +245,15 @@ void setup()
 
   Serial.begin(115200);
   debug.setStoreOffline(true);
+  bool backlog = debug.setBacklogSize(TELNET_BACKLOG_BYTES);
   debug.begin(115200);
+  if (!backlog)
+    debug.println("w: no PSRAM for the telnet backlog");
+  beginDvfs();
+  beginTasks();
+  beginPrint();
+  beginBootProfile();
+  bootMark("serial");
   debug.print("MAC:");
   debug.println(WiFi.macAddress());
 
@@ -127,14 +262,16 @@ void setup()
   M5.Axp.begin();
   // M5.Axp.ina3221.begin();
   M5.Axp.SetSpkEnable(true);
+  bootMark("m5");
   M5.Lcd.setBrightness(255);
   M5.Axp.SetLcdVoltage(lcdVoltage);
   M5.Lcd.textsize = 2;
   M5.Lcd.clearDisplay(TFT_BLUE);
   M5.Lcd.setTextColor(TFT_WHITE, TFT_BLUE);
   M5.Lcd.println("A.V.I.A Booting");
-
-  checkWifi();
+  bootMark("display");
+  beginClock();
+  bootMark("clock");
 
   getRtcTime(timeStr, sizeof(timeStr));
   // M5.Lcd.setFreeFont(&FreeMonoBold9pt7b);
@@ -148,6 +285,7 @@ void setup()
   gSprite.createSprite(GAUGE_WIDTH, GAUGE_HEIGHT);
   pSprite.createSprite(PANEL_WIDTH, PANEL_HEIGHT);
   warnSprite.createSprite(PANEL_WIDTH, 30);
+  bootMark("sprites");
 
   uint8_t mac[6];
   WiFi.macAddress(mac);
@@ -163,21 +301,28 @@ void setup()
   }
   Serial.println();
   espnow.init();
+  bootMark("espnow");
 
-  bool sd = beginSD();
-  M5.Lcd.printf("SD Card: %s\n", sd ? "Yes" : "No");
+  beginBoot();
 
   soundsBeep(2600, 100, 100);
+  bootMark("beep");
   // alarmSound = 1;
 
   if (ENABLE_IMU)
     M5.IMU.Init(); // Init IMU sensor.
 
+  feedbackQueue = xQueueCreate(FEEDBACK_QUEUE_LENGTH, sizeof(Feedback));
   xTaskCreatePinnedToCore(soundTask, "soundTask", 4096, NULL, 1, NULL, 0);
 
-  espnow.pauseWiFi();
-
   M5.Lcd.clearDisplay(TFT_BLACK);
+
+  beginTouch();
+  startTask(TASK_INGEST, ingestTask, 4096, 3, 0);
+  startTask(TASK_RENDER, renderTask, 8192, 3, 1);
+  startTask(TASK_UI, uiTask, 4096, 2, 1);
+  startTask(TASK_POWER, powerTask, 4096, 1, 1);
+  bootMark("setup");
 }
 
 void drawFatLine(int x, int y, int destx, int desty, int thickness, uint32_t color)
@@ -361,20 +506,6 @@ void drawGauges()
   delete[] labels;
 }
 
-uint32_t getColorForValue(const ColoredRange *ranges, size_t numRanges, float value)
-{
-  for (size_t i = 0; i < numRanges; i++)
-  {
-    const ColoredRange &range = ranges[i];
-    if (value >= range.start && value <= range.end)
-    {
-      return range.color;
-    }
-  }
-  // Return a default color (e.g., white) if the value is not within any of the ranges
-  return GREEN;
-}
-
 int checkRanges()
 {
 
@@ -422,6 +553,7 @@ void testDisplay()
   static float fuelPress = 250;
   static float oilPress = 4.5;
   static float oilTemp = 82;
+  static SensorData sim;
 
   batteryVoltage += direction;
   fuelLitres += direction;
@@ -429,17 +561,19 @@ void testDisplay()
   oilPress += (direction / 10.0);
   oilTemp += direction;
 
-  sensorData.frame = counter;
-  sensorData.batteryVoltage = batteryVoltage;
-  sensorData.fuelLitres = fuelLitres;
-  sensorData.fuelPress = fuelPress;
-  sensorData.oilPress = oilPress;
-  sensorData.oilTemp = oilTemp;
+  sim.frame = counter;
+  sim.batteryVoltage = batteryVoltage;
+  sim.fuelLitres = fuelLitres;
+  sim.fuelPress = fuelPress;
+  sim.oilPress = oilPress;
+  sim.oilTemp = oilTemp;
 
-  sensorData.fuelQtyError = false;
-  sensorData.fuelPressError = false;
-  sensorData.oilPressError = false;
-  sensorData.oilTempError = false;
+  sim.fuelQtyError = false;
+  sim.fuelPressError = false;
+  sim.oilPressError = false;
+  sim.oilTempError = false;
+
+  ingestFrame(sim, esp_timer_get_time());
 
   if (counter % 40 == 0)
     direction *= -1;
@@ -472,16 +606,18 @@ void drawTopBar()
   M5.Lcd.textcolor = WHITE;
   M5.Lcd.textbgcolor = BLACK;
 
-  M5.Lcd.setCursor(200, 0);
+  M5.Lcd.setCursor(188, 0);
   // M5.Lcd.printf("%c %3.0f %d ",
   //               sdPresent ? 'S' : '-',
   //               M5.Axp.GetBatteryLevel(),
   //               M5.Axp.isCharging());
 
-  M5.Lcd.printf("%c %3.0f %3.0f ",
+  // level and current as on the charging screen
+  ChargeStatus charge = readCharge();
+  M5.Lcd.printf("%c%3d %4dma",
                 sdPresent ? 'S' : '-',
-                M5.Axp.GetBatteryLevel(),
-                M5.Axp.GetBatCurrent() * 1000);
+                charge.level,
+                charge.currentMa);
 
   for (size_t i = 0; i < 3; i++)
   {
@@ -510,165 +646,332 @@ void drawBottomBar()
   M5.Lcd.printf("%6i ", sensorData.frame);
 }
 
-void loop()
+void drawCharging(const ChargeStatus &status)
 {
-  static unsigned long lastUpdated;
-  static int nextSecond = millis() + 1000;
-  static int nextUpdate = millis() + RADIO_SLEEP_MS;
-  static bool newData = false;
-  static int reminder = 0;
-  static bool wasPluggedIn = false;
+  M5.Lcd.setTextColor(TFT_YELLOW, TFT_BLACK);
+  M5.Lcd.setCursor(0, 0);
 
-  // very rough touch detection - i.e. doesn't work when device sleeping.
-  // touch on the left will decrease brightness touch on the right will increase brightness.
-  if (M5.Touch.ispressed())
+  if (status.level < 100)
   {
+    M5.Lcd.println("Charging... ");
+  }
+  else
+  {
+    M5.Lcd.println("Charged     ");
+  }
 
-    muteUntil = secondsSinceBoot() + 60;
-    Point p = M5.Touch.getPressPoint();
+  M5.Lcd.printf("%3d%% (%4dma) %d.%02dV \n", status.level, status.currentMa,
+                status.voltageCv / 100, status.voltageCv % 100);
+}
 
-    // Get touch position
-    int16_t x = M5.Touch.point->x;
-    int16_t y = M5.Touch.point->y;
+// The only task that draws. Gauges are redrawn as soon as the ingest task has
+// a frame, the no-data screen on the power task's tick and the charging
+// screen when its values change.
+void renderTask(void *parameter)
+{
+  bool crossedOut = false;
+  bool wasPluggedIn = false;
+  bool gaugesDrawn = false;
 
-    // right touch - brighter
-    if (x > 160 && x < 320 && lcdVoltage < 3300)
+  for (;;)
+  {
+    EventBits_t bits = xEventGroupWaitBits(taskEvents, EV_FRAME | EV_TICK | EV_CHARGE, pdTRUE, pdFALSE, portMAX_DELAY);
+    int64_t arrival = 0;
+    bool fresh = (bits & EV_FRAME) && takeSensorData(sensorData, arrival);
+    // lack of valid data for STALE_MS - the display must change to indicate unreliable data.
+    bool stale = !fresh && (bits & EV_TICK) && dataStale;
+    int64_t drawn = 0; // arrival of the frame on the gauges
+
+    if (!fresh && !stale && !(bits & EV_CHARGE) && charging == wasPluggedIn)
+      continue;
+
+    taskBegin(TASK_RENDER);
+    displayBusy();
+    energyBegin(E_RENDER);
+    dvfsRequest(DVFS_FAST);
+
+    if (charging)
     {
-      lcdVoltage += 100;
-      soundsBeep(2700, 25, 100);
+      if (!wasPluggedIn)
+        M5.lcd.clearDisplay(TFT_BLACK);
+      wasPluggedIn = true;
+      if (bits & EV_CHARGE)
+        drawCharging(takeCharge());
     }
-
-    // left touch - dimmer
-    if (x > 10 && x < 160 && lcdVoltage > 2500)
+    else if (wasPluggedIn)
     {
-      lcdVoltage -= 100;
-      soundsBeep(2500, 25, 100);
+      M5.lcd.clearDisplay(TFT_BLACK);
+      wasPluggedIn = false;
+    }
+    else if (fresh)
+    {
+      if (crossedOut)
+        M5.lcd.clearDisplay(TFT_BLACK);
+      crossedOut = false;
+
+      // check for anything in the red:
+      int warning = checkRanges();
+      if (warning > 1 && !MUTE && !muted)
+      {
+        alarmSound = 1;
+      }
+      else
+      {
+        alarmSound = 0;
+      }
+
+      if (ENABLE_IMU)
+        M5.IMU.getAccelData(&accX, &accY, &accZ);
+
+      // draw the actual gauges
+      drawGauges();
+      drawTopBar();
+      drawBottomBar();
+      if (!gaugesDrawn)
+      {
+        bootMark("gauges");
+        saveBootProfile();
+        gaugesDrawn = true;
+      }
+
+      drawn = arrival;
     }
+    else if (stale)
+    {
+      drawFatLine(20, 20, 300, 220, 15, RED);
+      drawFatLine(20, 220, 300, 20, 15, RED);
 
-    Serial.printf("Touch position: x=%d, y=%d LCD=%d\n", x, y, lcdVoltage);
+      drawTopBar();
+      drawBottomBar();
+      crossedOut = true;
+    }
 
-    M5.Axp.SetLcdVoltage(lcdVoltage);
+    dvfsRelease(DVFS_FAST);
+    energyEnd(E_RENDER);
+    displayIdle();
+    taskEnd(TASK_RENDER, drawn);
   }
+}
 
-  if (M5.Axp.isACIN())
-  {
-    if (!wasPluggedIn)
-      M5.lcd.clearDisplay(TFT_BLACK);
+// Sleeps until the touch controller's INT line fires, then samples it every
+// TOUCH_TRACK_MS until the finger is gone, and hands the gestures to the power task.
+void uiTask(void *parameter)
+{
+  GestureDetector detector;
+  Gesture gesture;
+  touchWaiter = xTaskGetCurrentTaskHandle();
 
-    M5.Lcd.setTextColor(TFT_YELLOW, TFT_BLACK);
-    M5.Lcd.setCursor(0, 0);
+  for (;;)
+  {
+    ulTaskNotifyTake(pdTRUE, detector.active() ? pdMS_TO_TICKS(TOUCH_TRACK_MS) : portMAX_DELAY);
+    taskBegin(TASK_UI);
 
-    if (M5.Axp.GetBatteryLevel() < 100.0)
-    {
-      M5.Lcd.println("Charging... ");
-    }
-    else
+    int16_t x = 0, y = 0;
+    bool pressed = M5.Touch.ispressed();
+    if (pressed)
     {
-      M5.Lcd.println("Charged     ");
+      Point p = M5.Touch.getPressPoint();
+      x = p.x;
+      y = p.y;
     }
 
-    // M5.Axp.GetBatState();
-    M5.Axp.SetCHGCurrent(AXP::kCHG_1000mA);
-    M5.Lcd.printf("%0.2f% (%0.0fma) %0.2fV \n", M5.Axp.GetBatteryLevel(), M5.Axp.GetBatCurrent() * 1000, M5.Axp.GetBatVoltage());
-    SleepProcessor(20000); // low power sleep for 0.5 sec
-    wasPluggedIn = true;
-
-    return;
+    if (detector.sample(pressed, x, y, millis(), gesture) &&
+        xQueueSend(gestureQueue, &gesture, 0) == pdTRUE && frameWaiter != NULL)
+      xTaskNotifyGive(frameWaiter);
+    touchActive = detector.active();
+    taskEnd(TASK_UI);
   }
-  else
+}
+
+// Any touch silences the alarm for MUTE_MS.
+// touch on the left will decrease brightness touch on the right will increase brightness,
+// swipe up or down for the brightest or dimmest. A long press is acknowledged with a buzz.
+void onGesture(const Gesture &g)
+{
+  muted = true;
+  wheel.start(muteTimer, MUTE_MS);
+
+  int voltage = lcdVoltage;
+  switch (g.type)
   {
-    if (wasPluggedIn)
-      M5.lcd.clearDisplay(TFT_BLACK);
-    wasPluggedIn = false;
+  case GESTURE_TAP:
+    if (g.x > 160 && g.x < 320)
+      voltage += 100;
+    if (g.x > 10 && g.x < 160)
+      voltage -= 100;
+    break;
+  case GESTURE_SWIPE_UP:
+    voltage = LCD_MAX_MV;
+    break;
+  case GESTURE_SWIPE_DOWN:
+    voltage = LCD_MIN_MV;
+    break;
+  case GESTURE_LONG_PRESS:
+    feedback(0, 80, true);
+    break;
+  default:
+    break;
   }
 
-  if (sensorDataUpdated)
+  voltage = constrain(voltage, LCD_MIN_MV, LCD_MAX_MV);
+  if (charging)
+  {
+    // someone is looking, show current values
+    chargePollMs = CHARGE_POLL_MIN_MS;
+    wheel.start(chargeTimer, 0);
+  }
+  if (voltage != lcdVoltage)
   {
+    feedback(voltage > lcdVoltage ? 2700 : 2500, 25);
+    lcdVoltage = voltage;
+    wheel.start(brightnessTimer, BRIGHTNESS_SETTLE_MS);
+  }
 
-    if (POWER_SAVE)
-      espnow.pauseWiFi();
+  LOG_INFO("touch %s x=%d y=%d dx=%d dy=%d held %u ms LCD=%d\n",
+           gestureNames[g.type], g.x, g.y, g.dx, g.dy, g.heldMs, lcdVoltage);
+}
 
-    if (millis() - lastUpdated > 5000)
-      M5.lcd.clearDisplay(TFT_BLACK);
+void serviceTouch()
+{
+  Gesture g;
+  while (xQueueReceive(gestureQueue, &g, 0) == pdTRUE)
+    onGesture(g);
+}
 
-    if (SIMULATE)
-      testDisplay();
+void applyBrightness(void *arg)
+{
+  M5.Axp.SetLcdVoltage(lcdVoltage);
+}
+
+void unmute(void *arg)
+{
+  muted = false;
+}
+
+// On external power: see charging.h.
+void enterCharging()
+{
+  charging = true;
+  LOG_INFO("charging mode\n");
+  wheel.stop(secondTimer);
+  wheel.stop(staleTimer);
+  wheel.stop(reminderTimer);
+  alarmSound = 0;
+  M5.Axp.SetCHGCurrent(AXP::kCHG_1000mA);
+  M5.Axp.SetLcdVoltage(CHARGE_LCD_MV);
+  publishCharge(readCharge(), true);
+  xEventGroupSetBits(taskEvents, EV_CHARGE);
+  chargePollMs = CHARGE_POLL_MIN_MS;
+  wheel.start(chargeTimer, chargePollMs);
+}
+
+void leaveCharging()
+{
+  charging = false;
+  LOG_INFO("on battery\n");
+  wheel.stop(chargeTimer);
+  M5.Axp.SetLcdVoltage(lcdVoltage);
+  wheel.start(secondTimer, 0, 1000);
+  dataStale = false;
+  wheel.start(staleTimer, STALE_MS);
+}
 
-    // check for anything in the red:
-    int warning = checkRanges();
-    if (warning > 1 && !MUTE && secondsSinceBoot() > muteUntil)
+void chargePoll(void *arg)
+{
+  taskBegin(TASK_POWER);
+  if (!M5.Axp.isACIN())
+    leaveCharging();
+  else
+  {
+    if (publishCharge(readCharge(), false))
     {
-      alarmSound = 1;
+      chargePollMs = CHARGE_POLL_MIN_MS;
+      xEventGroupSetBits(taskEvents, EV_CHARGE);
     }
     else
-    {
-      alarmSound = 0;
-    }
-
-    if (ENABLE_IMU)
-      M5.IMU.getAccelData(&accX, &accY, &accZ);
+      chargePollMs = min(chargePollMs * 2, (uint32_t)CHARGE_POLL_MAX_MS);
+    wheel.start(chargeTimer, chargePollMs);
+  }
+  taskEnd(TASK_POWER);
+}
 
-    // draw the actual gauges
-    drawGauges();
-    drawTopBar();
-    drawBottomBar();
+// Once a second from the wheel.
+void everySecond(void *arg)
+{
+  taskBegin(TASK_POWER);
+  inverter = !inverter; // flip the inverter
 
-    sensorDataUpdated = false;
-    lastUpdated = millis();
-    newData = true;
-    SleepProcessor(1000 * RADIO_SLEEP_MS);
+  if (M5.Axp.isACIN())
+  {
+    enterCharging();
+    taskEnd(TASK_POWER);
+    return;
   }
 
-  // check for lack of valid data for 5 seconds - if so then the display must change to indicate unreliable data.
-  if (millis() - lastUpdated > 5000)
+  getRtcTime(timeStr, sizeof(timeStr));
+  debug.printf("i: Time %s %d\n", timeStr, inverter);
+  espnow.report(debug);
+  energySample(!charging);
+  energyReport(debug);
+  dvfsReport(debug);
+  tasksReport(debug);
+
+  if (SIMULATE)
   {
-    reminder++;
-    // drawGauges();
-    drawFatLine(20, 20, 300, 220, 15, RED);
-    drawFatLine(20, 220, 300, 20, 15, RED);
-
-    drawTopBar();
-    drawBottomBar();
+    testDisplay();
+    dataArrived();
+  }
 
-    // do a reminder beep that its been left powered on.  aprox 60 seconds
-    if (reminder > 10)
-    {
-      alarmSound = 1;
-      delay(300);
-      alarmSound = 0;
-      delay(1000);
-      reminder = 0;
-    }
+  xEventGroupSetBits(taskEvents, EV_TICK);
+  taskEnd(TASK_POWER);
+}
 
-    if (POWER_SAVE)
-      espnow.pauseWiFi();
-    SleepProcessor(3000000); // low power sleep for 1 sec
-  }
+void dataLost(void *arg)
+{
+  dataStale = true;
+  wheel.start(reminderTimer, REMINDER_MS, REMINDER_MS);
+}
 
-  // task for every second
-  if (millis() > nextSecond)
-  {
-    inverter = !inverter; // flip the inverter
+// do a reminder beep that its been left powered on.
+void reminderBeep(void *arg)
+{
+  alarmSound = 1;
+  wheel.start(beepOffTimer, REMINDER_BEEP_MS);
+}
 
-    getRtcTime(timeStr, sizeof(timeStr));
-    debug.printf("i: Time %s %d\n", timeStr, inverter);
-    nextSecond = millis() + 1000;
-    // only if there is actually received valid data, then write to the SD card.
-    if (newData)
-    {
-      newData = false;
-      writeSD();
-    }
+void beepOff(void *arg)
+{
+  alarmSound = 0;
+}
 
-    if (SIMULATE)
-      sensorDataUpdated = true;
-  }
+// Lowest priority on core 1, so it only runs once render and ui are blocked.
+// Keeps the clock and the radio schedule, runs the jobs on the wheel and
+// sleeps until the next one is due.
+void powerTask(void *parameter)
+{
+  frameWaiter = xTaskGetCurrentTaskHandle();
+  wheel.advance(wheelNow());
+  wheel.start(secondTimer, 1000, 1000);
+  wheel.start(staleTimer, STALE_MS);
+  wheel.start(muteTimer, MUTE_MS);
 
-  // allow new data
-  if (millis() > nextUpdate)
+  for (;;)
   {
-    nextUpdate = millis() + RADIO_SLEEP_MS;
-    if (POWER_SAVE)
-      espnow.resumeWiFi();
+    updateClock();
+    serviceRadio();
+    serviceTouch();
+
+    uint64_t now = wheelNow();
+    wheel.advance(now);
+    uint64_t wake = wheel.nextWake();
+    if (clockAligning)
+      wake = min(wake, now + CLOCK_POLL_MS); // close enough to see the RTC's edge
+    radioSleep(wake > now ? 1000 * (wake - now) : 0);
   }
-}
\ No newline at end of file
+}
+
+// Everything runs in the tasks started by setup().
+void loop()
+{
+  vTaskDelete(NULL);
+}
@@ -0,0 +1,64 @@
+#ifndef RANGES_H
+#define RANGES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Gauge colour bands, also used by the host tools to judge exceedances.
+
+#ifndef ARDUINO
+// RGB565 values of the display library's colour names
+#define RED 0xF800
+#define YELLOW 0xFFE0
+#define GREEN 0x07E0
+#define DARKGREY 0x7BEF
+#endif
+
+struct ColoredRange {
+  float start;
+  float end;
+  uint32_t color;
+};
+
+ColoredRange oilTempRange[] = {
+  {0, 40, RED},
+  {120, 140, RED},
+};
+int oilTempRangeNum = 2;
+
+ColoredRange oilPressRange[] = {
+  {0, 1.5, RED},
+  {1.5, 4.5, YELLOW},
+  {4.5, 6.2, GREEN},
+  {6.2, 7.0, RED},
+};
+int oilPressRangeNum = 4;
+
+ColoredRange fuelPressRange[] = {
+  {0, 35, RED},
+  {35, 350, DARKGREY},
+};
+int fuelPressRangeNum = 2;
+
+ColoredRange fuelQTYRange[] = {
+  {0, 10, RED},
+  {10, 20, YELLOW},
+  {20, 120, GREEN},
+};
+int fuelQTYRangeNum = 3;
+
+uint32_t getColorForValue(const ColoredRange *ranges, size_t numRanges, float value)
+{
+  for (size_t i = 0; i < numRanges; i++)
+  {
+    const ColoredRange &range = ranges[i];
+    if (value >= range.start && value <= range.end)
+    {
+      return range.color;
+    }
+  }
+  // Return a default color (e.g., white) if the value is not within any of the ranges
+  return GREEN;
+}
+
+#endif
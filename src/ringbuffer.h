@@ -0,0 +1,70 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+// Lock free ring for exactly one producer and one consumer.
+// The producer only moves head and the consumer only moves tail, so the
+// ingest task can push while the SD writer task pops without a mutex.
+// LENGTH must be a power of two.
+template <typename T, size_t LENGTH>
+class SpscRing
+{
+    static_assert((LENGTH & (LENGTH - 1)) == 0, "SpscRing length must be a power of two");
+
+public:
+    bool push(const T &item)
+    {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        uint32_t used = h - tail.load(std::memory_order_acquire);
+        if (used >= LENGTH)
+        {
+            dropped++;
+            return false;
+        }
+        items[h & (LENGTH - 1)] = item;
+        head.store(h + 1, std::memory_order_release);
+        if (used + 1 > peak)
+            peak = used + 1;
+        return true;
+    }
+
+    bool pop(T &item)
+    {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire))
+            return false;
+        item = items[t & (LENGTH - 1)];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // pop up to max items into out, returns the number copied
+    size_t popBatch(T *out, size_t max)
+    {
+        size_t n = 0;
+        while (n < max && pop(out[n]))
+            n++;
+        return n;
+    }
+
+    size_t size() const
+    {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+    size_t capacity() const { return LENGTH; }
+    uint32_t droppedCount() const { return dropped; }
+    uint32_t peakUsed() const { return peak; }
+
+private:
+    T items[LENGTH];
+    std::atomic<uint32_t> head{0};
+    std::atomic<uint32_t> tail{0};
+    uint32_t dropped = 0; // producer side only
+    uint32_t peak = 0;    // producer side only
+};
+
+#endif
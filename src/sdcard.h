@@ -4,37 +4,375 @@
 #include <Arduino.h>
 #include <M5Core2.h>
 #include "global.h"
+#include "logblock.h"
+#include "logcodec.h"
 #include <SD.h>
 
+#define LOG_FILE_BLOCKS 8192      // data blocks preallocated per log file (4 MiB), rotates when full
+#define LOG_CHECKPOINT_BLOCKS 32  // superblock rewrite interval, bounds the recovery scan
+#define LOG_QUOTA_MB 1024         // space all log files may take, oldest are deleted first
+#define LOG_SPARE_FILE "/spare.tmp"
+#define LOG_FILE_BYTES ((uint32_t)(LOG_DATA_START + LOG_FILE_BLOCKS) * LOG_BLOCK_SIZE)
+#define LOG_ENCODING LOG_BLOCK_PACKED // LOG_BLOCK_CSV writes plain text blocks instead
+
 char fileName[20];
-extern char timeStr[20];
 extern float accX, accY, accZ;
 bool sdPresent = false;
 
-bool beginSD()
+File journal;
+LogSuperBlock superBlock;
+uint32_t journalSeq = 0; // next data block to write
+LogBlock journalBlock;
+size_t journalUsed = 0; // payload bytes pending in journalBlock
+size_t journalRecords = 0; // frames pending in journalBlock
+uint32_t journalTime;   // RTC seconds and millis() of the first record in journalBlock
+uint32_t journalMs;
+LogEncoder journalEncoder;
+bool spareNeeded = true; // LOG_SPARE_FILE has to be (re)allocated
+uint32_t worstBlockUs = 0;
+uint32_t worstBatchUs = 0;
+
+void listFlights();
+
+bool writeSuperBlock(File &file, LogSuperBlock &sb)
+{
+    static uint8_t buffer[LOG_BLOCK_SIZE];
+
+    logSealSuper(sb);
+    memset(buffer, 0, sizeof(buffer));
+    memcpy(buffer, &sb, sizeof(sb));
+    file.seek((sb.generation & 1) * LOG_BLOCK_SIZE);
+    bool ok = file.write(buffer, sizeof(buffer)) == sizeof(buffer);
+    file.flush();
+    return ok;
+}
+
+// Seals the last checkpoint of a journal left open by a power loss. Only the
+// blocks written after the newest superblock are read.
+bool recoverJournal(const char *path)
+{
+    File file = SD.open(path, "r+");
+    if (!file)
+        return false;
+
+    auto readBlock = [&file](uint32_t index, void *buffer)
+    {
+        return file.seek(index * LOG_BLOCK_SIZE) &&
+               file.read((uint8_t *)buffer, LOG_BLOCK_SIZE) == LOG_BLOCK_SIZE;
+    };
+
+    LogSuperBlock sb;
+    if (!logLoadSuper(readBlock, sb))
+    {
+        Serial.printf("w: %s has no valid superblock\n", path);
+        file.close();
+        return false;
+    }
+
+    uint32_t scanned = 0;
+    uint32_t valid = logScanTail(readBlock, sb, &scanned);
+    if (valid != sb.committed)
+    {
+        sb.generation++;
+        sb.committed = valid;
+        writeSuperBlock(file, sb);
+    }
+    file.close();
+
+    Serial.printf("i: recovered %s: %u blocks, %u scanned\n", path, valid, scanned);
+    return true;
+}
+
+// Counts the journals in the root directory and optionally returns the oldest
+// and newest names. Journals are named by RTC time so they sort by age.
+int scanJournals(char *oldest, char *newest)
+{
+    int count = 0;
+    File root = SD.open("/");
+    File entry = root.openNextFile();
+
+    if (oldest)
+        oldest[0] = 0;
+    if (newest)
+        newest[0] = 0;
+
+    while (entry)
+    {
+        const char *name = entry.name();
+        if (name[0] == '/')
+            name++;
+        size_t len = strlen(name);
+        if (!entry.isDirectory() && len + 2 <= sizeof(fileName) && len > 4 &&
+            strcmp(name + len - 4, ".log") == 0)
+        {
+            count++;
+            if (oldest && (!oldest[0] || strcmp(name, oldest + 1) < 0))
+                snprintf(oldest, sizeof(fileName), "/%s", name);
+            if (newest && strcmp(name, newest[0] ? newest + 1 : "") > 0)
+                snprintf(newest, sizeof(fileName), "/%s", name);
+        }
+        entry.close();
+        entry = root.openNextFile();
+    }
+    root.close();
+    return count;
+}
+
+void recoverLatestJournal()
+{
+    char latest[sizeof(fileName)];
+    if (scanJournals(NULL, latest) > 0)
+        recoverJournal(latest);
+}
+
+// Deletes the oldest journals until the current one plus a spare fit both
+// the quota and the free space on the card.
+void enforceQuota()
+{
+    char oldest[sizeof(fileName)];
+    uint32_t maxFiles = ((uint64_t)LOG_QUOTA_MB << 20) / LOG_FILE_BYTES;
+    int count = scanJournals(oldest, NULL);
+
+    while (count > 1 && strcmp(oldest, fileName) != 0 &&
+           ((uint32_t)count + 1 > maxFiles || SD.totalBytes() - SD.usedBytes() < LOG_FILE_BYTES))
+    {
+        Serial.printf("i: log quota, deleting %s\n", oldest);
+        if (!SD.remove(oldest))
+        {
+            // the same file would come back as the oldest forever
+            LOG_WARN("log quota, could not delete the oldest journal\n");
+            break;
+        }
+        count = scanJournals(oldest, NULL);
+    }
+}
+
+// Sizes a file up front so appends never allocate clusters.
+bool preallocate(const char *path)
+{
+    File file = SD.open(path, FILE_WRITE);
+    if (!file)
+        return false;
+    file.seek(LOG_FILE_BYTES - 1);
+    bool ok = file.write((uint8_t)0) == 1;
+    file.close();
+    return ok;
+}
+
+bool writeBlock(LogBlock &block, size_t used, uint8_t type, uint32_t time, uint32_t ms)
+{
+    waitDisplayIdle(); // the card shares the SPI bus with the LCD
+    unsigned long start = micros();
+
+    logSealBlock(block, superBlock.fileId, journalSeq, type, used, time, ms,
+                 type == LOG_BLOCK_PACKED ? LOG_BLOCK_SENDER_MS : 0);
+    journal.seek((LOG_DATA_START + journalSeq) * LOG_BLOCK_SIZE);
+    bool ok = journal.write((const uint8_t *)&block, LOG_BLOCK_SIZE) == LOG_BLOCK_SIZE;
+    journalSeq++;
+
+    if (journalSeq % LOG_CHECKPOINT_BLOCKS == 0)
+    {
+        // data must be on the card before the superblock claims it
+        journal.flush();
+        superBlock.generation++;
+        superBlock.committed = journalSeq;
+        writeSuperBlock(journal, superBlock);
+    }
+
+    uint32_t took = micros() - start;
+    if (took > worstBlockUs)
+        worstBlockUs = took;
+    return ok;
+}
+
+// Starts a journal in an already preallocated file.
+bool openJournal(const char *path)
+{
+    static LogBlock headerBlock;
+
+    journal = SD.open(path, "r+");
+    if (!journal)
+        return false;
+
+    memset(&superBlock, 0, sizeof(superBlock));
+    superBlock.magic = LOG_SUPER_MAGIC;
+    superBlock.version = LOG_VERSION;
+    superBlock.blockSize = LOG_BLOCK_SIZE;
+    superBlock.fileId = esp_random();
+    superBlock.capacity = LOG_FILE_BLOCKS;
+    getRtcTime(superBlock.created, sizeof(superBlock.created));
+
+    // both copies start out valid
+    writeSuperBlock(journal, superBlock);
+    superBlock.generation++;
+    writeSuperBlock(journal, superBlock);
+
+    journalSeq = 0;
+    journalUsed = 0;
+    journalEncoder.reset();
+
+    // the first block always names the columns, whatever the encoding
+    size_t len = strlen(LOG_CSV_HEADER);
+    memcpy(headerBlock.payload, LOG_CSV_HEADER, len);
+    return writeBlock(headerBlock, len, LOG_BLOCK_CSV, logTimeToSeconds(superBlock.created), millis());
+}
+
+// Takes over the spare file if one is ready, so a new journal costs a rename
+// instead of a cluster allocation.
+bool createJournal(const char *path)
+{
+    if (!spareNeeded && SD.rename(LOG_SPARE_FILE, path))
+    {
+        spareNeeded = true;
+    }
+    else
+    {
+        Serial.println("w: no spare log file, allocating inline");
+        if (!preallocate(path))
+            return false;
+    }
+    return openJournal(path);
+}
+
+// Seals the full journal and continues in a new one.
+bool rotateJournal()
+{
+    journal.flush();
+    superBlock.generation++;
+    superBlock.committed = journalSeq;
+    writeSuperBlock(journal, superBlock);
+    journal.close();
+
+    getRtcFileName(fileName, sizeof(fileName));
+    Serial.printf("i: log rotated to %s\n", fileName);
+    return createJournal(fileName);
+}
+
+bool writeJournalBlock()
+{
+    if (journalUsed == 0)
+        return true;
+    if (journalSeq >= superBlock.capacity && !rotateJournal())
+    {
+        journalUsed = 0;
+        journalRecords = 0;
+        sdPresent = false;
+        return false;
+    }
+
+    bool ok = writeBlock(journalBlock, journalUsed, LOG_ENCODING, journalTime, journalMs);
+    journalUsed = 0;
+    journalRecords = 0;
+    journalEncoder.reset();
+    return ok;
+}
+
+// Adds text to the pending block. Lines never straddle blocks so every block
+// can be read on its own.
+bool appendJournal(const char *text, size_t len, uint32_t time, uint32_t ms)
+{
+    bool ok = true;
+    if (len > LOG_PAYLOAD_SIZE)
+        return false;
+    if (journalUsed + len > LOG_PAYLOAD_SIZE)
+        ok = writeJournalBlock();
+    if (journalUsed == 0)
+    {
+        journalTime = time;
+        journalMs = ms;
+    }
+    memcpy(journalBlock.payload + journalUsed, text, len);
+    journalUsed += len;
+    journalRecords++;
+    return ok;
+}
+
+// Adds a packed record to the pending block, starting a new block (and so a
+// new keyframe) when it does not fit.
+bool appendRecord(const PackedRecord &record)
+{
+    bool ok = true;
+    size_t n = journalEncoder.encode(record, journalBlock.payload + journalUsed, LOG_PAYLOAD_SIZE - journalUsed);
+    if (n == 0)
+    {
+        ok = writeJournalBlock();
+        n = journalEncoder.encode(record, journalBlock.payload, LOG_PAYLOAD_SIZE);
+    }
+    if (journalUsed == 0)
+    {
+        journalTime = record.v[F_TIME];
+        journalMs = record.v[F_MS];
+    }
+    journalUsed += n;
+    journalRecords++;
+    return ok;
+}
+
+// RTC seconds since 2000 of a captured frame
+uint32_t frameSeconds(const LoggedFrame &f)
+{
+    // timeStr only changes once a second, skip re-parsing it
+    static char lastTime[20];
+    static uint32_t lastSeconds;
+    if (strcmp(f.timeStr, lastTime) != 0)
+    {
+        memcpy(lastTime, f.timeStr, sizeof(lastTime));
+        lastSeconds = logTimeToSeconds(f.timeStr);
+    }
+    return lastSeconds;
+}
+
+void packFrame(const LoggedFrame &f, PackedRecord &r)
 {
-    int retry = 0;
+    r.v[F_TIME] = frameSeconds(f);
+    r.v[F_MS] = f.ms;
+    r.v[F_FRAME] = f.data.frame;
+    r.v[F_FLAGS] = (f.data.fuelQtyError ? LOG_FLAG_FUEL_QTY : 0) |
+                   (f.data.fuelPressError ? LOG_FLAG_FUEL_PRESS : 0) |
+                   (f.data.oilPressError ? LOG_FLAG_OIL_PRESS : 0) |
+                   (f.data.oilTempError ? LOG_FLAG_OIL_TEMP : 0) |
+                   (f.data.ampError ? LOG_FLAG_AMP : 0);
+    r.v[F_BATTERY_VOLTAGE] = logQuantise(f.data.batteryVoltage, F_BATTERY_VOLTAGE);
+    r.v[F_AMP] = logQuantise(f.data.amp, F_AMP);
+    r.v[F_FUEL_LITRES] = logQuantise(f.data.fuelLitres, F_FUEL_LITRES);
+    r.v[F_FUEL_PRESS] = logQuantise(f.data.fuelPress, F_FUEL_PRESS);
+    r.v[F_OIL_TEMP] = logQuantise(f.data.oilTemp, F_OIL_TEMP);
+    r.v[F_OIL_PRESS] = logQuantise(f.data.oilPress, F_OIL_PRESS);
+    r.v[F_CHT1] = logQuantise(f.data.cht1, F_CHT1);
+    r.v[F_ACC_X] = logQuantise(f.accX, F_ACC_X);
+    r.v[F_ACC_Y] = logQuantise(f.accY, F_ACC_Y);
+    r.v[F_ACC_Z] = logQuantise(f.accZ, F_ACC_Z);
+    r.v[F_SENDER_MS] = f.senderMs;
+}
+
+// Mounts the card, retrying for up to budgetMs.
+bool beginSD(unsigned long budgetMs)
+{
+    unsigned long start = millis();
 
     bool retVal = SD.begin(TFCARD_CS_PIN, SPI, 40000000);
-    while (retry < 5 && !SD.begin(TFCARD_CS_PIN, SPI, 40000000))
+    while (!retVal && millis() - start < budgetMs)
     {
         Serial.printf("info: SD card present: %d\n", retVal);
-        retry++;
         delay(200);
+        retVal = SD.begin(TFCARD_CS_PIN, SPI, 40000000);
     }
     Serial.printf("i: SD card present: %d\n", retVal);
     sdPresent = retVal;
 
     if (sdPresent)
     {
-        getRtcFileName(fileName, 20);
+        recoverLatestJournal();
+        listFlights();
+        File spare = SD.open(LOG_SPARE_FILE);
+        spareNeeded = !spare || spare.size() != LOG_FILE_BYTES;
+        spare.close();
+
+        getRtcFileName(fileName, sizeof(fileName));
         Serial.print("i: SD filename: ");
         Serial.println(fileName);
 
-        File dataFile = SD.open(fileName, FILE_WRITE);
-        getRtcTime(timeStr, sizeof(timeStr));
-        dataFile.printf("timeStr,frame,batteryVoltage,amp,fuelLitres,fuelPress,oilTemp,oilPress,cht1,accX,accY,accZ\n");
-        dataFile.close();
+        sdPresent = createJournal(fileName);
     }
 
     return retVal;
@@ -45,7 +383,7 @@ bool checkSD()
     if (sdPresent)
     {
         bool retVal = SD.exists(fileName);
-        // once not present forever not present.
+        // lost until remountSD() finds it again, the flash log covers the gap
         sdPresent = retVal;
         return retVal;
     }
@@ -53,28 +391,138 @@ bool checkSD()
         return false;
 }
 
-bool writeSD()
+// Mounts a card that was missing or pulled and starts a fresh journal on it.
+bool remountSD()
+{
+    journal.close();
+    journalUsed = 0;
+    journalRecords = 0;
+    SD.end();
+    if (!SD.begin(TFCARD_CS_PIN, SPI, 40000000))
+        return false;
+
+    File spare = SD.open(LOG_SPARE_FILE);
+    spareNeeded = !spare || spare.size() != LOG_FILE_BYTES;
+    spare.close();
+
+    getRtcFileName(fileName, sizeof(fileName));
+    sdPresent = createJournal(fileName);
+    Serial.printf("i: SD card back, logging to %s: %d\n", fileName, sdPresent);
+    return sdPresent;
+}
+
+// Appends a batch of captured frames as journal blocks and flushes them.
+// Returns how many frames from the start of the batch are on the card. A
+// block that fails leaves a hole the recovery scan would stop at, so the card
+// is then treated as gone: the rest of the batch is left for the flash log
+// and remountSD() starts a fresh journal.
+size_t writeSD(const LoggedFrame *frames, size_t count)
 {
+    char line[160];
+    PackedRecord record;
+
     if (checkSD())
     {
-        File dataFile = SD.open(fileName, FILE_APPEND);
-
-        dataFile.printf("%s,%i,%0.2f,%0.2f,%0.1f,%0.1f,%0.1f,%0.1f,%0.1f,%0.1f,%0.1f,%0.1f\n",
-                        timeStr,
-                        sensorData.frame,
-                        sensorData.batteryVoltage,
-                        sensorData.amp,
-                        sensorData.fuelLitres,
-                        sensorData.fuelPress,
-                        sensorData.oilTemp,
-                        sensorData.oilPress,
-                        sensorData.cht1,
-                        accX, accY, accZ);
-
-        dataFile.close();
-        return true;
+        unsigned long start = micros();
+        size_t committed = 0;
+        bool ok = true;
+        for (size_t i = 0; i < count && ok; i++)
+        {
+            const LoggedFrame &f = frames[i];
+            if (LOG_ENCODING == LOG_BLOCK_PACKED)
+            {
+                packFrame(f, record);
+                ok = appendRecord(record);
+            }
+            else
+            {
+                int n = snprintf(line, sizeof(line), LOG_CSV_FORMAT,
+                                 f.timeStr,
+                                 f.data.frame,
+                                 f.data.batteryVoltage,
+                                 f.data.amp,
+                                 f.data.fuelLitres,
+                                 f.data.fuelPress,
+                                 f.data.oilTemp,
+                                 f.data.oilPress,
+                                 f.data.cht1,
+                                 f.accX, f.accY, f.accZ,
+                                 f.ms, f.senderMs);
+                if (n > 0)
+                    ok = appendJournal(line, min((size_t)n, sizeof(line) - 1), frameSeconds(f), f.ms);
+            }
+            // everything before the pending block has been written
+            if (ok)
+                committed = i + 1 - journalRecords;
+        }
+
+        if (ok && writeJournalBlock())
+            committed = count;
+        else
+        {
+            journalUsed = 0;
+            journalRecords = 0;
+            journalEncoder.reset();
+            sdPresent = false;
+        }
+        journal.flush();
+
+        uint32_t took = micros() - start;
+        if (took > worstBatchUs)
+            worstBatchUs = took;
+        return committed;
+    }
+    return 0;
+}
+
+// Returns the data block to start reading a journal at for records from time
+// (RTC seconds since 2000) onwards, or -1 if it is not a journal. Costs a
+// binary search over the block headers plus, for a closed journal, the
+// recovery scan of its tail.
+int32_t seekJournal(const char *path, uint32_t time)
+{
+    File file = SD.open(path);
+    if (!file)
+        return -1;
+
+    auto readBlock = [&file](uint32_t index, void *buffer)
+    {
+        return file.seek(index * LOG_BLOCK_SIZE) &&
+               file.read((uint8_t *)buffer, LOG_BLOCK_SIZE) == LOG_BLOCK_SIZE;
+    };
+
+    LogSuperBlock sb;
+    int32_t block = -1;
+    if (logLoadSuper(readBlock, sb))
+    {
+        bool live = sdPresent && sb.fileId == superBlock.fileId;
+        uint32_t blocks = live ? journalSeq : logScanTail(readBlock, sb);
+        block = logSeekBlock(readBlock, sb, blocks, time);
+    }
+    file.close();
+    return block;
+}
+
+// Slow card housekeeping, run by the writer only when the frame ring has room
+// to absorb it: quota deletion and allocating the next journal ahead of time.
+void maintainSD()
+{
+    static uint32_t reportedBatchUs = 0;
+
+    if (!sdPresent)
+        return;
+
+    if (spareNeeded && frameRing.size() < LOG_RING_LENGTH / 4)
+    {
+        enforceQuota();
+        spareNeeded = !preallocate(LOG_SPARE_FILE);
+    }
+
+    if (worstBatchUs != reportedBatchUs)
+    {
+        reportedBatchUs = worstBatchUs;
+        LOG_INFO("SD worst write: block %u us, batch %u us\n", worstBlockUs, worstBatchUs);
     }
-    return false;
 }
 
-#endif
\ No newline at end of file
+#endif
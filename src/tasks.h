@@ -0,0 +1,163 @@
+#ifndef TASKS_H
+#define TASKS_H
+
+#include <Arduino.h>
+
+// The firmware runs as pinned tasks that block on queues and event bits:
+//   ingest  core 0  frames from the ESP-NOW callback into the log ring and the display copy
+//   log     core 0  batches the log ring to the card (logWriterTask)
+//   render  core 1  draws gauges on EV_FRAME, the no-data screen on EV_TICK and the
+//                   charging screen on EV_CHARGE
+//   ui      core 1  touch gestures, woken by the touch controller
+//   power   core 1  lowest priority: clock, radio schedule, the jobs on the timer wheel
+//                   and light sleep until the next one, which it only enters when every
+//                   other task is blocked
+//   print   core 0  formats the deferred log messages into serial and telnet (debuglog.h)
+//                   and serves the telnet clients
+// Each task brackets its work with taskBegin / taskEnd, which gives its CPU share
+// and, for event driven work, the response time from the event to the work
+// being done. Every TASK_REPORT_MS one "i: tasks" line reports them.
+//
+// The LCD and the SD card share one SPI bus. The render task clears
+// EV_DISPLAY_IDLE while it draws and the SD writer waits for it before each
+// block, so a gauge update waits for at most the one block already on the bus.
+#define TASK_REPORT_MS 60000
+#define TASK_BUS_WAIT_MS 100   // longest an SD block is held back for the display
+#define TASK_IDLE_POLL_MS 10   // power task recheck while another task is busy
+
+#define EV_FRAME (1 << 0)        // new sensor data for the display
+#define EV_TICK (1 << 1)         // once a second from the power task
+#define EV_DISPLAY_IDLE (1 << 2) // clear while the render task is on the SPI bus
+#define EV_CHARGE (1 << 3)       // new values for the charging screen
+
+enum TaskId
+{
+    TASK_INGEST,
+    TASK_RENDER,
+    TASK_LOG,
+    TASK_POWER,
+    TASK_UI,
+    TASK_PRINT,
+    TASK_COUNT
+};
+
+const char *taskNames[TASK_COUNT] = {"ingest", "render", "log", "power", "ui", "print"};
+
+struct TaskStats
+{
+    TaskHandle_t handle;
+    int64_t startedUs;
+    int64_t busyUs;
+    uint32_t runs;
+    int64_t responseUs; // event to work done
+    uint32_t responses;
+    uint32_t worstResponseUs;
+};
+
+EventGroupHandle_t taskEvents = NULL;
+portMUX_TYPE taskMux = portMUX_INITIALIZER_UNLOCKED;
+TaskStats taskStats[TASK_COUNT];
+uint32_t taskBusy = 0; // one bit per TaskId while it is between taskBegin and taskEnd
+
+void beginTasks()
+{
+    taskEvents = xEventGroupCreate();
+    xEventGroupSetBits(taskEvents, EV_DISPLAY_IDLE);
+}
+
+TaskHandle_t startTask(TaskId id, TaskFunction_t function, uint32_t stack, UBaseType_t priority, BaseType_t core)
+{
+    xTaskCreatePinnedToCore(function, taskNames[id], stack, NULL, priority, &taskStats[id].handle, core);
+    return taskStats[id].handle;
+}
+
+void taskBegin(TaskId id)
+{
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&taskMux);
+    taskStats[id].startedUs = now;
+    taskBusy |= 1 << id;
+    portEXIT_CRITICAL(&taskMux);
+}
+
+// eventUs is when the event that woke the task happened, 0 when there was none.
+void taskEnd(TaskId id, int64_t eventUs = 0)
+{
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&taskMux);
+    TaskStats &s = taskStats[id];
+    s.busyUs += now - s.startedUs;
+    s.runs++;
+    if (eventUs > 0)
+    {
+        uint32_t response = now - eventUs;
+        s.responseUs += response;
+        s.responses++;
+        if (response > s.worstResponseUs)
+            s.worstResponseUs = response;
+    }
+    taskBusy &= ~(1 << id);
+    portEXIT_CRITICAL(&taskMux);
+}
+
+// True when no task but the power task is doing work.
+bool tasksIdle()
+{
+    portENTER_CRITICAL(&taskMux);
+    bool idle = (taskBusy & ~(1 << TASK_POWER)) == 0;
+    portEXIT_CRITICAL(&taskMux);
+    return idle;
+}
+
+void displayBusy()
+{
+    xEventGroupClearBits(taskEvents, EV_DISPLAY_IDLE);
+}
+
+void displayIdle()
+{
+    xEventGroupSetBits(taskEvents, EV_DISPLAY_IDLE);
+}
+
+// Called by the SD writer before it takes the bus.
+void waitDisplayIdle()
+{
+    if (taskEvents != NULL)
+        xEventGroupWaitBits(taskEvents, EV_DISPLAY_IDLE, pdFALSE, pdTRUE, pdMS_TO_TICKS(TASK_BUS_WAIT_MS));
+}
+
+void tasksReport(Print &out)
+{
+    static unsigned long lastReport = millis();
+    unsigned long elapsed = millis() - lastReport;
+    if (elapsed < TASK_REPORT_MS)
+        return;
+    lastReport = millis();
+
+    TaskStats s[TASK_COUNT];
+    portENTER_CRITICAL(&taskMux);
+    for (int i = 0; i < TASK_COUNT; i++)
+    {
+        s[i] = taskStats[i];
+        taskStats[i].busyUs = 0;
+        taskStats[i].runs = 0;
+        taskStats[i].responseUs = 0;
+        taskStats[i].responses = 0;
+        taskStats[i].worstResponseUs = 0;
+    }
+    portEXIT_CRITICAL(&taskMux);
+
+    out.print("i: tasks");
+    for (int i = 0; i < TASK_COUNT; i++)
+    {
+        if (s[i].handle == NULL)
+            continue;
+        out.printf(" %s cpu=%.2f%% runs=%u", taskNames[i], s[i].busyUs / (elapsed * 10.0), s[i].runs);
+        if (s[i].responses)
+            out.printf(" resp=%.1f/%.1fms", s[i].responseUs / 1000.0 / s[i].responses, s[i].worstResponseUs / 1000.0);
+        out.printf(" stack=%u", uxTaskGetStackHighWaterMark(s[i].handle));
+    }
+    out.println();
+}
+
+#endif
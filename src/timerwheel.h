@@ -0,0 +1,268 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Hierarchical timer wheel for one-shot and periodic jobs. Plain C++ so the
+// host tool can check it.
+//
+// Time is a 64-bit millisecond count that never wraps (esp_timer_get_time()
+// / 1000 on the device). Level 0 has one slot per millisecond for the next
+// WHEEL_SLOTS ms, each level above covers WHEEL_SLOTS times the span of the
+// one below; a timer goes on the lowest level its expiry fits and drops a
+// level each time the wheel reaches its slot. Starting and stopping a timer
+// is O(1), advancing skips empty stretches using a bitmap per level and
+// nextWake() tells the caller how long it may sleep.
+//
+// Not thread safe: the owning task starts, stops and advances, and the
+// callbacks run inside advance().
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4 // 64^4 ms ~ 4.6 h, later expiries are parked on the top level
+#define WHEEL_NEVER UINT64_MAX
+
+typedef void (*TimerCallback)(void *arg);
+
+struct TimerLink
+{
+    TimerLink *next;
+    TimerLink *prev;
+};
+
+struct WheelTimer : TimerLink
+{
+    WheelTimer(TimerCallback callback = NULL, void *arg = NULL)
+        : expires(0), period(0), callback(callback), arg(arg), level(-1), slot(0)
+    {
+        next = prev = NULL;
+    }
+
+    bool pending() const
+    {
+        return next != NULL;
+    }
+
+    uint64_t expires; // ms
+    uint64_t period;  // ms, 0 for one-shot
+    TimerCallback callback;
+    void *arg;
+    int8_t level;     // -1 while queued to run
+    uint8_t slot;
+};
+
+class TimerWheel
+{
+public:
+    TimerWheel(uint64_t nowMs = 0)
+    {
+        for (int l = 0; l < WHEEL_LEVELS; l++)
+        {
+            occupied[l] = 0;
+            for (int s = 0; s < WHEEL_SLOTS; s++)
+                slots[l][s].next = slots[l][s].prev = &slots[l][s];
+        }
+        current = nowMs;
+        count = 0;
+    }
+
+    // Fires delayMs from the wheel's current time, then every periodMs if not 0.
+    void start(WheelTimer &timer, uint64_t delayMs, uint64_t periodMs = 0)
+    {
+        startAt(timer, current + delayMs, periodMs);
+    }
+
+    // Fires at expiresMs, or on the next advance() if that has passed.
+    void startAt(WheelTimer &timer, uint64_t expiresMs, uint64_t periodMs = 0)
+    {
+        stop(timer);
+        timer.expires = expiresMs > current ? expiresMs : current + 1;
+        timer.period = periodMs;
+        place(timer);
+        count++;
+    }
+
+    void stop(WheelTimer &timer)
+    {
+        if (!timer.pending())
+            return;
+        unlink(timer);
+        count--;
+    }
+
+    // Moves the wheel to nowMs and runs every timer due by then, in expiry
+    // order to the millisecond. Returns the number of callbacks run.
+    size_t advance(uint64_t nowMs)
+    {
+        size_t ran = 0;
+        while (current < nowMs)
+        {
+            uint64_t next = nextWake();
+            if (next > nowMs)
+            {
+                // nothing happens on the way, no slot changes level before nowMs either
+                current = nowMs;
+                break;
+            }
+            current = next;
+            cascade();
+            ran += expire();
+        }
+        return ran;
+    }
+
+    // The earliest time advance() has anything to do, WHEEL_NEVER with no
+    // timers. Exact for timers on level 0; for the ones above it is when
+    // their slot is due to drop a level, which is never later than they
+    // expire, so a caller sleeping until then only wakes early.
+    uint64_t nextWake() const
+    {
+        uint64_t best = WHEEL_NEVER;
+        for (int l = 0; l < WHEEL_LEVELS; l++)
+        {
+            if (occupied[l] == 0)
+                continue;
+            int shift = l * WHEEL_BITS;
+            uint64_t index = (current >> shift) + 1; // slot for this level's next step
+            uint64_t bits = rotateRight(occupied[l], index & (WHEEL_SLOTS - 1));
+            uint64_t at = (index + countTrailingZeros(bits)) << shift;
+            if (at < best)
+                best = at;
+        }
+        return best;
+    }
+
+    uint64_t now() const
+    {
+        return current;
+    }
+
+    size_t size() const
+    {
+        return count;
+    }
+
+private:
+    void place(WheelTimer &timer)
+    {
+        uint64_t expires = timer.expires;
+        int l = 0;
+        while (l < WHEEL_LEVELS - 1 && (expires >> (l * WHEEL_BITS)) - (current >> (l * WHEEL_BITS)) >= WHEEL_SLOTS)
+            l++;
+
+        int shift = l * WHEEL_BITS;
+        if ((expires >> shift) - (current >> shift) >= WHEEL_SLOTS)
+        {
+            // beyond the top level, park in its furthest slot and place again from there
+            expires = ((current >> shift) + WHEEL_SLOTS - 1) << shift;
+        }
+
+        timer.level = l;
+        timer.slot = (expires >> shift) & (WHEEL_SLOTS - 1);
+        link(slots[l][timer.slot], timer);
+        occupied[l] |= (uint64_t)1 << timer.slot;
+    }
+
+    // Moves the slots that are due at the current time down a level, the
+    // highest first so a timer can fall through several levels at once.
+    void cascade()
+    {
+        for (int l = WHEEL_LEVELS - 1; l > 0; l--)
+        {
+            int shift = l * WHEEL_BITS;
+            if (current & (((uint64_t)1 << shift) - 1))
+                continue; // not at a boundary of this level
+            int s = (current >> shift) & (WHEEL_SLOTS - 1);
+            TimerLink &head = slots[l][s];
+            while (head.next != &head)
+            {
+                WheelTimer &timer = *static_cast<WheelTimer *>(head.next);
+                unlink(timer);
+                place(timer);
+            }
+        }
+    }
+
+    size_t expire()
+    {
+        int s = current & (WHEEL_SLOTS - 1);
+        TimerLink &head = slots[0][s];
+        if (head.next == &head)
+            return 0;
+
+        // take the slot's list first, the callbacks may start timers into it
+        TimerLink due;
+        due.next = head.next;
+        due.prev = head.prev;
+        due.next->prev = &due;
+        due.prev->next = &due;
+        head.next = head.prev = &head;
+        occupied[0] &= ~((uint64_t)1 << s);
+        for (TimerLink *t = due.next; t != &due; t = t->next)
+            static_cast<WheelTimer *>(t)->level = -1;
+
+        size_t ran = 0;
+        while (due.next != &due)
+        {
+            WheelTimer &timer = *static_cast<WheelTimer *>(due.next);
+            unlink(timer);
+            if (timer.expires > current)
+            {
+                place(timer); // parked beyond the top level, not due yet
+                continue;
+            }
+            if (timer.period)
+            {
+                // drift free, skipping periods missed while asleep
+                timer.expires += timer.period;
+                if (timer.expires <= current)
+                    timer.expires += (current - timer.expires) / timer.period * timer.period + timer.period;
+                place(timer);
+            }
+            else
+                count--;
+            ran++;
+            if (timer.callback)
+                timer.callback(timer.arg); // may stop or restart timer, or any other
+        }
+        return ran;
+    }
+
+    void link(TimerLink &head, WheelTimer &timer)
+    {
+        timer.prev = head.prev;
+        timer.next = &head;
+        head.prev->next = &timer;
+        head.prev = &timer;
+    }
+
+    void unlink(WheelTimer &timer)
+    {
+        timer.prev->next = timer.next;
+        timer.next->prev = timer.prev;
+        if (timer.level >= 0)
+        {
+            TimerLink &head = slots[timer.level][timer.slot];
+            if (head.next == &head)
+                occupied[timer.level] &= ~((uint64_t)1 << timer.slot);
+        }
+        timer.next = timer.prev = NULL;
+    }
+
+    static uint64_t rotateRight(uint64_t bits, unsigned n)
+    {
+        return n ? (bits >> n) | (bits << (WHEEL_SLOTS - n)) : bits;
+    }
+
+    static int countTrailingZeros(uint64_t bits)
+    {
+        return __builtin_ctzll(bits);
+    }
+
+    TimerLink slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t occupied[WHEEL_LEVELS];
+    uint64_t current;
+    size_t count;
+};
+
+#endif
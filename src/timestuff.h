@@ -3,6 +3,7 @@
 
 #include <Arduino.h>
 #include "global.h"
+#include "logcodec.h"
 
 RTC_TimeTypeDef TimeStruct;
 RTC_DateTypeDef DateStruct;
@@ -10,40 +11,201 @@ struct tm timeinfo;
 const char *timezone = "GMT+0BST-1,M3.5.0/01:00:00,M10.5.0/02:00:00";
 const char *ntpServer = "2.pool.ntp.org";
 
-void getRtcTime(char *timeStr, size_t size)
+// Wall clock service. The BM8563 is only read at boot, after a sync and once
+// an hour; in between the time is derived from esp_timer. The hourly re-read
+// finds the RTC's second edge so the esp_timer drift against it can be
+// measured and corrected. While it waits for the edge the power task polls
+// every CLOCK_POLL_MS instead of sleeping until its next job.
+#define CLOCK_RESYNC_MS 3600000 // how often to line esp_timer up with the RTC again
+#define CLOCK_EDGE_US 50000     // an edge seen with a coarser poll is not used
+#define CLOCK_POLL_MS 10        // power task poll while waiting for the edge
+#define CLOCK_ALIGN_MS 1100     // no edge in this long: the RTC is not ticking, try again later
+#define CLOCK_DRIFT_MIN_S 600   // shortest span a drift estimate is taken over
+
+portMUX_TYPE clockMux = portMUX_INITIALIZER_UNLOCKED;
+uint32_t clockBase = 0;    // RTC seconds since 2000 ...
+int64_t clockBaseUs = 0;   // ... at this esp_timer time
+int32_t clockDriftPpb = 0; // esp_timer rate error, positive when it runs fast
+bool clockAligning = false;
+int64_t clockAlignStartUs = 0;
+uint32_t clockAlignFrom;   // RTC second being waited out
+int64_t clockPollUs;
+uint32_t clockRefSeconds;  // first aligned edge since the RTC was last set,
+int64_t clockRefUs;        // the drift is measured from here
+bool clockRefValid = false;
+volatile bool clockSetPending = false; // RTC was set from another task
+
+uint32_t readRtcSeconds()
 {
-    // Get the current date and time from the RTC
     RTC_DateTypeDef date;
     RTC_TimeTypeDef time;
     M5.Rtc.GetTime(&time);
     M5.Rtc.GetDate(&date);
 
-    // Format the date and time as a string
-    snprintf(timeStr, size, "%04d-%02d-%02d %02d:%02d:%02d",
-             date.Year, date.Month, date.Date,
-             time.Hours, time.Minutes, time.Seconds);
+    return (uint32_t)(logDaysFromCivil(date.Year, date.Month, date.Date) - LOG_EPOCH_DAYS) * 86400 +
+           time.Hours * 3600 + time.Minutes * 60 + time.Seconds;
+}
+
+void setClockBase(uint32_t seconds, int64_t us)
+{
+    portENTER_CRITICAL(&clockMux);
+    clockBase = seconds;
+    clockBaseUs = us;
+    portEXIT_CRITICAL(&clockMux);
+}
+
+// Starts the clock from the RTC, good to a second until updateClock() has
+// seen the next edge. Called at boot and after the RTC is set.
+void beginClock()
+{
+    uint32_t rtc = readRtcSeconds();
+    setClockBase(rtc, esp_timer_get_time());
+    clockAligning = true;
+    clockAlignFrom = rtc;
+    clockPollUs = esp_timer_get_time();
+    clockAlignStartUs = clockPollUs;
+    clockRefValid = false;
+}
+
+// Seconds since 2000 in RTC (local) time, optionally with the milliseconds.
+// Safe from any task.
+uint32_t clockSeconds(uint32_t *ms = NULL)
+{
+    portENTER_CRITICAL(&clockMux);
+    uint32_t base = clockBase;
+    int64_t baseUs = clockBaseUs;
+    int32_t ppb = clockDriftPpb;
+    portEXIT_CRITICAL(&clockMux);
+
+    int64_t elapsed = esp_timer_get_time() - baseUs;
+    elapsed -= elapsed * ppb / 1000000000LL;
+    if (ms != NULL)
+        *ms = (uint32_t)(elapsed / 1000 % 1000);
+    return base + (uint32_t)(elapsed / 1000000);
+}
+
+// Called from the power task. Only touches the RTC while waiting for a second edge,
+// which takes at most a second of polls, CLOCK_POLL_MS apart, once an hour.
+void updateClock()
+{
+    if (clockSetPending)
+    {
+        clockSetPending = false;
+        beginClock();
+        return;
+    }
+
+    int64_t now = esp_timer_get_time();
+
+    if (!clockAligning)
+    {
+        if (now - clockAlignStartUs < (int64_t)CLOCK_RESYNC_MS * 1000)
+            return;
+        clockAligning = true;
+        clockAlignFrom = readRtcSeconds();
+        clockPollUs = now;
+        clockAlignStartUs = now;
+        return;
+    }
+
+    uint32_t rtc = readRtcSeconds();
+    int64_t gap = now - clockPollUs;
+    clockPollUs = now;
+    if (rtc == clockAlignFrom)
+    {
+        if (now - clockAlignStartUs >= (int64_t)CLOCK_ALIGN_MS * 1000)
+        {
+            LOG_WARN("clock no RTC edge in %d ms\n", CLOCK_ALIGN_MS);
+            clockAligning = false;
+        }
+        return;
+    }
+    clockAlignFrom = rtc;
+    if (gap > CLOCK_EDGE_US)
+        return; // slept through it, wait for the next one
+
+    int64_t edgeUs = now - gap / 2;
+    if (!clockRefValid)
+    {
+        clockRefSeconds = rtc;
+        clockRefUs = edgeUs;
+        clockRefValid = true;
+    }
+    else if (rtc - clockRefSeconds >= CLOCK_DRIFT_MIN_S)
+    {
+        int64_t expected = (int64_t)(rtc - clockRefSeconds) * 1000000;
+        int32_t ppb = (int32_t)((edgeUs - clockRefUs - expected) * 1000000000LL / expected);
+        int32_t error = (int32_t)(clockSeconds() - rtc);
+        LOG_INFO("clock drift %d ppb, %d s off before resync\n", ppb, error);
+        portENTER_CRITICAL(&clockMux);
+        clockDriftPpb = ppb;
+        portEXIT_CRITICAL(&clockMux);
+    }
+    setClockBase(rtc, edgeUs);
+    clockAligning = false;
+}
+
+void putTwoDigits(char *p, uint32_t v)
+{
+    p[0] = '0' + v / 10;
+    p[1] = '0' + v % 10;
+}
+
+// Formats the clock as "YYYY-MM-DD hh:mm:ss". The string is cached and only
+// the fields that changed since the last call are rewritten. It does not step
+// back when a resync pulls the clock in by up to a second, a larger step back
+// (the RTC set, or a resync after a long drift) renders it anew. Safe from any
+// task: the cache is shared under rtcTimeMux and each caller gets a copy.
+portMUX_TYPE rtcTimeMux = portMUX_INITIALIZER_UNLOCKED;
+
+void getRtcTime(char *timeStr, size_t size)
+{
+    static char cached[20];
+    static uint32_t cachedSeconds = 0;
+    uint32_t now = clockSeconds();
+
+    if (size == 0)
+        return;
+    portENTER_CRITICAL(&rtcTimeMux);
+    if (cachedSeconds == 0 || now / 86400 != cachedSeconds / 86400 || now + 1 < cachedSeconds)
+    {
+        logSecondsToTime(now, cached, sizeof(cached));
+        cachedSeconds = now;
+    }
+    else if (now > cachedSeconds)
+    {
+        uint32_t t = now % 86400;
+        uint32_t c = cachedSeconds % 86400;
+        putTwoDigits(cached + 17, t % 60);
+        if (t / 60 != c / 60)
+            putTwoDigits(cached + 14, t / 60 % 60);
+        if (t / 3600 != c / 3600)
+            putTwoDigits(cached + 11, t / 3600);
+        cachedSeconds = now;
+    }
+
+    size_t n = min(size - 1, sizeof(cached) - 1);
+    memcpy(timeStr, cached, n);
+    portEXIT_CRITICAL(&rtcTimeMux);
+    timeStr[n] = 0;
 }
 
 void getRtcFileName(char *timeStr, size_t size)
 {
-    // Get the current date and time from the RTC
-    RTC_DateTypeDef date;
-    RTC_TimeTypeDef time;
-    M5.Rtc.GetTime(&time);
-    M5.Rtc.GetDate(&date);
+    char now[20];
+    logSecondsToTime(clockSeconds(), now, sizeof(now));
 
-    // Format the date and time as a string
-    snprintf(timeStr, size, "/%04d%02d%02d%02d%02d%02d.csv",
-             date.Year, date.Month, date.Date,
-             time.Hours, time.Minutes, time.Seconds);
+    snprintf(timeStr, size, "/%.4s%.2s%.2s%.2s%.2s%.2s.log",
+             now, now + 5, now + 8, now + 11, now + 14, now + 17);
 }
 
-bool timeSync()
+// Sets the RTC from NTP, waiting at most budgetMs for an answer.
+bool timeSync(uint32_t budgetMs = 5000)
 {
     configTime(0, 0, ntpServer); // get UTC time from NTP server
     setenv("TZ", timezone, 1);   // Set the TZ.
     tzset();
-    if (!getLocalTime(&timeinfo))
+    if (!getLocalTime(&timeinfo, budgetMs))
     {
         Serial.print("Failed to obtain time from ");
         Serial.println(ntpServer);
@@ -60,6 +222,7 @@ bool timeSync()
     DateStruct.WeekDay = timeinfo.tm_wday; // day of week. 0 = Sunday
     M5.Rtc.SetTime(&TimeStruct);
     M5.Rtc.SetDate(&DateStruct);
+    clockSetPending = true; // picked up by updateClock() on the power task
     return true;
 }
 
@@ -0,0 +1,58 @@
+#ifndef TOUCH_H
+#define TOUCH_H
+
+#include <Arduino.h>
+#include <driver/gpio.h>
+#include "gesture.h"
+
+// The FT6336 pulls its INT line low while it has a touch. The line wakes the
+// UI task, and the CPU out of light sleep, so nothing polls the controller
+// while the screen is left alone. The GPIO wakeup needs a level interrupt,
+// which would fire for as long as a finger is down, so it is only armed
+// around the light sleep itself and the falling edge is restored after.
+// While a finger is down the UI task samples it every TOUCH_TRACK_MS until
+// the release is confirmed, and posts the gestures to the power task through
+// gestureQueue.
+#define TOUCH_INT_PIN 39
+#define TOUCH_TRACK_MS 20
+#define GESTURE_QUEUE_LENGTH 8
+
+QueueHandle_t gestureQueue = NULL;
+TaskHandle_t touchWaiter = NULL;   // the UI task
+volatile bool touchActive = false; // a gesture is in progress, no light sleep until it is over
+
+void IRAM_ATTR onTouchInterrupt()
+{
+    BaseType_t woken = pdFALSE;
+    if (touchWaiter != NULL)
+        vTaskNotifyGiveFromISR(touchWaiter, &woken);
+    if (woken)
+        portYIELD_FROM_ISR();
+}
+
+// Just before esp_light_sleep_start().
+void touchSleepArm()
+{
+    gpio_wakeup_enable((gpio_num_t)TOUCH_INT_PIN, GPIO_INTR_LOW_LEVEL);
+}
+
+// Just after the light sleep: back to the edge interrupt and, when the INT
+// line ended the sleep, wake the UI task, as the interrupt may not have
+// seen the edge.
+void touchSleepDisarm(bool touched)
+{
+    gpio_wakeup_disable((gpio_num_t)TOUCH_INT_PIN);
+    gpio_set_intr_type((gpio_num_t)TOUCH_INT_PIN, GPIO_INTR_NEGEDGE);
+    if (touched && touchWaiter != NULL)
+        xTaskNotifyGive(touchWaiter);
+}
+
+void beginTouch()
+{
+    gestureQueue = xQueueCreate(GESTURE_QUEUE_LENGTH, sizeof(Gesture));
+    pinMode(TOUCH_INT_PIN, INPUT);
+    attachInterrupt(TOUCH_INT_PIN, onTouchInterrupt, FALLING);
+    esp_sleep_enable_gpio_wakeup();
+}
+
+#endif
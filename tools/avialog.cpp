@@ -0,0 +1,1840 @@
+// Host tool for the log files written by the AVIA receiver.
+//
+// Build on Linux / macOS:
+//     g++ -O2 -std=c++17 -pthread -I../src -I../lib/TelnetSpy avialog.cpp -o avialog
+//
+// Usage:
+//     avialog flights <flights.idx>          list the flights in an index file
+//     avialog decode <file>                  print a journal (or CSV log) as CSV
+//     avialog bench <file>...                packed encoding ratio and speed on recorded logs
+//     avialog report [-j N] <file|dir>...    per-flight exceedances and trends for card dumps
+//     avialog seek <journal> <time> [n]      print n records (default 20) from "YYYY-MM-DD HH:MM:SS"
+//     avialog boot <serial log>...           boot phase timings from captured serial / telnet output
+//     avialog clocksim [ppm] [jitter] [loss] simulated time beacon link: drift ppm, mean extra delay ms, loss %
+//     avialog listensim [period] [jitter] [loss] scheduled listening vs free running: sender period ms, jitter ms, loss %
+//     avialog energy [-c mAh] <serial log>...  per-activity current and runtime model from "i: energy" lines
+//     avialog wheelsim [timers] [hours]      timer wheel check across a 32-bit millis() wrap, and its speed
+//     avialog telnetbench [MB]               TelnetSpy ring buffer throughput: per byte, bulk and lock-free
+//     avialog binlogbench [messages]         deferred log: formatting check, producer stress and cost vs snprintf
+//     avialog ringstress [frames] [Hz]       frame log ring: sequence and drop check, flat out and at the sender's rate
+//
+// <file> is either a journal (*.log) or a CSV log from older firmware.
+// Directories are searched recursively for both.
+
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "binlog.h"
+#include "clocksync.h"
+#include "flight.h"
+#include "listen.h"
+#include "logcodec.h"
+#include "ranges.h"
+#include "ringbuffer.h"
+#include "TelnetSpyRing.h"
+#include "timerwheel.h"
+
+typedef std::function<void(const PackedRecord &)> RecordFn;
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: avialog flights <flights.idx>\n"
+            "       avialog decode <file>\n"
+            "       avialog bench <file>...\n"
+            "       avialog report [-j threads] <file|dir>...\n"
+            "       avialog seek <journal> <time> [count]\n"
+            "       avialog boot <serial log>...\n"
+            "       avialog clocksim [drift ppm] [jitter ms] [loss %%]\n"
+            "       avialog listensim [period ms] [jitter ms] [loss %%]\n"
+            "       avialog energy [-c capacity mAh] <serial log>...\n"
+            "       avialog wheelsim [timers] [hours]\n"
+            "       avialog telnetbench [MB]\n"
+            "       avialog binlogbench [messages]\n"
+            "       avialog ringstress [frames] [rate Hz]\n");
+    exit(2);
+}
+
+static double nowSeconds()
+{
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+// Read-only view of a whole file.
+struct MappedFile
+{
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+
+    bool open(const char *path)
+    {
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+        {
+            perror(path);
+            return false;
+        }
+        struct stat st;
+        bool ok = fstat(fd, &st) == 0;
+        size = ok ? st.st_size : 0;
+        if (ok && size > 0)
+        {
+            void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ok = p != MAP_FAILED;
+            if (ok)
+            {
+                data = (const uint8_t *)p;
+                madvise(p, size, MADV_SEQUENTIAL);
+            }
+        }
+        if (!ok)
+            perror(path);
+        ::close(fd);
+        return ok;
+    }
+
+    ~MappedFile()
+    {
+        if (data)
+            munmap((void *)data, size);
+    }
+};
+
+// Hand-rolled CSV parser for the one layout the logger writes. Numbers are
+// always [-]digits[.digits], so no locale, exponent or strtod is needed.
+class CsvParser
+{
+public:
+    // Parses the line at p and moves p past it. False for the header and for
+    // malformed lines.
+    bool parse(const char *&p, const char *end, PackedRecord &r)
+    {
+        static const LogField columns[] = {F_BATTERY_VOLTAGE, F_AMP, F_FUEL_LITRES, F_FUEL_PRESS,
+                                           F_OIL_TEMP, F_OIL_PRESS, F_CHT1, F_ACC_X, F_ACC_Y, F_ACC_Z};
+        const char *line = p;
+        const char *nl = (const char *)memchr(p, '\n', end - p);
+        const char *eol = nl ? nl : end;
+        p = nl ? nl + 1 : end;
+
+        if (eol - line < 20 || line[19] != ',' || !parseTime(line, r.v[F_TIME]))
+            return false;
+
+        const char *q = line + 20;
+        double value;
+        if (!number(q, eol, value))
+            return false;
+        r.v[F_FRAME] = (int32_t)value;
+        r.v[F_FLAGS] = 0;
+        for (LogField field : columns)
+        {
+            if (q >= eol || *q++ != ',' || !number(q, eol, value))
+                return false;
+            r.v[field] = (int32_t)lround(value * logFieldScale[field]);
+        }
+        // the ms column was added with the frame ring, older logs stop at accZ
+        r.v[F_MS] = 0;
+        if (q < eol && *q == ',' && number(++q, eol, value))
+            r.v[F_MS] = (int32_t)(uint32_t)value;
+        // and senderMs with the clock beacons
+        r.v[F_SENDER_MS] = 0;
+        if (q < eol && *q == ',' && number(++q, eol, value))
+            r.v[F_SENDER_MS] = (int32_t)(uint32_t)value;
+        return true;
+    }
+
+private:
+    char lastTime[19] = {};
+    int32_t lastSeconds = 0;
+
+    static bool number(const char *&p, const char *end, double &value)
+    {
+        static const double scale[] = {1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+        bool negative = p < end && *p == '-';
+        if (negative)
+            p++;
+        uint64_t mantissa = 0;
+        int digits = 0, decimals = 0;
+        while (p < end && (unsigned)(*p - '0') < 10)
+        {
+            mantissa = mantissa * 10 + (*p++ - '0');
+            digits++;
+        }
+        if (p < end && *p == '.')
+        {
+            p++;
+            while (p < end && (unsigned)(*p - '0') < 10)
+            {
+                if (decimals < 9)
+                {
+                    mantissa = mantissa * 10 + (*p - '0');
+                    decimals++;
+                }
+                p++;
+                digits++;
+            }
+        }
+        value = negative ? -(mantissa / scale[decimals]) : mantissa / scale[decimals];
+        return digits > 0;
+    }
+
+    // "YYYY-MM-DD HH:MM:SS", only re-parsed when the second changes
+    bool parseTime(const char *s, int32_t &seconds)
+    {
+        if (memcmp(s, lastTime, sizeof(lastTime)) == 0)
+        {
+            seconds = lastSeconds;
+            return true;
+        }
+        static const int digitAt[] = {0, 1, 2, 3, 5, 6, 8, 9, 11, 12, 14, 15, 17, 18};
+        int d[14];
+        for (int i = 0; i < 14; i++)
+        {
+            d[i] = s[digitAt[i]] - '0';
+            if ((unsigned)d[i] > 9)
+                return false;
+        }
+        int year = d[0] * 1000 + d[1] * 100 + d[2] * 10 + d[3];
+        int32_t days = logDaysFromCivil(year, d[4] * 10 + d[5], d[6] * 10 + d[7]) - LOG_EPOCH_DAYS;
+        seconds = days < 0 ? 0 : days * 86400 + (d[8] * 10 + d[9]) * 3600 + (d[10] * 10 + d[11]) * 60 + d[12] * 10 + d[13];
+        memcpy(lastTime, s, sizeof(lastTime));
+        lastSeconds = seconds;
+        return true;
+    }
+};
+
+static void forEachCsvLine(const char *text, size_t len, const RecordFn &fn)
+{
+    CsvParser parser;
+    PackedRecord r;
+    const char *p = text;
+    const char *end = text + len;
+    while (p < end)
+        if (parser.parse(p, end, r))
+            fn(r);
+}
+
+static void forEachBlockRecord(const LogBlock &block, const RecordFn &fn)
+{
+    if (block.header.type == LOG_BLOCK_CSV)
+    {
+        forEachCsvLine((const char *)block.payload, block.header.length, fn);
+    }
+    else if (block.header.type == LOG_BLOCK_PACKED)
+    {
+        LogDecoder decoder;
+        PackedRecord r;
+        const uint8_t *p = block.payload;
+        const uint8_t *end = p + block.header.length;
+        int fields = block.header.flags & LOG_BLOCK_SENDER_MS ? LOG_FIELDS : LOG_FIELDS_V2;
+        while (p < end && decoder.decode(p, end, r, fields))
+            fn(r);
+    }
+}
+
+// Walks the valid data blocks of a journal in order and stops at the first
+// damaged one. Returns false if the data is not a journal.
+static bool forEachBlock(const MappedFile &file, const std::function<void(const LogBlock &)> &fn)
+{
+    uint32_t blocks = file.size / LOG_BLOCK_SIZE;
+    auto readBlock = [&file, blocks](uint32_t index, void *buffer)
+    {
+        if (index >= blocks)
+            return false;
+        memcpy(buffer, file.data + (size_t)index * LOG_BLOCK_SIZE, LOG_BLOCK_SIZE);
+        return true;
+    };
+
+    LogSuperBlock sb = {};
+    if (!logLoadSuper(readBlock, sb))
+        return false;
+
+    for (uint32_t seq = 0; seq < sb.capacity && LOG_DATA_START + seq < blocks; seq++)
+    {
+        // mmap is page aligned, so every block is suitably aligned in place
+        const LogBlock &block = *(const LogBlock *)(file.data + (size_t)(LOG_DATA_START + seq) * LOG_BLOCK_SIZE);
+        if (!logBlockValid(block, sb.fileId, seq))
+            break;
+        fn(block);
+    }
+    return true;
+}
+
+static bool forEachRecord(const MappedFile &file, const RecordFn &fn)
+{
+    bool journal = forEachBlock(file, [&fn](const LogBlock &block)
+                                { forEachBlockRecord(block, fn); });
+    if (!journal)
+        forEachCsvLine((const char *)file.data, file.size, fn);
+    return journal;
+}
+
+static bool forEachRecord(const char *path, const RecordFn &fn)
+{
+    MappedFile file;
+    if (!file.open(path))
+        return false;
+    forEachRecord(file, fn);
+    return true;
+}
+
+static int listFlights(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        perror(path);
+        return 1;
+    }
+
+    printf("%-3s %-19s %8s  %-19s %6s  %8s %8s %8s\n",
+           "#", "start", "duration", "journal", "block", "oilT max", "oilP min", "fuel min");
+
+    FlightRecord record;
+    int n = 0;
+    while (fread(&record, sizeof(record), 1, f) == 1)
+    {
+        if (!flightValid(record))
+        {
+            printf("%-3d (damaged record)\n", n++);
+            continue;
+        }
+        unsigned long s = record.durationMs / 1000;
+        printf("%-3d %-19.19s %2lu:%02lu:%02lu  %-19.19s %6u  %8.1f %8.2f %8.1f%s\n",
+               n, record.startTime, s / 3600, s / 60 % 60, s % 60,
+               record.startFile, record.startBlock,
+               record.channels[CH_OIL_TEMP].max,
+               record.channels[CH_OIL_PRESS].min,
+               record.channels[CH_FUEL_LITRES].min,
+               record.closed ? "" : "  (open)");
+        n++;
+    }
+    fclose(f);
+    return 0;
+}
+
+static int decode(const char *path)
+{
+    char line[256];
+    fputs(LOG_CSV_HEADER, stdout);
+    bool ok = forEachRecord(path, [&line](const PackedRecord &r)
+                            {
+                                logFormatCsv(r, line, sizeof(line));
+                                fputs(line, stdout);
+                            });
+    return ok ? 0 : 1;
+}
+
+// Packs the recorded samples exactly as the logger would, block by block, and
+// compares against the CSV text the old logger wrote for the same samples.
+static int bench(int count, char **paths)
+{
+    std::vector<PackedRecord> records;
+    for (int i = 0; i < count; i++)
+        if (!forEachRecord(paths[i], [&records](const PackedRecord &r)
+                           { records.push_back(r); }))
+            return 1;
+    if (records.empty())
+    {
+        fprintf(stderr, "no records\n");
+        return 1;
+    }
+
+    char line[256];
+    size_t csvBytes = 0;
+    size_t csvBlocks = 1, csvUsed = 0;
+    for (const PackedRecord &r : records)
+    {
+        size_t n = logFormatCsv(r, line, sizeof(line));
+        csvBytes += n;
+        if (csvUsed + n > LOG_PAYLOAD_SIZE)
+        {
+            csvBlocks++;
+            csvUsed = 0;
+        }
+        csvUsed += n;
+    }
+
+    // encode into a block-sized arena, repeated until the timing is stable
+    std::vector<LogBlock> blocks(records.size());
+    std::vector<uint16_t> used(records.size());
+    size_t packedBytes = 0, packedBlocks = 0;
+    int rounds = 0;
+    double start = nowSeconds();
+    do
+    {
+        LogEncoder encoder;
+        packedBytes = 0;
+        packedBlocks = 0;
+        used[0] = 0;
+        for (const PackedRecord &r : records)
+        {
+            LogBlock &block = blocks[packedBlocks];
+            size_t n = encoder.encode(r, block.payload + used[packedBlocks], LOG_PAYLOAD_SIZE - used[packedBlocks]);
+            if (n == 0)
+            {
+                packedBlocks++;
+                used[packedBlocks] = 0;
+                encoder.reset();
+                n = encoder.encode(r, blocks[packedBlocks].payload, LOG_PAYLOAD_SIZE);
+            }
+            used[packedBlocks] += n;
+            packedBytes += n;
+        }
+        packedBlocks++;
+        rounds++;
+    } while (nowSeconds() - start < 0.5);
+    double encodeNs = (nowSeconds() - start) * 1e9 / ((double)rounds * records.size());
+
+    size_t decoded = 0, mismatched = 0;
+    rounds = 0;
+    start = nowSeconds();
+    do
+    {
+        decoded = 0;
+        mismatched = 0;
+        for (size_t b = 0; b < packedBlocks; b++)
+        {
+            LogDecoder decoder;
+            PackedRecord r;
+            const uint8_t *p = blocks[b].payload;
+            const uint8_t *end = p + used[b];
+            while (p < end && decoder.decode(p, end, r))
+            {
+                if (memcmp(&r, &records[decoded], sizeof(r)) != 0)
+                    mismatched++;
+                decoded++;
+            }
+        }
+        rounds++;
+    } while (nowSeconds() - start < 0.5);
+    double decodeNs = (nowSeconds() - start) * 1e9 / ((double)rounds * decoded);
+
+    printf("records          %zu\n", records.size());
+    printf("csv bytes        %zu (%.1f per record, %zu blocks)\n",
+           csvBytes, (double)csvBytes / records.size(), csvBlocks);
+    printf("packed bytes     %zu (%.1f per record, %zu blocks)\n",
+           packedBytes, (double)packedBytes / records.size(), packedBlocks);
+    printf("ratio            %.2fx bytes, %.2fx blocks\n",
+           (double)csvBytes / packedBytes, (double)csvBlocks / packedBlocks);
+    printf("encode           %.1f ns/record\n", encodeNs);
+    printf("decode           %.1f ns/record, %.0f MB/s packed\n",
+           decodeNs, packedBytes / (decodeNs * decoded) * 1e3);
+    printf("round trip       %s\n", decoded == records.size() && mismatched == 0 ? "ok" : "MISMATCH");
+    return decoded == records.size() && mismatched == 0 ? 0 : 1;
+}
+
+// Jumps straight to a time using the block headers as the index: loads the
+// superblock, scans the tail since the last checkpoint for the block count,
+// then binary searches.
+static int seek(const char *path, const char *timeStr, long count)
+{
+    MappedFile file;
+    if (!file.open(path))
+        return 1;
+
+    uint32_t blocks = file.size / LOG_BLOCK_SIZE;
+    uint32_t reads = 0;
+    auto readBlock = [&file, blocks, &reads](uint32_t index, void *buffer)
+    {
+        if (index >= blocks)
+            return false;
+        memcpy(buffer, file.data + (size_t)index * LOG_BLOCK_SIZE, LOG_BLOCK_SIZE);
+        reads++;
+        return true;
+    };
+
+    uint32_t target = logTimeToSeconds(timeStr);
+    LogSuperBlock sb = {};
+    if (target == 0 || !logLoadSuper(readBlock, sb))
+    {
+        fprintf(stderr, "%s: %s\n", path, target ? "not a journal" : "time must be YYYY-MM-DD HH:MM:SS");
+        return 1;
+    }
+    uint32_t valid = logScanTail(readBlock, sb);
+    uint32_t first = logSeekBlock(readBlock, sb, valid, target);
+    fprintf(stderr, "%u valid blocks, starting at block %u after %u block reads\n", valid, first, reads);
+
+    char line[256];
+    fputs(LOG_CSV_HEADER, stdout);
+    for (uint32_t seq = first; seq < valid && count > 0; seq++)
+    {
+        const LogBlock &block = *(const LogBlock *)(file.data + (size_t)(LOG_DATA_START + seq) * LOG_BLOCK_SIZE);
+        forEachBlockRecord(block, [&](const PackedRecord &r)
+                           {
+                               if (count <= 0 || (uint32_t)r.v[F_TIME] < target)
+                                   return;
+                               logFormatCsv(r, line, sizeof(line));
+                               fputs(line, stdout);
+                               count--;
+                           });
+    }
+    return 0;
+}
+
+// ---- boot ----
+
+// Summarises the "i: boot profile <n> <state> name=us ..." lines the receiver
+// prints for the previous boot. Phase is the time since the mark before it.
+static int bootSummary(int count, char **paths)
+{
+    std::vector<std::string> names; // in order of first appearance
+    std::vector<std::vector<double>> at, phase;
+    int boots = 0, incomplete = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        FILE *f = fopen(paths[i], "r");
+        if (f == NULL)
+        {
+            perror(paths[i]);
+            return 1;
+        }
+
+        char line[1024];
+        while (fgets(line, sizeof(line), f))
+        {
+            const char *p = strstr(line, "boot profile ");
+            unsigned boot;
+            char state[16];
+            int n;
+            if (p == NULL || sscanf(p, "boot profile %u %15s%n", &boot, state, &n) != 2)
+                continue;
+            boots++;
+            if (strcmp(state, "complete") != 0)
+                incomplete++;
+
+            double previous = 0;
+            char name[32];
+            unsigned us;
+            int used;
+            for (p += n; sscanf(p, " %31[^=]=%u%n", name, &us, &used) == 2; p += used)
+            {
+                size_t k = std::find(names.begin(), names.end(), name) - names.begin();
+                if (k == names.size())
+                {
+                    names.push_back(name);
+                    at.resize(k + 1);
+                    phase.resize(k + 1);
+                }
+                at[k].push_back(us / 1000.0);
+                phase[k].push_back((us - previous) / 1000.0);
+                previous = us;
+            }
+        }
+        fclose(f);
+    }
+
+    if (boots == 0)
+    {
+        fprintf(stderr, "no boot profile lines found\n");
+        return 1;
+    }
+
+    auto percentile = [](std::vector<double> &v, double q)
+    {
+        std::sort(v.begin(), v.end());
+        return v[(size_t)(q * (v.size() - 1) + 0.5)];
+    };
+
+    printf("%d boots, %d incomplete\n", boots, incomplete);
+    printf("%-12s %6s %10s %10s %10s %10s\n", "mark", "boots", "at ms", "phase min", "median", "max");
+    for (size_t k = 0; k < names.size(); k++)
+    {
+        printf("%-12s %6zu %10.1f %10.1f %10.1f %10.1f\n", names[k].c_str(), at[k].size(),
+               percentile(at[k], 0.5), percentile(phase[k], 0), percentile(phase[k], 0.5),
+               percentile(phase[k], 1));
+    }
+    return 0;
+}
+
+// ---- clocksim ----
+
+// Runs the receiver's ClockEstimator against a simulated sender: a crystal
+// drift, beacons once a second with random loss, and a delay of 1 ms plus an
+// exponential jitter with the odd 30-80 ms stall. Reports how far the estimate
+// of the sender's clock is off over an hour, after the first fit.
+static int clockSim(double ppm, double jitterMs, double lossPct)
+{
+    const int64_t period = 1000000;
+    const int64_t duration = 3600LL * 1000000;
+    const int64_t senderStart = 123456789; // sender booted well before the receiver
+
+    std::mt19937_64 rng(42);
+    std::exponential_distribution<double> jitter(1.0 / std::max(jitterMs * 1000.0, 1.0));
+    std::uniform_real_distribution<double> uniform(0, 1);
+
+    ClockEstimator estimator;
+    std::vector<double> errors;
+    double worst = 0;
+    uint32_t sent = 0, received = 0;
+
+    for (int64_t local = 0; local < duration; local += period)
+    {
+        // sender time for a local time: the receiver's crystal is ppm fast
+        int64_t sender = senderStart + (int64_t)(local / (1 + ppm * 1e-6));
+        sent++;
+
+        if (estimator.valid())
+        {
+            // check the estimate at a random point in the gap between beacons
+            int64_t at = local + (int64_t)(uniform(rng) * period);
+            int64_t truth = senderStart + (int64_t)(at / (1 + ppm * 1e-6));
+            double error = fabs((double)(estimator.toSender(at) - truth)) / 1000.0;
+            errors.push_back(error);
+            worst = std::max(worst, error);
+        }
+
+        if (uniform(rng) * 100 < lossPct)
+            continue;
+        double delay = 1000 + jitter(rng);
+        if (uniform(rng) < 0.02)
+            delay += 30000 + uniform(rng) * 50000;
+        estimator.add(sent - 1, sender, local + (int64_t)delay);
+        received++;
+    }
+
+    if (errors.empty())
+    {
+        fprintf(stderr, "estimator never fitted\n");
+        return 1;
+    }
+    std::sort(errors.begin(), errors.end());
+    printf("drift %.1f ppm, jitter %.1f ms, loss %.0f%%: %u of %u beacons received\n",
+           ppm, jitterMs, lossPct, received, sent);
+    printf("estimated drift %.2f ppm, %u lost\n", estimator.driftPpm(), estimator.lost());
+    printf("error ms: median %.3f  p99 %.3f  max %.3f  (%zu checks)\n",
+           errors[errors.size() / 2], errors[errors.size() * 99 / 100], worst, errors.size());
+    return worst < 10 ? 0 : 1;
+}
+
+// ---- listensim ----
+
+struct ListenResult
+{
+    double duty;      // fraction of the time the radio is on
+    double perSecond; // frames received per second
+    double delivery;  // windows that caught their frame
+};
+
+// Sender frames at period (its crystal 30 ppm slow), each sent up to jitter
+// late and lost with probability loss, arriving 1 ms after they are sent.
+// The radio is simulated in 100 us steps for ten minutes.
+template <typename Radio>
+static ListenResult simulateListen(Radio &radio, double periodMs, double jitterMs, double lossPct)
+{
+    const int64_t step = 100;
+    const int64_t duration = 600LL * 1000000;
+    const double period = periodMs * 1000 * (1 + 30e-6);
+
+    std::mt19937_64 rng(7);
+    std::uniform_real_distribution<double> uniform(0, 1);
+
+    int64_t onTime = 0;
+    uint32_t received = 0;
+    int64_t nextTx = 0;
+    int64_t arrival = -1;
+    uint64_t frame = 0;
+
+    for (int64_t t = 0; t < duration; t += step)
+    {
+        while (arrival < t)
+        {
+            nextTx = (int64_t)(++frame * period);
+            arrival = uniform(rng) * 100 < lossPct ? -1 : nextTx + (int64_t)(uniform(rng) * jitterMs * 1000) + 1000;
+            if (arrival >= 0)
+                break;
+        }
+
+        bool on = radio.on(t);
+        if (on)
+            onTime += step;
+        if (on && arrival >= t && arrival < t + step)
+        {
+            if (radio.frame(arrival))
+                received++;
+            arrival = -1;
+        }
+    }
+
+    ListenResult r;
+    r.duty = (double)onTime / duration;
+    r.perSecond = received / (duration / 1e6);
+    r.delivery = radio.delivery();
+    return r;
+}
+
+// The old loop: resume, take the first frame once the radio is up, pause and
+// sleep LISTEN_INTERVAL_US.
+struct FreeRunningRadio
+{
+    int64_t resumed = 0;
+    int64_t sleepUntil = 0;
+
+    bool on(int64_t t)
+    {
+        if (t < sleepUntil)
+            return false;
+        if (resumed < sleepUntil)
+            resumed = t;
+        return true;
+    }
+    bool frame(int64_t t)
+    {
+        if (t - resumed < LISTEN_WAKE_US)
+            return false;
+        sleepUntil = t + LISTEN_INTERVAL_US;
+        return true;
+    }
+    double delivery() const
+    {
+        return 1;
+    }
+};
+
+struct ScheduledRadio
+{
+    ListenScheduler scheduler;
+    int64_t resumed = -1;
+
+    ScheduledRadio(int64_t guardUs) : scheduler(guardUs) {}
+
+    bool on(int64_t t)
+    {
+        scheduler.update(t);
+        bool on = scheduler.radioOn(t);
+        if (on && resumed < 0)
+            resumed = t;
+        if (!on)
+            resumed = -1;
+        return on;
+    }
+    bool frame(int64_t t)
+    {
+        // nothing is heard while the radio is still starting
+        if (resumed < 0 || t - resumed < LISTEN_WAKE_US)
+            return false;
+        scheduler.onFrame(t);
+        return true;
+    }
+    double delivery() const
+    {
+        return scheduler.windows ? (double)scheduler.hits / scheduler.windows : 0;
+    }
+};
+
+static int listenSim(double periodMs, double jitterMs, double lossPct)
+{
+    printf("sender period %.1f ms, jitter %.1f ms, loss %.0f%%, radio wake %.0f ms, wanted %.1f frames/s\n",
+           periodMs, jitterMs, lossPct, LISTEN_WAKE_US / 1000.0, 1e6 / LISTEN_INTERVAL_US);
+    printf("%-18s %8s %10s %10s\n", "strategy", "duty %", "frames/s", "delivery");
+
+    FreeRunningRadio free;
+    ListenResult r = simulateListen(free, periodMs, jitterMs, lossPct);
+    printf("%-18s %8.2f %10.2f %10s\n", "free running", r.duty * 100, r.perSecond, "-");
+
+    const int guards[] = {1, 2, 4, 8, 16};
+    for (int g : guards)
+    {
+        ScheduledRadio scheduled(g * 1000);
+        r = simulateListen(scheduled, periodMs, jitterMs, lossPct);
+        char name[32];
+        snprintf(name, sizeof(name), "scheduled +-%d ms", g);
+        printf("%-18s %8.2f %10.2f %9.1f%%\n", name, r.duty * 100, r.perSecond, r.delivery * 100);
+    }
+    return 0;
+}
+
+// ---- wheelsim ----
+
+// Half the timers are periodic (0.1 s to 1 h), half one-shot (1 ms to 10 h)
+// and restarted from their own callback. The driver sleeps like the power
+// task, until nextWake(), but now and then wakes early or oversleeps. Every
+// callback must run at exactly its expiry and nextWake() must never be later
+// than the earliest timer. Starts an hour before millis() would wrap.
+struct WheelJob
+{
+    WheelTimer timer;
+    uint64_t due;
+    TimerWheel *wheel;
+    std::mt19937_64 *rng;
+    uint64_t fired;
+    uint64_t wrong;
+};
+
+static uint64_t logUniform(std::mt19937_64 &rng, double lo, double hi)
+{
+    std::uniform_real_distribution<double> u(log(lo), log(hi));
+    return (uint64_t)exp(u(rng));
+}
+
+static void wheelJobFired(void *arg)
+{
+    WheelJob &job = *(WheelJob *)arg;
+    job.fired++;
+    if (job.wheel->now() != job.due)
+        job.wrong++;
+    if (job.timer.period)
+    {
+        job.due = job.timer.expires;
+        // the odd periodic job stops and comes back later with a new period
+        if ((*job.rng)() % 1000 == 0)
+        {
+            uint64_t period = logUniform(*job.rng, 100, 3600e3);
+            job.wheel->start(job.timer, period, period);
+            job.due = job.timer.expires;
+        }
+        return;
+    }
+    uint64_t delay = logUniform(*job.rng, 1, 36000e3);
+    job.wheel->start(job.timer, delay);
+    job.due = job.timer.expires;
+}
+
+static int wheelSim(int timers, double hours)
+{
+    const uint64_t start = 0xFFFFFFFFULL - 3600 * 1000;
+    const uint64_t end = start + (uint64_t)(hours * 3600e3);
+
+    std::mt19937_64 rng(42);
+    TimerWheel wheel(start);
+    std::vector<WheelJob> jobs(timers);
+    for (int i = 0; i < timers; i++)
+    {
+        WheelJob &job = jobs[i];
+        job.timer.callback = wheelJobFired;
+        job.timer.arg = &job;
+        job.wheel = &wheel;
+        job.rng = &rng;
+        job.fired = job.wrong = 0;
+        if (i % 2)
+            wheel.start(job.timer, logUniform(rng, 1, 36000e3));
+        else
+        {
+            uint64_t period = logUniform(rng, 100, 3600e3);
+            wheel.start(job.timer, period, period);
+        }
+        job.due = job.timer.expires;
+    }
+
+    uint64_t wakes = 0, early = 0, late = 0, checks = 0, bad = 0;
+    double earlyMs = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    while (wheel.now() < end)
+    {
+        uint64_t next = wheel.nextWake();
+        if (++wakes % 256 == 0)
+        {
+            uint64_t earliest = WHEEL_NEVER;
+            for (const WheelJob &job : jobs)
+                if (job.timer.pending())
+                    earliest = std::min(earliest, job.timer.expires);
+            checks++;
+            if (next > earliest)
+                bad++;
+            else if (next < earliest)
+            {
+                early++;
+                earlyMs += earliest - next;
+            }
+        }
+
+        uint64_t to = next;
+        uint64_t roll = rng() % 100;
+        if (roll < 5 && next > wheel.now() + 1)
+            to = wheel.now() + 1 + rng() % (next - wheel.now() - 1); // woken by something else
+        else if (roll < 10)
+        {
+            to = next + rng() % 5000; // overslept
+            late++;
+        }
+        wheel.advance(std::min(to, end));
+    }
+    double runS = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    uint64_t fired = 0, wrong = 0;
+    for (const WheelJob &job : jobs)
+    {
+        fired += job.fired;
+        wrong += job.wrong;
+    }
+
+    // start / stop cost on a loaded wheel
+    const int ops = 1000000;
+    WheelTimer probe;
+    t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < ops; i++)
+    {
+        wheel.start(probe, 1 + (i * 2654435761u) % 20000000);
+        wheel.stop(probe);
+    }
+    double opNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / ops;
+
+    printf("%d timers, %.1f h from %llu ms (a 32-bit millis() wraps after 1 h)\n",
+           timers, hours, (unsigned long long)start);
+    printf("%llu callbacks, %llu off their expiry; %llu wakes, %llu of them overslept\n",
+           (unsigned long long)fired, (unsigned long long)wrong,
+           (unsigned long long)wakes, (unsigned long long)late);
+    printf("nextWake: %llu checks, %llu after the earliest timer, %llu early by %.1f ms avg\n",
+           (unsigned long long)checks, (unsigned long long)bad, (unsigned long long)early,
+           early ? earlyMs / early : 0.0);
+    printf("%.0f ns per wake, %.1f ns per start + stop\n", runS * 1e9 / wakes, opNs);
+    return wrong == 0 && bad == 0 ? 0 : 1;
+}
+
+// ---- telnetbench ----
+
+// Log lines are printed into a TelnetSpy ring and a client is sent 512 byte
+// blocks whenever that much is waiting, as handle() does. Three ways of filling it:
+//   per byte  the old write(uint8_t) path, one lock per character
+//   bulk      write(buffer, size), one lock per print
+//   spsc      TelnetSpySpscRing, no lock
+// Writer and reader share one thread so the numbers are the cost of the
+// write path alone, on any host. The lock is a spinlock like the ESP32's
+// portMUX; on the device a critical section also masks interrupts and costs
+// more, so the gap there is wider.
+class BenchLock
+{
+public:
+    void lock()
+    {
+        while (flag.test_and_set(std::memory_order_acquire))
+            ;
+    }
+    void unlock() { flag.clear(std::memory_order_release); }
+
+private:
+    std::atomic_flag flag = ATOMIC_FLAG_INIT;
+};
+
+enum BenchMode
+{
+    BENCH_PER_BYTE,
+    BENCH_BULK,
+    BENCH_SPSC
+};
+
+static void benchRelease(TelnetSpyRing &, uint32_t)
+{
+}
+
+static void benchRelease(TelnetSpySpscRing &ring, uint32_t pos)
+{
+    ring.release(pos);
+}
+
+template <class Ring>
+static void benchRing(const char *name, BenchMode mode, const std::vector<std::string> &lines, size_t bytes)
+{
+    Ring ring;
+    ring.resize(4096);
+    BenchLock lock;
+    const bool locked = mode != BENCH_SPSC;
+    char sink[512];
+    uint32_t cursor = 0;
+    uint64_t written = 0, received = 0, skipped = 0, count = 0, locks = 0;
+
+    double t0 = nowSeconds();
+    while (written < bytes)
+    {
+        for (const std::string &line : lines)
+        {
+            const uint8_t *data = (const uint8_t *)line.data();
+            if (mode == BENCH_PER_BYTE)
+            {
+                for (size_t i = 0; i < line.size(); i++)
+                {
+                    lock.lock();
+                    ring.write(data + i, 1);
+                    lock.unlock();
+                }
+                locks += line.size();
+            }
+            else if (locked)
+            {
+                lock.lock();
+                ring.write(data, line.size());
+                lock.unlock();
+                locks++;
+            }
+            else
+                ring.write(data, line.size());
+            written += line.size();
+            count++;
+
+            while (ring.headPos() - cursor >= sizeof(sink))
+            {
+                const char *block;
+                if (locked)
+                    lock.lock();
+                if ((int32_t)(cursor - ring.tailPos()) < 0)
+                {
+                    skipped += ring.tailPos() - cursor;
+                    cursor = ring.tailPos();
+                }
+                size_t n = ring.peekAt(cursor, &block, sizeof(sink));
+                if (locked)
+                    lock.unlock();
+                memcpy(sink, block, n); // the client write
+                cursor += n;
+                benchRelease(ring, cursor);
+                received += n;
+            }
+        }
+    }
+    double runS = nowSeconds() - t0;
+
+    printf("%-9s %7.1f MB/s %7.1f ns/line %6.2f write locks/line%s\n", name, written / runS / 1e6,
+           runS * 1e9 / count, (double)locks / count,
+           skipped == 0 && received + (ring.headPos() - cursor) == ring.headPos() ? "" : "  LOST BYTES");
+}
+
+static int telnetBench(double mb)
+{
+    std::mt19937 rng(7);
+    std::vector<std::string> lines;
+    char line[160];
+    for (int i = 0; i < 1000; i++)
+    {
+        switch (rng() % 3)
+        {
+        case 0:
+            snprintf(line, sizeof(line), "i: rx %u us\n", (unsigned)(rng() % 100000));
+            break;
+        case 1:
+            snprintf(line, sizeof(line), "i: energy radio=%u%% lcd=%u%% cpu=%u%% %u.%02umA\n", (unsigned)(rng() % 100),
+                     (unsigned)(rng() % 100), (unsigned)(rng() % 100), (unsigned)(rng() % 300),
+                     (unsigned)(rng() % 100));
+            break;
+        default:
+            snprintf(line, sizeof(line), "%02u:%02u:%02u oil %u psi %u C fuel %u l/h egt %u C\n",
+                     (unsigned)(rng() % 24), (unsigned)(rng() % 60), (unsigned)(rng() % 60),
+                     (unsigned)(rng() % 100), (unsigned)(rng() % 150), (unsigned)(rng() % 40),
+                     (unsigned)(rng() % 900));
+        }
+        lines.push_back(line);
+    }
+
+    size_t bytes = (size_t)(mb * 1e6);
+    printf("%.0f MB of log lines through a 4096 byte ring\n", mb);
+    benchRing<TelnetSpyRing>("per byte", BENCH_PER_BYTE, lines, bytes);
+    benchRing<TelnetSpyRing>("bulk", BENCH_BULK, lines, bytes);
+    benchRing<TelnetSpySpscRing>("spsc", BENCH_SPSC, lines, bytes);
+    return 0;
+}
+
+// ---- binlogbench ----
+
+// Every deferred message in the firmware, with typical arguments, must come
+// out of binLogFormat() exactly as snprintf prints it. Then producer threads
+// push into one ring while a consumer pops, as the tasks and the print task
+// do: every message must arrive once, in order per producer, or be counted
+// as dropped. Last, the cost on the logging side: a record against snprintf.
+static int binLogCheck(const char *fmt, const BinLogRecord &r, const char *expected)
+{
+    char line[256];
+    binLogFormat(r, line, sizeof(line));
+    if (strcmp(line, expected) == 0)
+        return 0;
+    printf("mismatch for \"%s\":\n  got      %s  expected %s", fmt, line, expected);
+    return 1;
+}
+
+template <typename... Args>
+static int binLogSame(const char *fmt, Args... args)
+{
+    static BinLogRing<4> ring;
+    BinLogRecord r;
+    binLogPush(ring, 0, fmt, args...);
+    ring.pop(r);
+    char expected[256];
+    snprintf(expected, sizeof(expected), fmt, args...);
+    return binLogCheck(fmt, r, expected);
+}
+
+static BinLogRing<256> stressRing;
+static int binLogProbe;
+
+static int binLogBench(int messages)
+{
+    int bad = 0;
+    bad += binLogSame("i: rx %i ** saved %i **\n", 1234, 17);
+    bad += binLogSame("w: ingest queue full, %u frames dropped\n", 4000000000u);
+    bad += binLogSame("w: invalid frame, %d bytes\n", -3);
+    bad += binLogSame("i: sender clock offset %lld us drift %.1f ppm, %u beacons lost\n", -123456789012LL, -41.25, 3u);
+    bad += binLogSame("w: log ring full, %u frames dropped (peak %u/%u)\n", 5u, 256u, 256u);
+    bad += binLogSame("i: clock drift %d ppb, %d s off before resync\n", -2500, 1);
+    bad += binLogSame("i: SD worst write: block %u us, batch %u us\n", 12000u, 45000u);
+    bad += binLogSame("i: flight %d stopped after %lu s\n", 3, 5400ul);
+    bad += binLogSame("i: touch %s x=%d y=%d dx=%d dy=%d held %u ms LCD=%d\n", "swipe left", (int16_t)200,
+                      (int16_t)120, (int16_t)-80, (int16_t)4, 230u, 3100);
+    bad += binLogSame("i: radio %s: on %.1f%%, %u cycles, resume %.2f ms avg %.2f max\n", "kept", 12.34f, 99u, 0.5, 1.25);
+    bad += binLogSame("d: %+d %5.3e %-6s| %c %x %08lX %zu %p\n", -7, 0.000123, "ab", 'Z', 255u, 0xBEEFul, (size_t)42,
+                      (void *)&binLogProbe);
+
+    // producers write their id and a sequence number, the consumer checks them
+    const int producers = 4;
+    std::atomic<int> running(producers);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < producers; t++)
+        threads.emplace_back([&, t] {
+            for (int i = 0; i < messages / producers; i++)
+            {
+                binLogPush(stressRing, i, "p%d %d\n", t, i);
+                if (i % 32 == 31)
+                    std::this_thread::yield(); // tasks log now and then, not flat out
+            }
+            running--;
+        });
+    std::vector<int> next(producers, 0);
+    uint64_t received = 0, skipped = 0, disorder = 0;
+    BinLogRecord r;
+    for (;;)
+    {
+        bool finished = running.load() == 0;
+        if (!stressRing.pop(r))
+        {
+            if (finished && stressRing.empty())
+                break;
+            std::this_thread::yield();
+            continue;
+        }
+        int t = (int)r.args[0], i = (int)r.args[1];
+        if (i < next[t])
+            disorder++;
+        else
+            skipped += i - next[t];
+        next[t] = i + 1;
+        received++;
+    }
+    for (std::thread &t : threads)
+        t.join();
+    for (int t = 0; t < producers; t++)
+        skipped += messages / producers - next[t];
+    bool lost = skipped != stressRing.droppedCount() || disorder;
+
+    // cost per message on the logging side
+    const int n = 1000000;
+    BinLogRing<1024> ring;
+    char line[256];
+    double t0 = nowSeconds();
+    for (int i = 0; i < n; i++)
+    {
+        binLogPush(ring, i, "i: sender clock offset %lld us drift %.1f ppm, %u beacons lost\n", (long long)i * 7, i * 0.01,
+                   (unsigned)i);
+        if ((i & 511) == 511)
+            while (ring.pop(r))
+                ;
+    }
+    double pushNs = (nowSeconds() - t0) * 1e9 / n;
+    t0 = nowSeconds();
+    volatile size_t sink = 0;
+    for (int i = 0; i < n; i++)
+        sink += snprintf(line, sizeof(line), "i: sender clock offset %lld us drift %.1f ppm, %u beacons lost\n",
+                         (long long)i * 7, i * 0.01, (unsigned)i);
+    double printfNs = (nowSeconds() - t0) * 1e9 / n;
+    t0 = nowSeconds();
+    binLogPush(ring, 0, "i: sender clock offset %lld us drift %.1f ppm, %u beacons lost\n", 7LL, 0.01, 1u);
+    ring.pop(r);
+    for (int i = 0; i < n; i++)
+        sink += binLogFormat(r, line, sizeof(line));
+    double formatNs = (nowSeconds() - t0) * 1e9 / n;
+
+    printf("formatting: %d of 11 messages differ from snprintf\n", bad);
+    printf("%d producers, %d messages: %llu received, %llu dropped (%u counted), %llu out of order\n", producers,
+           messages, (unsigned long long)received, (unsigned long long)skipped, stressRing.droppedCount(),
+           (unsigned long long)disorder);
+    printf("per message: record %.0f ns, snprintf %.0f ns, later formatting %.0f ns\n", pushNs, printfNs, formatNs);
+    return bad == 0 && !lost ? 0 : 1;
+}
+
+// ---- ringstress ----
+
+// The frame ring between the ingest task and the SD writer (framelog.h). First
+// a producer and a consumer thread run flat out, the consumer the slower, so
+// the ring runs full and drops: every frame popped must be whole and next in
+// sequence, or the gap before it counted as dropped. Then
+// the producer runs at the sender's rate, sped up STRESS_SPEEDUP times,
+// against a writer that drains batches as logWriterTask does and stalls on
+// each as the card does, once for STRESS_CARD_STALL_MS: nothing may be lost.
+#define STRESS_RING_LENGTH 256     // LOG_RING_LENGTH
+#define STRESS_BATCH 25            // LOG_BATCH_FRAMES
+#define STRESS_FLUSH_MS 1000       // LOG_FLUSH_MS
+#define STRESS_WRITE_MS 100        // card time per batch
+#define STRESS_CARD_STALL_MS 3000  // one long stall, as an SD card's housekeeping
+#define STRESS_PACED_S 120         // sender time of the paced run
+#define STRESS_SPEEDUP 20
+
+// the size of a LoggedFrame, filled from its sequence number
+struct StressFrame
+{
+    uint32_t seq;
+    uint32_t fill[19];
+};
+
+static void stressFill(StressFrame &f, uint32_t seq)
+{
+    f.seq = seq;
+    for (int k = 0; k < 19; k++)
+        f.fill[k] = seq * 2654435761u + k;
+}
+
+static bool stressWhole(const StressFrame &f)
+{
+    for (int k = 0; k < 19; k++)
+        if (f.fill[k] != f.seq * 2654435761u + k)
+            return false;
+    return true;
+}
+
+struct StressResult
+{
+    uint64_t received = 0;
+    uint64_t skipped = 0;
+    uint64_t torn = 0;
+    uint64_t disorder = 0;
+    uint32_t dropped = 0;
+    uint32_t peak = 0;
+};
+
+// rateHz 0 runs both sides flat out.
+static StressResult stressRun(uint32_t frames, double rateHz)
+{
+    typedef std::chrono::steady_clock Clock;
+    std::unique_ptr<SpscRing<StressFrame, STRESS_RING_LENGTH>> owned(new SpscRing<StressFrame, STRESS_RING_LENGTH>());
+    SpscRing<StressFrame, STRESS_RING_LENGTH> &ring = *owned;
+    std::atomic<bool> finished(false);
+    StressResult result;
+
+    std::thread producer([&] {
+        Clock::time_point next = Clock::now();
+        auto period = std::chrono::duration<double>(rateHz > 0 ? 1.0 / (rateHz * STRESS_SPEEDUP) : 0);
+        StressFrame f;
+        for (uint32_t i = 0; i < frames; i++)
+        {
+            stressFill(f, i);
+            ring.push(f);
+            if (rateHz > 0)
+            {
+                next += std::chrono::duration_cast<Clock::duration>(period);
+                std::this_thread::sleep_until(next);
+            }
+            else if (i % 64 == 63)
+                std::this_thread::yield(); // lets the consumer in on a single core too
+        }
+        finished = true;
+    });
+
+    auto scaled = [](double ms) {
+        return std::chrono::microseconds((int64_t)(ms * 1000 / STRESS_SPEEDUP));
+    };
+    static StressFrame batch[STRESS_BATCH];
+    uint32_t next = 0;
+    bool stalled = false;
+    Clock::time_point flushAt = Clock::now() + scaled(STRESS_FLUSH_MS);
+    for (;;)
+    {
+        bool done = finished.load();
+        if (rateHz > 0 && !done)
+        {
+            // woken by a full batch or the flush interval
+            while (ring.size() < STRESS_BATCH && Clock::now() < flushAt && !finished.load())
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+            flushAt = Clock::now() + scaled(STRESS_FLUSH_MS);
+        }
+        size_t n;
+        bool any = false;
+        while ((n = ring.popBatch(batch, STRESS_BATCH)) > 0)
+        {
+            any = true;
+            for (size_t k = 0; k < n; k++)
+            {
+                const StressFrame &f = batch[k];
+                if (!stressWhole(f))
+                    result.torn++;
+                if (f.seq < next)
+                    result.disorder++;
+                else
+                    result.skipped += f.seq - next;
+                next = f.seq + 1;
+                result.received++;
+            }
+            if (rateHz > 0)
+            {
+                bool longStall = !stalled && next >= frames / 2;
+                stalled |= longStall;
+                std::this_thread::sleep_for(scaled(longStall ? STRESS_CARD_STALL_MS : STRESS_WRITE_MS));
+            }
+            else
+                std::this_thread::yield(); // a batch per turn is slower than the producer: the ring fills and drops
+        }
+        if (done && !any && ring.size() == 0)
+            break;
+        if (!any && rateHz == 0)
+            std::this_thread::yield();
+    }
+    producer.join();
+    result.skipped += frames - next;
+    result.dropped = ring.droppedCount();
+    result.peak = ring.peakUsed();
+    return result;
+}
+
+static bool stressReport(const char *name, uint32_t frames, const StressResult &r, bool lossless)
+{
+    printf("%-9s %u frames: %llu received, %llu missing (%u counted as dropped), %llu torn, %llu out of order, "
+           "peak %u/%u\n",
+           name, frames, (unsigned long long)r.received, (unsigned long long)r.skipped, r.dropped,
+           (unsigned long long)r.torn, (unsigned long long)r.disorder, r.peak, STRESS_RING_LENGTH);
+    return r.skipped == r.dropped && r.torn == 0 && r.disorder == 0 && (!lossless || r.dropped == 0);
+}
+
+static int ringStress(uint32_t frames, double rateHz)
+{
+    bool ok = stressReport("flat out", frames, stressRun(frames, 0), false);
+    uint32_t paced = (uint32_t)(rateHz * STRESS_PACED_S);
+    printf("paced: %.0f Hz for %d s, batches of %d, %d ms per batch, one %d ms card stall\n", rateHz,
+           STRESS_PACED_S, STRESS_BATCH, STRESS_WRITE_MS, STRESS_CARD_STALL_MS);
+    ok &= stressReport("paced", paced, stressRun(paced, rateHz), true);
+    return ok ? 0 : 1;
+}
+
+// ---- energy ----
+
+// Same order as energyStateNames on the receiver.
+static const char *energyStates[] = {"render", "radio", "sleep", "sd", "audio"};
+static const int ENERGY_STATES = sizeof(energyStates) / sizeof(energyStates[0]);
+
+// Fits drain = base + sum(current[state] * residency[state]) by least squares
+// to the receiver's minute reports, then predicts the runtime of a full
+// battery for the average mix and with each activity taken out.
+static int energyModel(int argc, char **argv)
+{
+    const int N = ENERGY_STATES + 1;
+    double capacity = 390;
+    double ata[N][N] = {}, atb[N] = {}, mean[N] = {};
+    int rows = 0;
+
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+        {
+            capacity = atof(argv[++i]);
+            continue;
+        }
+        FILE *f = fopen(argv[i], "r");
+        if (f == NULL)
+        {
+            perror(argv[i]);
+            return 1;
+        }
+
+        char line[512];
+        while (fgets(line, sizeof(line), f))
+        {
+            if (strstr(line, "i: energy ") == NULL)
+                continue;
+            double x[N], drain;
+            x[0] = 1;
+            bool ok = true;
+            for (int k = 0; k < ENERGY_STATES && ok; k++)
+            {
+                char key[16];
+                snprintf(key, sizeof(key), " %s=", energyStates[k]);
+                const char *p = strstr(line, key);
+                ok = p != NULL;
+                if (ok)
+                    x[k + 1] = atof(p + strlen(key)) / 100;
+            }
+            const char *p = strstr(line, "drain=");
+            if (!ok || p == NULL)
+                continue;
+            drain = atof(p + 6);
+
+            for (int r = 0; r < N; r++)
+            {
+                for (int c = 0; c < N; c++)
+                    ata[r][c] += x[r] * x[c];
+                atb[r] += x[r] * drain;
+                mean[r] += x[r];
+            }
+            rows++;
+        }
+        fclose(f);
+    }
+
+    if (rows < N)
+    {
+        fprintf(stderr, "%d energy reports, need at least %d\n", rows, N);
+        return 1;
+    }
+
+    // a little ridge so an activity that never varied does not blow up the fit
+    for (int r = 1; r < N; r++)
+        ata[r][r] += 1e-3 * ata[r][r] + 1e-9;
+
+    // Gauss-Jordan on the normal equations
+    double coef[N];
+    for (int c = 0; c < N; c++)
+    {
+        int pivot = c;
+        for (int r = c + 1; r < N; r++)
+            if (fabs(ata[r][c]) > fabs(ata[pivot][c]))
+                pivot = r;
+        std::swap(ata[c], ata[pivot]);
+        std::swap(atb[c], atb[pivot]);
+        for (int r = 0; r < N; r++)
+        {
+            if (r == c || ata[c][c] == 0)
+                continue;
+            double m = ata[r][c] / ata[c][c];
+            for (int k = c; k < N; k++)
+                ata[r][k] -= m * ata[c][k];
+            atb[r] -= m * atb[c];
+        }
+    }
+    for (int c = 0; c < N; c++)
+        coef[c] = ata[c][c] != 0 ? atb[c] / ata[c][c] : 0;
+    for (int c = 0; c < N; c++)
+        mean[c] /= rows;
+
+    auto predict = [&](int without)
+    {
+        double mA = coef[0];
+        for (int k = 0; k < ENERGY_STATES; k++)
+            if (k != without)
+                mA += coef[k + 1] * mean[k + 1];
+        return mA;
+    };
+
+    printf("%d reports, battery %.0f mAh\n", rows, capacity);
+    printf("%-10s %10s %12s\n", "state", "mA at 100%", "avg share %");
+    printf("%-10s %10.1f %12s\n", "base", coef[0], "-");
+    for (int k = 0; k < ENERGY_STATES; k++)
+        printf("%-10s %+10.1f %12.2f\n", energyStates[k], coef[k + 1], mean[k + 1] * 100);
+
+    double avg = predict(-1);
+    printf("\naverage mix: %.1f mA, %.1f h from full\n", avg, avg > 0 ? capacity / avg : 0);
+    for (int k = 0; k < ENERGY_STATES; k++)
+    {
+        double mA = predict(k);
+        printf("  without %-7s %.1f mA, %.1f h\n", energyStates[k], mA, mA > 0 ? capacity / mA : 0);
+    }
+    return 0;
+}
+
+// ---- report ----
+
+struct Monitored
+{
+    const char *name;
+    const ColoredRange *ranges;
+    const int *numRanges;
+    LogField field;
+};
+
+static const Monitored monitored[] = {
+    {"oilTemp", oilTempRange, &oilTempRangeNum, F_OIL_TEMP},
+    {"oilPress", oilPressRange, &oilPressRangeNum, F_OIL_PRESS},
+    {"fuelPress", fuelPressRange, &fuelPressRangeNum, F_FUEL_PRESS},
+    {"fuelQty", fuelQTYRange, &fuelQTYRangeNum, F_FUEL_LITRES},
+};
+#define MONITORED (sizeof(monitored) / sizeof(monitored[0]))
+
+// Time spent in a red band of the gauge.
+struct Exceedance
+{
+    uint32_t events = 0;
+    double seconds = 0;
+    float low = 0, high = 0;
+    bool inside = false;
+    bool startsInside = false;
+
+    void add(float value, bool red, double dt, bool first)
+    {
+        if (red)
+        {
+            if (!inside)
+                events++;
+            if (events == 1 && !inside)
+                low = high = value;
+            low = std::min(low, value);
+            high = std::max(high, value);
+            seconds += dt;
+        }
+        if (first)
+            startsInside = red;
+        inside = red;
+    }
+
+    void merge(const Exceedance &next)
+    {
+        if (next.events == 0)
+        {
+            inside = false;
+            return;
+        }
+        low = events ? std::min(low, next.low) : next.low;
+        high = events ? std::max(high, next.high) : next.high;
+        // an exceedance running across the join is one event, not two
+        events += next.events - (inside && next.startsInside ? 1 : 0);
+        seconds += next.seconds;
+        inside = next.inside;
+    }
+};
+
+// Everything reported for one flight. All of it can be merged, so a flight
+// cut in two by journal rotation is joined back after the parallel pass.
+struct FlightReport
+{
+    const char *file = nullptr;
+    int32_t startTime = 0; // RTC seconds
+    int32_t endTime = 0;
+    uint64_t samples = 0;
+    ChannelStats stats[FLIGHT_CHANNELS];
+    // least squares sums for the oil temperature trend, t in hours from startTime
+    double st = 0, sy = 0, stt = 0, sty = 0;
+    float fuelFirst = 0, fuelLast = 0;
+    Exceedance exceed[MONITORED];
+    bool open = false;          // engine still running at the end of the file
+    bool fromFileStart = false; // engine already running in the first sample
+
+    FlightReport()
+    {
+        for (ChannelStats &s : stats)
+            s.reset();
+    }
+
+    void add(const PackedRecord &r, double dt)
+    {
+        static const LogField channelField[FLIGHT_CHANNELS] = {
+            F_BATTERY_VOLTAGE, F_AMP, F_FUEL_LITRES, F_FUEL_PRESS, F_OIL_TEMP, F_OIL_PRESS, F_CHT1};
+
+        bool first = samples == 0;
+        if (first)
+        {
+            startTime = r.v[F_TIME];
+            fuelFirst = logValue(r, F_FUEL_LITRES);
+        }
+        endTime = r.v[F_TIME];
+        fuelLast = logValue(r, F_FUEL_LITRES);
+        samples++;
+
+        for (int i = 0; i < FLIGHT_CHANNELS; i++)
+            stats[i].add(logValue(r, channelField[i]));
+
+        double t = (r.v[F_TIME] - startTime) / 3600.0;
+        double y = logValue(r, F_OIL_TEMP);
+        st += t;
+        sy += y;
+        stt += t * t;
+        sty += t * y;
+
+        for (size_t i = 0; i < MONITORED; i++)
+        {
+            const Monitored &m = monitored[i];
+            float value = logValue(r, m.field);
+            exceed[i].add(value, getColorForValue(m.ranges, *m.numRanges, value) == RED, dt, first);
+        }
+    }
+
+    void merge(const FlightReport &next)
+    {
+        if (next.samples == 0)
+            return;
+        if (samples == 0)
+        {
+            bool keepStart = fromFileStart;
+            const char *keepFile = file;
+            *this = next;
+            fromFileStart = keepStart;
+            file = keepFile ? keepFile : next.file;
+            return;
+        }
+
+        // shift next's sums onto this flight's time origin
+        double d = (next.startTime - startTime) / 3600.0;
+        double n = (double)next.samples;
+        stt += next.stt + 2 * d * next.st + n * d * d;
+        sty += next.sty + d * next.sy;
+        st += next.st + n * d;
+        sy += next.sy;
+
+        for (int i = 0; i < FLIGHT_CHANNELS; i++)
+            stats[i].merge(next.stats[i]);
+        for (size_t i = 0; i < MONITORED; i++)
+            exceed[i].merge(next.exceed[i]);
+
+        samples += next.samples;
+        endTime = next.endTime;
+        fuelLast = next.fuelLast;
+        open = next.open;
+    }
+
+    double oilTempTrend() const
+    {
+        double n = (double)samples;
+        double den = n * stt - st * st;
+        return den > 1e-12 ? (n * sty - st * sy) / den : 0;
+    }
+};
+
+struct FileResult
+{
+    std::vector<FlightReport> flights;
+    uint64_t records = 0;
+    uint64_t bytes = 0;
+};
+
+// Splits one file into flights. Samples from arming onwards count towards the
+// flight. Samples after the engine stops are held back and only kept if it
+// starts again before the detector gives up, so a shutdown's zero oil pressure
+// is not reported as an exceedance.
+static void analyse(const char *path, FileResult &result)
+{
+    MappedFile file;
+    if (!file.open(path))
+        return;
+    result.bytes = file.size;
+
+    FlightDetector detector;
+    FlightReport current, tail;
+    bool tracking = false;
+    bool firstRecord = true;
+    uint64_t lastMs = 0;
+
+    forEachRecord(file, [&](const PackedRecord &r)
+                  {
+                      result.records++;
+                      // older logs have no ms column, fall back to the RTC second
+                      uint64_t ms = r.v[F_MS] ? (uint32_t)r.v[F_MS] : (uint64_t)r.v[F_TIME] * 1000;
+                      double dt = firstRecord || ms < lastMs ? 0 : std::min((ms - lastMs) / 1000.0, 1.0);
+                      lastMs = ms;
+                      float oilPress = logValue(r, F_OIL_PRESS);
+                      bool oilError = r.v[F_FLAGS] & LOG_FLAG_OIL_PRESS;
+
+                      switch (detector.update(ms, oilPress, oilError))
+                      {
+                      case FLIGHT_ARMED:
+                          current = FlightReport();
+                          current.file = path;
+                          current.fromFileStart = firstRecord;
+                          tracking = true;
+                          break;
+                      case FLIGHT_DISARMED:
+                          tracking = false;
+                          break;
+                      case FLIGHT_STOPPED:
+                          result.flights.push_back(current);
+                          tail = FlightReport();
+                          tracking = false;
+                          break;
+                      default:
+                          break;
+                      }
+                      firstRecord = false;
+
+                      if (!tracking)
+                          return;
+                      bool running = !oilError && oilPress > FLIGHT_OIL_OFF;
+                      if (!detector.inFlight() || running)
+                      {
+                          if (tail.samples)
+                          {
+                              current.merge(tail);
+                              tail = FlightReport();
+                          }
+                          current.add(r, dt);
+                      }
+                      else
+                      {
+                          tail.add(r, dt);
+                      }
+                  });
+
+    if (detector.inFlight())
+    {
+        current.open = true;
+        result.flights.push_back(current);
+    }
+}
+
+static bool hasLogExtension(const char *name)
+{
+    size_t len = strlen(name);
+    return len > 4 && (strcasecmp(name + len - 4, ".log") == 0 || strcasecmp(name + len - 4, ".csv") == 0);
+}
+
+static void collect(const std::string &path, std::vector<std::string> &files)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+    {
+        perror(path.c_str());
+        return;
+    }
+    if (!S_ISDIR(st.st_mode))
+    {
+        files.push_back(path);
+        return;
+    }
+
+    DIR *dir = opendir(path.c_str());
+    if (!dir)
+        return;
+    while (struct dirent *entry = readdir(dir))
+    {
+        if (entry->d_name[0] == '.')
+            continue;
+        std::string child = path + "/" + entry->d_name;
+        if (stat(child.c_str(), &st) != 0)
+            continue;
+        if (S_ISDIR(st.st_mode))
+            collect(child, files);
+        else if (hasLogExtension(entry->d_name))
+            files.push_back(child);
+    }
+    closedir(dir);
+}
+
+static void printFlight(const FlightReport &f, int n)
+{
+    char start[20];
+    logSecondsToTime(f.startTime, start, sizeof(start));
+    int32_t s = f.endTime - f.startTime;
+    double hours = s / 3600.0;
+    const char *name = strrchr(f.file, '/') ? strrchr(f.file, '/') + 1 : f.file;
+
+    printf("%s flight %d: %s, %d:%02d:%02d, %llu samples%s\n",
+           name, n, start, s / 3600, s / 60 % 60, s % 60,
+           (unsigned long long)f.samples, f.open ? " (log ends in flight)" : "");
+    printf("  oil temp max %.1f C mean %.1f C trend %+.1f C/h, oil press %.2f..%.2f bar, cht max %.0f C, fuel burn %.1f L/h\n",
+           f.stats[CH_OIL_TEMP].max, f.stats[CH_OIL_TEMP].summary().mean, f.oilTempTrend(),
+           f.stats[CH_OIL_PRESS].min, f.stats[CH_OIL_PRESS].max, f.stats[CH_CHT1].max,
+           hours > 0 ? (f.fuelFirst - f.fuelLast) / hours : 0.0);
+
+    printf("  exceedances:");
+    bool any = false;
+    for (size_t i = 0; i < MONITORED; i++)
+    {
+        const Exceedance &e = f.exceed[i];
+        if (e.events == 0)
+            continue;
+        printf(" %s %ux %.1f s (%.2f..%.2f)", monitored[i].name, e.events, e.seconds, e.low, e.high);
+        any = true;
+    }
+    printf(any ? "\n" : " none\n");
+}
+
+static int report(int argc, char **argv)
+{
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::string> files;
+
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            threads = std::max(1, atoi(argv[++i]));
+        else
+            collect(argv[i], files);
+    }
+    if (files.empty())
+        usage();
+    // journals are named by RTC time, so this also puts each card in order
+    std::sort(files.begin(), files.end());
+
+    double start = nowSeconds();
+    std::vector<FileResult> results(files.size());
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < std::min<size_t>(threads, files.size()); t++)
+        workers.emplace_back([&]()
+                             {
+                                 size_t i;
+                                 while ((i = next++) < files.size())
+                                     analyse(files[i].c_str(), results[i]);
+                             });
+    for (std::thread &w : workers)
+        w.join();
+
+    // join flights that rotation split across consecutive files
+    std::vector<FlightReport> flights;
+    uint64_t records = 0, bytes = 0;
+    for (FileResult &result : results)
+    {
+        records += result.records;
+        bytes += result.bytes;
+        for (size_t i = 0; i < result.flights.size(); i++)
+        {
+            FlightReport &f = result.flights[i];
+            if (i == 0 && f.fromFileStart && !flights.empty() && flights.back().open &&
+                f.startTime - flights.back().endTime <= FLIGHT_STOP_MS / 1000 + 1)
+                flights.back().merge(f);
+            else
+                flights.push_back(f);
+        }
+    }
+    double elapsed = nowSeconds() - start;
+
+    for (size_t i = 0; i < flights.size(); i++)
+        printFlight(flights[i], (int)i + 1);
+
+    fprintf(stderr, "%zu files, %.1f MB, %llu records, %zu flights in %.2f s (%.0f MB/s, %zu threads)\n",
+            files.size(), bytes / 1e6, (unsigned long long)records, flights.size(),
+            elapsed, bytes / 1e6 / elapsed, workers.size());
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc >= 2 && strcmp(argv[1], "clocksim") == 0)
+        return clockSim(argc > 2 ? atof(argv[2]) : 40, argc > 3 ? atof(argv[3]) : 3,
+                        argc > 4 ? atof(argv[4]) : 10);
+    if (argc >= 2 && strcmp(argv[1], "listensim") == 0)
+        return listenSim(argc > 2 ? atof(argv[2]) : 100, argc > 3 ? atof(argv[3]) : 2,
+                         argc > 4 ? atof(argv[4]) : 5);
+    if (argc >= 2 && strcmp(argv[1], "wheelsim") == 0)
+        return wheelSim(argc > 2 ? atoi(argv[2]) : 1000, argc > 3 ? atof(argv[3]) : 6);
+    if (argc >= 2 && strcmp(argv[1], "telnetbench") == 0)
+        return telnetBench(argc > 2 ? atof(argv[2]) : 64);
+    if (argc >= 2 && strcmp(argv[1], "binlogbench") == 0)
+        return binLogBench(argc > 2 ? atoi(argv[2]) : 4000000);
+    if (argc >= 2 && strcmp(argv[1], "ringstress") == 0)
+        return ringStress(argc > 2 ? atoi(argv[2]) : 4000000, argc > 3 ? atof(argv[3]) : 50);
+    if (argc < 3)
+        usage();
+
+    if (strcmp(argv[1], "flights") == 0)
+        return listFlights(argv[2]);
+    if (strcmp(argv[1], "decode") == 0)
+        return decode(argv[2]);
+    if (strcmp(argv[1], "bench") == 0)
+        return bench(argc - 2, argv + 2);
+    if (strcmp(argv[1], "report") == 0)
+        return report(argc - 2, argv + 2);
+    if (strcmp(argv[1], "energy") == 0)
+        return energyModel(argc - 2, argv + 2);
+    if (strcmp(argv[1], "boot") == 0)
+        return bootSummary(argc - 2, argv + 2);
+    if (strcmp(argv[1], "seek") == 0 && argc >= 4)
+        return seek(argv[2], argv[3], argc > 4 ? atol(argv[4]) : 20);
+
+    usage();
+    return 2;
+}